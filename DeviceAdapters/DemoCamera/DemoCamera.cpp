@@ -186,6 +186,8 @@ CDemoCamera::CDemoCamera() :
    CCameraBase<CDemoCamera> (),
    initialized_(false),
    readoutUs_(0.0),
+   maxFrameRate_(false),
+   readoutFreeMs_(0.0),
    scanMode_(1),
    bitDepth_(8),
    roiX_(0),
@@ -193,7 +195,6 @@ CDemoCamera::CDemoCamera() :
 {
    // call the base class method to set-up default error codes/messages
    InitializeDefaultErrorMessages();
-   readoutStartTime_ = GetCurrentMMTime();
 }
 
 /**
@@ -322,6 +323,26 @@ int CDemoCamera::Initialize()
    nRet = CreateProperty(MM::g_Keyword_ReadoutTime, "0", MM::Float, false, pAct);
    assert(nRet == DEVICE_OK);
 
+   // overlap of exposure and readout in sequence acquisition
+   pAct = new CPropertyAction (this, &CDemoCamera::OnPipelinedReadout);
+   nRet = CreateProperty("PipelinedReadout", "0", MM::Integer, false, pAct);
+   assert(nRet == DEVICE_OK);
+   AddAllowedValue("PipelinedReadout", "0");
+   AddAllowedValue("PipelinedReadout", "1");
+
+   // no simulated exposure and readout times, for throughput tests
+   pAct = new CPropertyAction (this, &CDemoCamera::OnMaxFrameRate);
+   nRet = CreateProperty("MaxFrameRate", "0", MM::Integer, false, pAct);
+   assert(nRet == DEVICE_OK);
+   AddAllowedValue("MaxFrameRate", "0");
+   AddAllowedValue("MaxFrameRate", "1");
+
+   // threads filling the rows of the synthetic image
+   pAct = new CPropertyAction (this, &CDemoCamera::OnGeneratorThreads);
+   nRet = CreateProperty("GeneratorThreads", "1", MM::Integer, false, pAct);
+   assert(nRet == DEVICE_OK);
+   SetPropertyLimits("GeneratorThreads", 1, 16);
+
    // synchronize all properties
    // --------------------------
    nRet = UpdateStatus();
@@ -362,13 +383,35 @@ int CDemoCamera::Shutdown()
 */
 int CDemoCamera::SnapImage()
 {
-   MM::MMTime startTime = GetCurrentMMTime();
-   double exp = GetExposure();
-   double expUs = exp * 1000.0;
-   GenerateSyntheticImage(img_, exp);
+   // the image is generated at readout, directly into its destination
+   PendingFrame frame;
+   frame.exposure = GetExposure();
+   frame.readoutDoneMs = 0.0;
 
-   while (GetCurrentMMTime() - startTime < MM::MMTime(expUs)) {}
-   readoutStartTime_ = GetCurrentMMTime();
+   if (!maxFrameRate_)
+   {
+      // The sensor is modelled as a frame transfer device: the exposure
+      // starts at once, but its charge can be shifted into the readout
+      // register only after the previous image has been read out.
+      double transferMs = CDeviceUtils::GetMonotonicTimeMs() + frame.exposure;
+      {
+         MMThreadGuard guard(pendingLock_);
+         if (transferMs < readoutFreeMs_)
+            transferMs = readoutFreeMs_;
+         readoutFreeMs_ = transferMs + readoutUs_ / 1000.0;
+         frame.readoutDoneMs = readoutFreeMs_;
+      }
+      SleepUntil(transferMs);
+   }
+
+   // only a pipelined sequence reads out the previous exposure after this
+   // one has been taken, otherwise an unread exposure is simply replaced
+   MMThreadGuard guard(pendingLock_);
+   if (!(IsCapturing() && IsPipelinedReadout()))
+      pendingFrames_.clear();
+   else if (pendingFrames_.size() >= 2)
+      pendingFrames_.pop_front();
+   pendingFrames_.push_back(frame);
 
    return DEVICE_OK;
 }
@@ -386,12 +429,70 @@ int CDemoCamera::SnapImage()
 */
 const unsigned char* CDemoCamera::GetImageBuffer()
 {
-   MM::MMTime curTime = GetCurrentMMTime();
-   MM::MMTime readoutTime(readoutUs_);
-   while (readoutTime > (curTime - readoutStartTime_)) {}
+   PendingFrame frame;
+   if (PopPendingFrame(frame))
+   {
+      SleepUntil(frame.readoutDoneMs);
+      GenerateSyntheticImage(const_cast<unsigned char*>(img_.GetPixels()), img_.Width(), img_.Height(), img_.Depth(), frame.exposure);
+   }
    return img_.GetPixels();
 }
 
+/**
+* Reads out the last snapped image directly into the circular buffer slot.
+* Called by the base class during sequence acquisition.
+*/
+int CDemoCamera::GetImageInto(unsigned char* pBuf)
+{
+   PendingFrame frame;
+   if (PopPendingFrame(frame))
+   {
+      SleepUntil(frame.readoutDoneMs);
+      GenerateSyntheticImage(pBuf, img_.Width(), img_.Height(), img_.Depth(), frame.exposure);
+   }
+   else
+      memcpy(pBuf, img_.GetPixels(), img_.Width() * img_.Height() * img_.Depth());
+   return DEVICE_OK;
+}
+
+/**
+* Starts the sequence acquisition of the base class, discarding a snapped
+* image that was never read out, so that it does not become the first frame.
+*/
+int CDemoCamera::StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow)
+{
+   if (!IsCapturing())
+   {
+      MMThreadGuard guard(pendingLock_);
+      pendingFrames_.clear();
+   }
+   return CCameraBase<CDemoCamera>::StartSequenceAcquisition(numImages, interval_ms, stopOnOverflow);
+}
+
+/**
+* Takes the oldest exposure that has not been read out yet.
+*/
+bool CDemoCamera::PopPendingFrame(PendingFrame& frame)
+{
+   MMThreadGuard guard(pendingLock_);
+   if (pendingFrames_.empty())
+      return false;
+   frame = pendingFrames_.front();
+   pendingFrames_.pop_front();
+   return true;
+}
+
+/**
+* Sleeps until the monotonic clock reaches the given time, with the
+* millisecond resolution of the system sleep.
+*/
+void CDemoCamera::SleepUntil(double monotonicMs)
+{
+   double remainingMs;
+   while ((remainingMs = monotonicMs - CDeviceUtils::GetMonotonicTimeMs()) > 0.0)
+      CDeviceUtils::SleepMs(remainingMs < 1.0 ? 1 : (long)remainingMs);
+}
+
 /**
 * Returns image buffer X-size in pixels.
 * Required by the MM::Camera API.
@@ -734,6 +835,69 @@ int CDemoCamera::OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct)
    return DEVICE_OK;
 }
 
+/**
+* Handles "PipelinedReadout" property.
+*/
+int CDemoCamera::OnPipelinedReadout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      if (IsCapturing())
+         return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+      long pipelined;
+      pProp->Get(pipelined);
+      SetPipelinedReadout(pipelined != 0);
+   }
+   else if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(IsPipelinedReadout() ? 1L : 0L);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+* Handles "MaxFrameRate" property.
+*/
+int CDemoCamera::OnMaxFrameRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      long maxFrameRate;
+      pProp->Get(maxFrameRate);
+      maxFrameRate_ = maxFrameRate != 0;
+   }
+   else if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(maxFrameRate_ ? 1L : 0L);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+* Handles "GeneratorThreads" property.
+*/
+int CDemoCamera::OnGeneratorThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      if (IsCapturing())
+         return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+      long threads;
+      pProp->Get(threads);
+      generator_.SetThreads((unsigned)threads);
+   }
+   else if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long)generator_.GetThreads());
+   }
+
+   return DEVICE_OK;
+}
+
 /*
 * Handles "ScanMode" property.
 * Changes allowed Binning values to test whether the UI updates properly
@@ -783,53 +947,9 @@ int CDemoCamera::ResizeImageBuffer()
 /**
 * Generate a spatial sine wave.
 */
-void CDemoCamera::GenerateSyntheticImage(ImgBuffer& img, double exp)
+void CDemoCamera::GenerateSyntheticImage(unsigned char* pBuf, unsigned width, unsigned height, unsigned byteDepth, double exp)
 {
-   if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0)
-      return;
-
-   const double cPi = 3.14;
-   long lPeriod = img.Width()/2;
-   static double dPhase = 0.0;
-   double dLinePhase = 0.0;
-   const double dAmp = exp;
-   const double cLinePhaseInc = 2.0 * cPi / 4.0 / img.Height();
-
-
-   long maxValue = 1 << bitDepth_;
-
-   unsigned j, k;
-   if (img.Depth() == 1)
-   {
-      double pedestal = 127 * exp / 100.0;
-      unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
-      for (j=0; j<img.Height(); j++)
-      {
-         for (k=0; k<img.Width(); k++)
-         {
-            long lIndex = img.Width()*j + k;
-            *(pBuf + lIndex) = (unsigned char) min(255.0, (pedestal + dAmp * sin(dPhase + dLinePhase + (2.0 * cPi * k) / lPeriod)));
-         }
-         dLinePhase += cLinePhaseInc;
-      }         
-   }
-   else if (img.Depth() == 2)
-   {
-      double pedestal = maxValue/2 * exp / 100.0;
-      double dAmp16 = dAmp * maxValue/255.0; // scale to behave like 8-bit
-      unsigned short* pBuf = (unsigned short*) const_cast<unsigned char*>(img.GetPixels());
-      for (j=0; j<img.Height(); j++)
-      {
-         for (k=0; k<img.Width(); k++)
-         {
-            long lIndex = img.Width()*j + k;
-            *(pBuf + lIndex) = (unsigned short) min((double)maxValue, pedestal + dAmp16 * sin(dPhase + dLinePhase + (2.0 * cPi * k) / lPeriod));
-         }
-         dLinePhase += cLinePhaseInc;
-      }         
-   }
-
-   dPhase += cPi / 4.0;
+   generator_.Generate(pBuf, width, height, byteDepth, exp, (1 << bitDepth_) - 1);
 }
 
 
@@ -32,9 +32,11 @@
 
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/ImgBuffer.h"
+#include "../../MMDevice/SyntheticImage.h"
 #include "../../MMDevice/DeviceThreads.h"
 #include <string>
 #include <map>
+#include <deque>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -64,6 +66,8 @@ public:
    // ------------
    int SnapImage();
    const unsigned char* GetImageBuffer();
+   int GetImageInto(unsigned char* pBuf);
+   int StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow);
    unsigned GetImageWidth() const;
    unsigned GetImageHeight() const;
    unsigned GetImageBytesPerPixel() const;
@@ -86,6 +90,9 @@ public:
    int OnBitDepth(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnScanMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPipelinedReadout(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMaxFrameRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnGeneratorThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
    int SetAllowedBinning();
@@ -93,15 +100,29 @@ private:
    static const double nominalPixelSizeUm_;
 
    ImgBuffer img_;
+   SyntheticImageGenerator generator_;
    bool initialized_;
    double readoutUs_;
-   MM::MMTime readoutStartTime_;
+   bool maxFrameRate_;
+
+   // exposures waiting for readout; with pipelined readout the next frame
+   // is exposed while the previous one is still being read out
+   struct PendingFrame
+   {
+      double readoutDoneMs; // monotonic time at which the image is read out
+      double exposure;
+   };
+   std::deque<PendingFrame> pendingFrames_;
+   double readoutFreeMs_; // monotonic time at which the readout register is free
+   MMThreadLock pendingLock_;
    long scanMode_;
    int bitDepth_;
    unsigned roiX_;
    unsigned roiY_;
 
-   void GenerateSyntheticImage(ImgBuffer& img, double exp);
+   bool PopPendingFrame(PendingFrame& frame);
+   static void SleepUntil(double monotonicMs);
+   void GenerateSyntheticImage(unsigned char* pBuf, unsigned width, unsigned height, unsigned byteDepth, double exp);
    int ResizeImageBuffer();
 };
 
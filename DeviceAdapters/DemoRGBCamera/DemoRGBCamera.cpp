@@ -858,7 +858,7 @@ int DemoRGBCamera::StartSequenceAcquisition(long numImages, double interval_ms,
       return ret;
 
    // make sure the circular buffer is properly sized
-   GetCoreCallback()->InitializeImageBuffer(1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
+   GetCoreCallback()->InitializeImageBuffer(this, 1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
 
    double actualIntervalMs = max(GetExposure(), interval_ms);
    SetProperty(MM::g_Keyword_ActualInterval_ms, CDeviceUtils::ConvertToString(actualIntervalMs)); 
@@ -798,48 +798,7 @@ int DemoStreamingCamera::ResizeImageBuffer(int imageSizeW, int imageSizeH, int b
 */
 void DemoStreamingCamera::GenerateSyntheticImage(ImgBuffer& img, double exp)
 {
-   if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0)
-      return;
-
-   const double cPi = 3.14;
-   long lPeriod = img.Width()/2;
-   static double dPhase = 0.0;
-   double dLinePhase = 0.0;
-   const double dAmp = exp;
-   const double cLinePhaseInc = 2.0 * cPi / 4.0 / img.Height();
-
-   unsigned j, k;
-   if (img.Depth() == 1)
-   {
-      double pedestal = 127 * exp / 100.0;
-      unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
-      for (j=0; j<img.Height(); j++)
-      {
-         for (k=0; k<img.Width(); k++)
-         {
-            long lIndex = img.Width()*j + k;
-            *(pBuf + lIndex) = (unsigned char) min(255.0, (pedestal + dAmp * sin(dPhase + dLinePhase + (2.0 * cPi * k) / lPeriod)));
-         }
-         dLinePhase += cLinePhaseInc;
-      }         
-   }
-   else if (img.Depth() == 2)
-   {
-      double pedestal = USHRT_MAX/2 * exp / 100.0;
-      double dAmp16 = dAmp * USHRT_MAX/255.0; // scale to behave like 8-bit
-      unsigned short* pBuf = (unsigned short*) const_cast<unsigned char*>(img.GetPixels());
-      for (j=0; j<img.Height(); j++)
-      {
-         for (k=0; k<img.Width(); k++)
-         {
-            long lIndex = img.Width()*j + k;
-            *(pBuf + lIndex) = (unsigned short) min((double)USHRT_MAX, pedestal + dAmp16 * sin(dPhase + dLinePhase + (2.0 * cPi * k) / lPeriod));
-         }
-         dLinePhase += cLinePhaseInc;
-      }         
-   }
-
-   dPhase += cPi / 4.0;
+   generator_.Generate(const_cast<unsigned char*>(img.GetPixels()), img.Width(), img.Height(), img.Depth(), exp, USHRT_MAX);
 }
 
 
@@ -862,7 +821,7 @@ int DemoStreamingCamera::StartSequenceAcquisition(long numImages, double interva
       return ret;
 
    // make sure the circular buffer is properly sized
-   GetCoreCallback()->InitializeImageBuffer(GetNumberOfChannels(), 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
+   GetCoreCallback()->InitializeImageBuffer(this, GetNumberOfChannels(), 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
 
    double actualIntervalMs = max(GetExposure(), interval_ms);
    SetProperty(MM::g_Keyword_ActualInterval_ms, CDeviceUtils::ConvertToString(actualIntervalMs)); 
@@ -28,6 +28,7 @@
 
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/ImgBuffer.h"
+#include "../../MMDevice/SyntheticImage.h"
 #include "../../MMDevice/DeviceThreads.h"
 #include <string>
 #include <map>
@@ -111,6 +112,7 @@ private:
    unsigned char* rawBuffer_;
    bool stopOnOverflow_;
    MMThreadLock rawBufferLock_;
+   SyntheticImageGenerator generator_;
 
    void GenerateSyntheticImage(ImgBuffer& img, double exp);
 
@@ -125,6 +127,8 @@ private:
 
 };
 
+class NoiseRowThread;
+
 //////////////////////////////////////////////////////////////////////////////
 // DemoNoiseProcessor class
 // Demonstration of the image processor module.
@@ -146,14 +150,26 @@ public:
    // ImageProcessor API
    // ------------------
    int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   int ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                   unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth);
 
    // action interface
    // ----------------
    int OnStdDev(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
+   void AddNoiseToFrame(const unsigned char* src, unsigned char* dst, unsigned width, unsigned height, unsigned byteDepth);
+   void StartWorkers(long threads);
+   void StopWorkers();
+
    bool initialized_;
    double stdDev_;
+   long threads_;
+   unsigned seed_;
+   unsigned frameCount_;
+   std::vector<NoiseRowThread*> workers_; // threads_ - 1, the caller processes the first band
+   MMThreadSemaphore bandsDone_;
 };
 
 //////////////////////////////////////////////////////////////////////////////
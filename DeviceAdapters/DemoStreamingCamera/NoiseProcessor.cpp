@@ -30,39 +30,126 @@
 extern const char* g_NoiseProcessorName;
 const char* g_StdDevProp = "StdDev";
 
-double noise1(double ampl)
-{
-   /* Setup constants */
-   const static int q = 15;
-   const static double c1 = (1 << q) - 1;
-   const static double c2 = ((int)(c1 / 3)) + 1;
-   const static double c3 = 1.0 / c1;
+// standard deviation of the sum of four independent bytes, sqrt(4 * (256^2 - 1) / 12)
+const float cByteSumStdDev = 147.8006f;
 
-   /* random number in range 0 - 1 not including 1 */
-   static double random = 0.0;
+/**
+ * Integer hash with good avalanche (lowbias32), used as a counter-based
+ * random number generator: the random word of a pixel depends only on its
+ * index and the frame key, so any range of pixels can be processed
+ * independently and the loop has no carried state.
+ */
+static inline unsigned HashCounter(unsigned x)
+{
+   x ^= x >> 16;
+   x *= 0x7feb352dU;
+   x ^= x >> 15;
+   x *= 0x846ca68bU;
+   x ^= x >> 16;
+   return x;
+}
 
-   /* the white noise */
-   static double noise = 0.0;
+/**
+ * Adds zero-mean noise to pixels [first, last), saturating at 0 and maxValue.
+ * The noise is the sum of the four bytes of a random word, which is close to
+ * Gaussian (Irwin-Hall distribution, n = 4), scaled to the standard deviation.
+ */
+template <class T>
+static void AddNoise(const T* pSrc, T* pDst, unsigned first, unsigned last, float stdDev, float maxValue, unsigned key)
+{
+   const float scale = stdDev / cByteSumStdDev;
+   for (unsigned i=first; i<last; i++)
+   {
+      unsigned r = HashCounter(i * 0x9e3779b9U + key);
+      int sum = (int)(r & 0xff) + (int)((r >> 8) & 0xff) + (int)((r >> 16) & 0xff) + (int)(r >> 24);
+      float val = pSrc[i] + (sum - 510) * scale + 0.5f;
+      val = val > 0.0f ? val : 0.0f;
+      val = val < maxValue ? val : maxValue;
+      pDst[i] = (T) val;
+   }
+}
 
-   random = ((float)rand() / (float)(RAND_MAX + 1));
-   noise = (2.0 * ((random * c2) + (random * c2) + (random * c2)) - 3.0 * (c2 - 1.0)) * c3;
+/**
+ * A range of pixels of one frame. Source and destination may be the same.
+ */
+struct NoiseJob
+{
+   const unsigned char* source;
+   unsigned char* buffer;
+   unsigned byteDepth;
+   unsigned first;
+   unsigned last;
+   float stdDev;
+   unsigned key;
+};
 
-   return ampl * noise;
+static void RunNoiseJob(const NoiseJob& job)
+{
+   if (job.byteDepth == 1)
+      AddNoise(job.source, job.buffer, job.first, job.last, job.stdDev, (float)UCHAR_MAX, job.key);
+   else
+      AddNoise((const unsigned short*) job.source, (unsigned short*) job.buffer, job.first, job.last, job.stdDev, (float)USHRT_MAX, job.key);
 }
 
+/**
+ * Worker owned by the processor for as long as the thread setting holds.
+ * Processes a band of rows each time a job is posted to it and reports
+ * completion on the processor's done semaphore.
+ */
+class NoiseRowThread : public MMDeviceThreadBase
+{
+public:
+   NoiseRowThread(MMThreadSemaphore* pDone) : done_(pDone), quit_(false) {}
+
+   int svc()
+   {
+      for (;;)
+      {
+         start_.Wait();
+         if (quit_)
+            break;
+         RunNoiseJob(job_);
+         done_->Post();
+      }
+      return 0;
+   }
+
+   void Start(const NoiseJob& job)
+   {
+      job_ = job;
+      start_.Post();
+   }
+
+   void Quit()
+   {
+      quit_ = true;
+      start_.Post();
+      wait();
+   }
+
+private:
+   MMThreadSemaphore start_;
+   MMThreadSemaphore* done_;
+   NoiseJob job_;
+   bool quit_;
+};
+
 DemoNoiseProcessor::DemoNoiseProcessor() : 
    initialized_(false),
-   stdDev_(50.0)
+   stdDev_(50.0),
+   threads_(1),
+   frameCount_(0)
 {
    // call the base class method to set-up default error codes/messages
    InitializeDefaultErrorMessages();
    
    /* Generate a new random seed from system time - do this once in your constructor */
-   srand((unsigned int)GetClockTicksUs());
+   seed_ = HashCounter((unsigned)GetClockTicksUs());
 }
 
 DemoNoiseProcessor::~DemoNoiseProcessor()
 {
+   StopWorkers();
 }
 
 /**
@@ -111,6 +198,12 @@ int DemoNoiseProcessor::Initialize()
    nRet = CreateProperty("StdDev", "50.0", MM::Float, false, pAct);
    assert(nRet == DEVICE_OK);
 
+   // threads
+   pAct = new CPropertyAction (this, &DemoNoiseProcessor::OnThreads);
+   nRet = CreateProperty("Threads", "1", MM::Integer, false, pAct);
+   assert(nRet == DEVICE_OK);
+   SetPropertyLimits("Threads", 1, 16);
+
    // synchronize all properties
    // --------------------------
    nRet = UpdateStatus();
@@ -127,6 +220,8 @@ int DemoNoiseProcessor::Initialize()
  */
 int DemoNoiseProcessor::Shutdown()
 {
+   StopWorkers();
+   threads_ = 1;
    initialized_ = false;
    return DEVICE_OK;
 }
@@ -137,40 +232,92 @@ int DemoNoiseProcessor::Shutdown()
  */
 int DemoNoiseProcessor::Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth)
 {
-   if (stdDev_ <= 0.0)
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+   if (stdDev_ <= 0.0 || width == 0 || height == 0)
       return DEVICE_OK; // no need to process
 
-   unsigned long size = width * height;
-   if (byteDepth == 1)
+   AddNoiseToFrame(buffer, buffer, width, height, byteDepth);
+   return DEVICE_OK;
+}
+
+/**
+ * Out-of-place variant: the noisy image is written straight to dst, which
+ * saves the copy done by the default implementation.
+ * Required by the MM::ImageProcessor API.
+ */
+int DemoNoiseProcessor::ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                                    unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth)
+{
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+   if (dstWidth != width || dstHeight != height || dstByteDepth != byteDepth)
+      return DEVICE_INCOMPATIBLE_IMAGE;
+   if (stdDev_ <= 0.0 || width == 0 || height == 0)
+   {
+      memcpy(dst, src, (size_t)width * height * byteDepth);
+      return DEVICE_OK;
+   }
+
+   AddNoiseToFrame(src, dst, width, height, byteDepth);
+   return DEVICE_OK;
+}
+
+/**
+ * Adds a new noise pattern to the frame, splitting the rows over the
+ * configured number of threads.
+ */
+void DemoNoiseProcessor::AddNoiseToFrame(const unsigned char* src, unsigned char* dst, unsigned width, unsigned height, unsigned byteDepth)
+{
+   NoiseJob job;
+   job.source = src;
+   job.buffer = dst;
+   job.byteDepth = byteDepth;
+   job.stdDev = (float)stdDev_;
+   job.key = HashCounter(seed_ + frameCount_++); // a new noise pattern for every frame
+
+   unsigned threads = (unsigned)workers_.size() + 1;
+   threads = threads < height ? threads : height;
+   unsigned rowsPerThread = (height + threads - 1) / threads;
+   unsigned bands = 0;
+   for (unsigned row = rowsPerThread; row < height; row += rowsPerThread)
    {
-      unsigned char* pBuf = (unsigned char*) buffer;
-      for (unsigned long i=0; i<size; i++)
-      {
-         double val = noise1(stdDev_);
-         if (val > UCHAR_MAX)
-            val = UCHAR_MAX;
-         if (val < 0.0)
-            val = 0.0;
-         pBuf[i] = pBuf[i] + (unsigned char) val; 
-      }
+      job.first = row * width;
+      job.last = (row + rowsPerThread < height ? row + rowsPerThread : height) * width;
+      workers_[bands++]->Start(job);
    }
-   else if (byteDepth == 2)
+
+   job.first = 0;
+   job.last = (rowsPerThread < height ? rowsPerThread : height) * width;
+   RunNoiseJob(job);
+
+   for (unsigned i=0; i<bands; i++)
+      bandsDone_.Wait();
+}
+
+/**
+ * Starts the row workers for the given number of threads, the calling
+ * thread being one of them.
+ */
+void DemoNoiseProcessor::StartWorkers(long threads)
+{
+   StopWorkers();
+   for (long i=1; i<threads; i++)
    {
-      unsigned short* pBuf = (unsigned short*) buffer;
-      for (unsigned long i=0; i<size; i++)
-      {
-         double val = noise1(stdDev_);
-         if (val > USHRT_MAX)
-            val = USHRT_MAX;
-         if (val < 0.0)
-            val = 0.0;
-         pBuf[i] = pBuf[i] + (unsigned short) val; 
-      }
+      NoiseRowThread* pWorker = new NoiseRowThread(&bandsDone_);
+      pWorker->activate();
+      workers_.push_back(pWorker);
    }
-   else
-      return ERR_UNSUPPORTED_IMAGE_TYPE;
+}
 
-   return DEVICE_OK;
+void DemoNoiseProcessor::StopWorkers()
+{
+   for (unsigned i=0; i<workers_.size(); i++)
+   {
+      workers_[i]->Quit();
+      delete workers_[i];
+   }
+   workers_.clear();
 }
 
 int DemoNoiseProcessor::OnStdDev(MM::PropertyBase* pProp, MM::ActionType eAct)
@@ -187,3 +334,24 @@ int DemoNoiseProcessor::OnStdDev(MM::PropertyBase* pProp, MM::ActionType eAct)
    return DEVICE_OK; 
 }
 
+int DemoNoiseProcessor::OnThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      long threads;
+      pProp->Get(threads);
+      if (threads < 1)
+         threads = 1;
+      if (threads != threads_)
+      {
+         threads_ = threads;
+         StartWorkers(threads_);
+      }
+   }
+   else if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(threads_);
+   }
+
+   return DEVICE_OK; 
+}
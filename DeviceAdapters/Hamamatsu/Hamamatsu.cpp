@@ -2030,7 +2030,7 @@ int CHamamatsu::StartSequenceAcquisition(long numImages, double interval_ms, boo
    }
 
    // make sure the circular buffer is properly sized
-   GetCoreCallback()->InitializeImageBuffer(1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
+   GetCoreCallback()->InitializeImageBuffer(this, 1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
 
    // start thread
    imageCounter_ = 0;
@@ -1661,7 +1661,7 @@ int QICamera::StartSequenceAcquisition(long numImages, double intervalMs, bool s
       return ret;
    }
    // make sure the circular buffer is properly sized
-   GetCoreCallback()->InitializeImageBuffer(1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
+   GetCoreCallback()->InitializeImageBuffer(this, 1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
 
    StartStreamingImages();
 
@@ -361,7 +361,7 @@ int ReportingManager::InitializeDebugStack(MM::Device * callee)
 		return ret;
 	}
 
-	if(!core_->InitializeImageBuffer(1,1,width_,height_,depth_))
+	if(!core_->InitializeImageBuffer(callee,1,1,width_,height_,depth_))
 	{
 		return DEVICE_ERR;
 	}
@@ -0,0 +1,557 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FlatField.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image processor subtracting a dark frame and correcting the
+//                pixel gain with a flat frame:
+//
+//                out = (in - dark) * mean(flat - dark) / (flat - dark)
+//
+//                The subtraction saturates at 0 and the result at the
+//                maximum of the pixel type. The gains are 16-bit fixed point
+//                numbers (up to 4.0), so 8 or 16 pixels are corrected per
+//                SSE2 instruction; other platforms run the same integer
+//                arithmetic one pixel at a time.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "Utilities.h"
+
+#ifdef WIN32
+   #include <malloc.h>
+#else
+   #include <stdlib.h>
+#endif
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+   #define FLATFIELD_SSE2
+   #include <emmintrin.h>
+#endif
+
+extern const char* g_DeviceNameFlatField;
+const char* g_ModeProp = "Mode";
+const char* g_ModeOff = "Off";
+const char* g_ModeCorrect = "Correct";
+const char* g_ModeAcquireDark = "Acquire Dark Frame";
+const char* g_ModeAcquireFlat = "Acquire Flat Frame";
+const char* g_ReferenceFramesProp = "ReferenceFrames";
+const char* g_DarkFrameProp = "DarkFrame";
+const char* g_FlatFrameProp = "FlatFrame";
+const char* g_NoReference = "None";
+
+const int gainShift = 14;                    // fractional bits of the gains
+const unsigned gainOne = 1 << gainShift;
+const size_t referenceAlignment = 64;        // cache line, covers SSE loads
+const size_t referencePadding = 16;          // pixels, a whole SSE2 step for any depth
+
+/**
+ * Corrects pixels [first, last) of a 16-bit image.
+ */
+static void Correct16(const unsigned short* src, unsigned short* dst, const unsigned short* dark, const unsigned short* gain, size_t first, size_t last)
+{
+   for (size_t i=first; i<last; i++)
+   {
+      unsigned v = src[i] > dark[i] ? src[i] - dark[i] : 0;
+      v = (v * gain[i]) >> gainShift;
+      dst[i] = (unsigned short)(v < 0xffff ? v : 0xffff);
+   }
+}
+
+/**
+ * Corrects pixels [first, last) of an 8-bit image.
+ */
+static void Correct8(const unsigned char* src, unsigned char* dst, const unsigned char* dark, const unsigned short* gain, size_t first, size_t last)
+{
+   for (size_t i=first; i<last; i++)
+   {
+      unsigned v = src[i] > dark[i] ? src[i] - dark[i] : 0;
+      v = (v * gain[i]) >> gainShift;
+      dst[i] = (unsigned char)(v < 0xff ? v : 0xff);
+   }
+}
+
+#ifdef FLATFIELD_SSE2
+/**
+ * (v * gain) >> gainShift of eight 16-bit lanes, and a mask of the lanes
+ * where the result does not fit into 16 bits.
+ */
+static inline __m128i MultiplyGain(__m128i v, __m128i g, __m128i& overflow)
+{
+   __m128i hi = _mm_mulhi_epu16(v, g);
+   __m128i lo = _mm_mullo_epi16(v, g);
+   overflow = _mm_subs_epu16(hi, _mm_set1_epi16((short)(gainOne - 1)));
+   return _mm_or_si128(_mm_slli_epi16(hi, 16 - gainShift), _mm_srli_epi16(lo, gainShift));
+}
+
+/**
+ * SSE2 version of Correct16(); the references are aligned, the images not
+ * necessarily.
+ */
+static void Correct16SSE2(const unsigned short* src, unsigned short* dst, const unsigned short* dark, const unsigned short* gain, size_t count)
+{
+   const __m128i zero = _mm_setzero_si128();
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+      v = _mm_subs_epu16(v, _mm_load_si128((const __m128i*)(dark + i)));
+      __m128i overflow;
+      __m128i r = MultiplyGain(v, _mm_load_si128((const __m128i*)(gain + i)), overflow);
+      // saturate: all bits set where the product overflowed
+      r = _mm_or_si128(r, _mm_xor_si128(_mm_cmpeq_epi16(overflow, zero), _mm_cmpeq_epi16(zero, zero)));
+      _mm_storeu_si128((__m128i*)(dst + i), r);
+   }
+   Correct16(src, dst, dark, gain, i, count);
+}
+
+/**
+ * SSE2 version of Correct8(). The 8-bit products can not overflow 16 bits,
+ * the final pack saturates them to 8 bits.
+ */
+static void Correct8SSE2(const unsigned char* src, unsigned char* dst, const unsigned char* dark, const unsigned short* gain, size_t count)
+{
+   const __m128i zero = _mm_setzero_si128();
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+      v = _mm_subs_epu8(v, _mm_load_si128((const __m128i*)(dark + i)));
+      __m128i overflow;
+      __m128i lo = MultiplyGain(_mm_unpacklo_epi8(v, zero), _mm_load_si128((const __m128i*)(gain + i)), overflow);
+      __m128i hi = MultiplyGain(_mm_unpackhi_epi8(v, zero), _mm_load_si128((const __m128i*)(gain + i + 8)), overflow);
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+   }
+   Correct8(src, dst, dark, gain, i, count);
+}
+#endif
+
+FlatFieldProcessor::FlatFieldProcessor() :
+   initialized_(false),
+   mode_(ModeOff),
+   referenceFrames_(10),
+   width_(0),
+   height_(0),
+   depth_(0),
+   pixels_(0),
+   dark_(0),
+   gain_(0),
+   hasDark_(false),
+   hasFlat_(false),
+   summedFrames_(0),
+   sumWidth_(0),
+   sumHeight_(0),
+   sumDepth_(0)
+{
+   InitializeDefaultErrorMessages();
+
+   SetErrorText(ERR_UNSUPPORTED_IMAGE_TYPE, "Only 8 and 16-bit images can be corrected");
+   SetErrorText(ERR_REFERENCE_MISMATCH, "Image size does not match the reference frames");
+   SetErrorText(ERR_OUT_OF_MEMORY, "Not enough memory for the reference frames");
+
+   // Name
+   CreateProperty(MM::g_Keyword_Name, g_DeviceNameFlatField, MM::String, true);
+
+   // Description
+   CreateProperty(MM::g_Keyword_Description, "Dark frame subtraction and flat field correction", MM::String, true);
+}
+
+FlatFieldProcessor::~FlatFieldProcessor()
+{
+   Shutdown();
+}
+
+void FlatFieldProcessor::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameFlatField);
+}
+
+int FlatFieldProcessor::Initialize()
+{
+   if (initialized_)
+      return DEVICE_OK;
+
+   CPropertyAction* pAct = new CPropertyAction (this, &FlatFieldProcessor::OnMode);
+   int ret = CreateProperty(g_ModeProp, g_ModeOff, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_ModeProp, g_ModeOff);
+   AddAllowedValue(g_ModeProp, g_ModeCorrect);
+   AddAllowedValue(g_ModeProp, g_ModeAcquireDark);
+   AddAllowedValue(g_ModeProp, g_ModeAcquireFlat);
+
+   // frames averaged into a new reference
+   pAct = new CPropertyAction (this, &FlatFieldProcessor::OnReferenceFrames);
+   ret = CreateProperty(g_ReferenceFramesProp, CDeviceUtils::ConvertToString(referenceFrames_), MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   SetPropertyLimits(g_ReferenceFramesProp, 1, 1000);
+
+   pAct = new CPropertyAction (this, &FlatFieldProcessor::OnDarkFrame);
+   ret = CreateProperty(g_DarkFrameProp, g_NoReference, MM::String, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &FlatFieldProcessor::OnFlatFrame);
+   ret = CreateProperty(g_FlatFrameProp, g_NoReference, MM::String, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int FlatFieldProcessor::Shutdown()
+{
+   MMThreadGuard guard(lock_);
+   FreeReferences();
+   sums_.clear();
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+/**
+ * Corrects the image in place, or adds it to the reference being acquired.
+ * Images are passed unchanged while a reference is acquired.
+ */
+int FlatFieldProcessor::Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth)
+{
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+
+   MMThreadGuard guard(lock_);
+   if (mode_ == ModeAcquireDark || mode_ == ModeAcquireFlat)
+   {
+      Accumulate(buffer, width, height, byteDepth);
+      if (summedFrames_ >= referenceFrames_ && !FinishReference())
+         return ERR_OUT_OF_MEMORY;
+      return DEVICE_OK;
+   }
+
+   if (mode_ != ModeCorrect || !(hasDark_ || hasFlat_))
+      return DEVICE_OK;
+   int ret = CheckCorrection(width, height, byteDepth);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   Correct(buffer, buffer);
+   return DEVICE_OK;
+}
+
+/**
+ * Writes the corrected image straight to dst.
+ */
+int FlatFieldProcessor::ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                                    unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth)
+{
+   if (dstWidth != width || dstHeight != height || dstByteDepth != byteDepth)
+      return DEVICE_INCOMPATIBLE_IMAGE;
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+
+   {
+      MMThreadGuard guard(lock_);
+      if (mode_ == ModeCorrect && (hasDark_ || hasFlat_))
+      {
+         int ret = CheckCorrection(width, height, byteDepth);
+         if (ret != DEVICE_OK)
+            return ret;
+         Correct(src, dst);
+         return DEVICE_OK;
+      }
+   }
+
+   memcpy(dst, src, (size_t)width * height * byteDepth);
+   return Process(dst, width, height, byteDepth);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int FlatFieldProcessor::OnMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      switch (mode_)
+      {
+         case ModeCorrect: pProp->Set(g_ModeCorrect); break;
+         case ModeAcquireDark: pProp->Set(g_ModeAcquireDark); break;
+         case ModeAcquireFlat: pProp->Set(g_ModeAcquireFlat); break;
+         default: pProp->Set(g_ModeOff); break;
+      }
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      MMThreadGuard guard(lock_);
+      if (val.compare(g_ModeCorrect) == 0)
+         mode_ = ModeCorrect;
+      else if (val.compare(g_ModeAcquireDark) == 0)
+         mode_ = ModeAcquireDark;
+      else if (val.compare(g_ModeAcquireFlat) == 0)
+         mode_ = ModeAcquireFlat;
+      else
+         mode_ = ModeOff;
+      summedFrames_ = 0; // a new acquisition starts from scratch
+   }
+   return DEVICE_OK;
+}
+
+int FlatFieldProcessor::OnReferenceFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(referenceFrames_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long frames;
+      pProp->Get(frames);
+      MMThreadGuard guard(lock_);
+      referenceFrames_ = frames > 0 ? frames : 1;
+   }
+   return DEVICE_OK;
+}
+
+int FlatFieldProcessor::OnDarkFrame(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Set(DescribeReference(hasDark_).c_str());
+   }
+   return DEVICE_OK;
+}
+
+int FlatFieldProcessor::OnFlatFrame(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Set(DescribeReference(hasFlat_).c_str());
+   }
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private methods
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Checks that the references, if any, fit the image.
+ */
+int FlatFieldProcessor::CheckCorrection(unsigned width, unsigned height, unsigned byteDepth) const
+{
+   if ((hasDark_ || hasFlat_) && (width != width_ || height != height_ || byteDepth != depth_))
+      return ERR_REFERENCE_MISMATCH;
+   return DEVICE_OK;
+}
+
+/**
+ * Corrects one image of the reference format; src and dst may be the same.
+ */
+void FlatFieldProcessor::Correct(const unsigned char* src, unsigned char* dst) const
+{
+#ifdef FLATFIELD_SSE2
+   if (depth_ == 1)
+      Correct8SSE2(src, dst, dark_, gain_, pixels_);
+   else
+      Correct16SSE2((const unsigned short*)src, (unsigned short*)dst, (const unsigned short*)dark_, gain_, pixels_);
+#else
+   if (depth_ == 1)
+      Correct8(src, dst, dark_, gain_, 0, pixels_);
+   else
+      Correct16((const unsigned short*)src, (unsigned short*)dst, (const unsigned short*)dark_, gain_, 0, pixels_);
+#endif
+}
+
+/**
+ * Adds the image to the 32-bit sums of the reference being acquired. A
+ * change of the image format restarts the sums.
+ */
+void FlatFieldProcessor::Accumulate(const unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth)
+{
+   size_t count = (size_t)width * height;
+   if (summedFrames_ == 0 || width != sumWidth_ || height != sumHeight_ || byteDepth != sumDepth_)
+   {
+      sums_.assign(count, 0);
+      summedFrames_ = 0;
+      sumWidth_ = width;
+      sumHeight_ = height;
+      sumDepth_ = byteDepth;
+   }
+
+   unsigned* pSums = &sums_[0];
+   if (byteDepth == 1)
+   {
+      for (size_t i=0; i<count; i++)
+         pSums[i] += buffer[i];
+   }
+   else
+   {
+      const unsigned short* pPix = (const unsigned short*)buffer;
+      for (size_t i=0; i<count; i++)
+         pSums[i] += pPix[i];
+   }
+   summedFrames_++;
+}
+
+/**
+ * Turns the sums into the reference being acquired and starts correcting.
+ * A reference of another format replaces both references.
+ */
+bool FlatFieldProcessor::FinishReference()
+{
+   if (sumWidth_ != width_ || sumHeight_ != height_ || sumDepth_ != depth_)
+   {
+      if (!AllocateReferences(sumWidth_, sumHeight_, sumDepth_))
+      {
+         mode_ = ModeOff;
+         return false;
+      }
+   }
+
+   const unsigned n = (unsigned)summedFrames_;
+   if (mode_ == ModeAcquireDark)
+   {
+      if (depth_ == 1)
+      {
+         for (size_t i=0; i<pixels_; i++)
+            dark_[i] = (unsigned char)((sums_[i] + n / 2) / n);
+      }
+      else
+      {
+         unsigned short* pDark = (unsigned short*)dark_;
+         for (size_t i=0; i<pixels_; i++)
+            pDark[i] = (unsigned short)((sums_[i] + n / 2) / n);
+      }
+      hasDark_ = true;
+   }
+   else
+   {
+      flat_.resize(pixels_);
+      for (size_t i=0; i<pixels_; i++)
+         flat_[i] = (unsigned short)((sums_[i] + n / 2) / n);
+      hasFlat_ = true;
+   }
+   ComputeGains();
+
+   sums_.clear();
+   summedFrames_ = 0;
+   mode_ = ModeCorrect;
+   return true;
+}
+
+/**
+ * Gain of each pixel relative to the mean of the dark subtracted flat frame.
+ */
+void FlatFieldProcessor::ComputeGains()
+{
+   if (!hasFlat_)
+   {
+      for (size_t i=0; i<pixels_; i++)
+         gain_[i] = (unsigned short)gainOne;
+      return;
+   }
+
+   std::vector<unsigned> net(pixels_);
+   double total = 0.0;
+   for (size_t i=0; i<pixels_; i++)
+   {
+      unsigned dark = depth_ == 1 ? dark_[i] : ((const unsigned short*)dark_)[i];
+      net[i] = flat_[i] > dark ? flat_[i] - dark : 1;
+      total += net[i];
+   }
+
+   double scale = (pixels_ > 0 ? total / pixels_ : 1.0) * gainOne;
+   for (size_t i=0; i<pixels_; i++)
+   {
+      double gain = scale / net[i] + 0.5;
+      gain_[i] = (unsigned short)(gain < 65535.0 ? gain : 65535.0);
+   }
+}
+
+/**
+ * Allocates empty references of the given format: no dark frame (zeros)
+ * and no flat frame (unit gains).
+ */
+bool FlatFieldProcessor::AllocateReferences(unsigned width, unsigned height, unsigned byteDepth)
+{
+   FreeReferences();
+
+   size_t pixels = (size_t)width * height;
+   size_t padded = (pixels + referencePadding - 1) / referencePadding * referencePadding;
+#ifdef WIN32
+   dark_ = (unsigned char*) _aligned_malloc(padded * byteDepth, referenceAlignment);
+   gain_ = (unsigned short*) _aligned_malloc(padded * sizeof(unsigned short), referenceAlignment);
+#else
+   void* p = 0;
+   if (posix_memalign(&p, referenceAlignment, padded * byteDepth) == 0)
+      dark_ = (unsigned char*) p;
+   p = 0;
+   if (posix_memalign(&p, referenceAlignment, padded * sizeof(unsigned short)) == 0)
+      gain_ = (unsigned short*) p;
+#endif
+   if (dark_ == 0 || gain_ == 0)
+   {
+      FreeReferences();
+      return false;
+   }
+
+   width_ = width;
+   height_ = height;
+   depth_ = byteDepth;
+   pixels_ = pixels;
+   memset(dark_, 0, padded * byteDepth);
+   for (size_t i=0; i<padded; i++)
+      gain_[i] = (unsigned short)gainOne;
+   return true;
+}
+
+void FlatFieldProcessor::FreeReferences()
+{
+#ifdef WIN32
+   _aligned_free(dark_);
+   _aligned_free(gain_);
+#else
+   free(dark_);
+   free(gain_);
+#endif
+   dark_ = 0;
+   gain_ = 0;
+   flat_.clear();
+   hasDark_ = false;
+   hasFlat_ = false;
+   width_ = 0;
+   height_ = 0;
+   depth_ = 0;
+   pixels_ = 0;
+}
+
+std::string FlatFieldProcessor::DescribeReference(bool present) const
+{
+   if (!present)
+      return g_NoReference;
+   std::ostringstream os;
+   os << width_ << "x" << height_ << ", " << depth_ * 8 << "-bit";
+   return os.str();
+}
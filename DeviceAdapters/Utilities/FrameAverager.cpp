@@ -0,0 +1,391 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameAverager.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image processor integrating N consecutive frames into 32-bit
+//                sums and emitting one frame per N: the average in the input
+//                pixel type, or the sum saturated to 16 bits. The output can
+//                be binned NxN in software. Frames are added 8 or 16 pixels
+//                per SSE2 step; other platforms add one pixel at a time.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "Utilities.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+   #define FRAMEAVERAGER_SSE2
+   #include <emmintrin.h>
+#endif
+
+extern const char* g_DeviceNameFrameAverager;
+const char* g_AveragerFramesProp = "Frames";
+const char* g_AveragerOutputProp = "Output";
+const char* g_OutputAverage = "Average";
+const char* g_OutputSum = "Sum";
+
+const long maxAveragedFrames = 256;  // 16-bit sums of 8x8 bins still fit 32 bits
+
+/**
+ * Adds pixels [first, last) of a 16-bit frame to the sums, or
+ * copies them for the first frame.
+ */
+static void Add16(const unsigned short* src, unsigned* sums, size_t first, size_t last, bool firstFrame)
+{
+   if (firstFrame)
+      for (size_t i=first; i<last; i++)
+         sums[i] = src[i];
+   else
+      for (size_t i=first; i<last; i++)
+         sums[i] += src[i];
+}
+
+/**
+ * Adds pixels [first, last) of an 8-bit frame to the sums, or
+ * copies them for the first frame.
+ */
+static void Add8(const unsigned char* src, unsigned* sums, size_t first, size_t last, bool firstFrame)
+{
+   if (firstFrame)
+      for (size_t i=first; i<last; i++)
+         sums[i] = src[i];
+   else
+      for (size_t i=first; i<last; i++)
+         sums[i] += src[i];
+}
+
+#ifdef FRAMEAVERAGER_SSE2
+/**
+ * Adds four 32-bit lanes to the sums at p, or stores them for the first frame.
+ */
+static inline void AddLanes(unsigned* p, __m128i v, bool firstFrame)
+{
+   if (!firstFrame)
+      v = _mm_add_epi32(v, _mm_loadu_si128((const __m128i*)p));
+   _mm_storeu_si128((__m128i*)p, v);
+}
+
+/**
+ * SSE2 version of Add16(): eight pixels are widened to 32 bits per step.
+ */
+static void Add16SSE2(const unsigned short* src, unsigned* sums, size_t count, bool firstFrame)
+{
+   const __m128i zero = _mm_setzero_si128();
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+      AddLanes(sums + i, _mm_unpacklo_epi16(v, zero), firstFrame);
+      AddLanes(sums + i + 4, _mm_unpackhi_epi16(v, zero), firstFrame);
+   }
+   Add16(src, sums, i, count, firstFrame);
+}
+
+/**
+ * SSE2 version of Add8(): sixteen pixels are widened to 32 bits per step.
+ */
+static void Add8SSE2(const unsigned char* src, unsigned* sums, size_t count, bool firstFrame)
+{
+   const __m128i zero = _mm_setzero_si128();
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      AddLanes(sums + i, _mm_unpacklo_epi16(lo, zero), firstFrame);
+      AddLanes(sums + i + 4, _mm_unpackhi_epi16(lo, zero), firstFrame);
+      AddLanes(sums + i + 8, _mm_unpacklo_epi16(hi, zero), firstFrame);
+      AddLanes(sums + i + 12, _mm_unpackhi_epi16(hi, zero), firstFrame);
+   }
+   Add8(src, sums, i, count, firstFrame);
+}
+#endif
+
+FrameAverager::FrameAverager() :
+   initialized_(false),
+   frames_(4),
+   sumOutput_(false),
+   binning_(1),
+   summedFrames_(0),
+   sumWidth_(0),
+   sumHeight_(0),
+   sumDepth_(0)
+{
+   InitializeDefaultErrorMessages();
+
+   SetErrorText(ERR_UNSUPPORTED_IMAGE_TYPE, "Only 8 and 16-bit images can be averaged");
+
+   // Name
+   CreateProperty(MM::g_Keyword_Name, g_DeviceNameFrameAverager, MM::String, true);
+
+   // Description
+   CreateProperty(MM::g_Keyword_Description, "Averages or sums N frames and bins them in software", MM::String, true);
+}
+
+FrameAverager::~FrameAverager()
+{
+   Shutdown();
+}
+
+void FrameAverager::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameFrameAverager);
+}
+
+int FrameAverager::Initialize()
+{
+   if (initialized_)
+      return DEVICE_OK;
+
+   // frames integrated into each output frame
+   CPropertyAction* pAct = new CPropertyAction (this, &FrameAverager::OnFrames);
+   int ret = CreateProperty(g_AveragerFramesProp, CDeviceUtils::ConvertToString(frames_), MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   SetPropertyLimits(g_AveragerFramesProp, 1, maxAveragedFrames);
+
+   pAct = new CPropertyAction (this, &FrameAverager::OnOutput);
+   ret = CreateProperty(g_AveragerOutputProp, g_OutputAverage, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_AveragerOutputProp, g_OutputAverage);
+   AddAllowedValue(g_AveragerOutputProp, g_OutputSum);
+
+   pAct = new CPropertyAction (this, &FrameAverager::OnBinning);
+   ret = CreateProperty(MM::g_Keyword_Binning, "1", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(MM::g_Keyword_Binning, "1");
+   AddAllowedValue(MM::g_Keyword_Binning, "2");
+   AddAllowedValue(MM::g_Keyword_Binning, "4");
+   AddAllowedValue(MM::g_Keyword_Binning, "8");
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int FrameAverager::Shutdown()
+{
+   MMThreadGuard guard(lock_);
+   sums_.clear();
+   binnedRow_.clear();
+   summedFrames_ = 0;
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+/**
+ * The output is binned, and 16-bit when summing.
+ */
+int FrameAverager::GetOutputFormat(unsigned width, unsigned height, unsigned byteDepth,
+                                   unsigned& outWidth, unsigned& outHeight, unsigned& outByteDepth)
+{
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+
+   MMThreadGuard guard(lock_);
+   if (width < binning_ || height < binning_)
+      return DEVICE_UNSUPPORTED_DATA_FORMAT;
+   outWidth = width / binning_;
+   outHeight = height / binning_;
+   outByteDepth = sumOutput_ ? 2 : byteDepth;
+   return DEVICE_OK;
+}
+
+/**
+ * Adds the image to the sums; every Nth image receives the result. In
+ * between the image shows the result of the frames summed so far, which
+ * keeps live views that call the processor directly from going dark.
+ * Requires the output format to be the input format.
+ */
+int FrameAverager::Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth)
+{
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+
+   MMThreadGuard guard(lock_);
+   if (binning_ != 1 || (sumOutput_ && byteDepth != 2))
+      return DEVICE_INCOMPATIBLE_IMAGE;
+
+   Accumulate(buffer, width, height, byteDepth);
+   Emit(buffer, byteDepth);
+   if (summedFrames_ >= frames_)
+      summedFrames_ = 0;
+   return DEVICE_OK;
+}
+
+/**
+ * Adds src to the sums. Returns DEVICE_IMAGE_ACCUMULATED, so that the frame
+ * is dropped, until N frames are summed; then writes the result to dst.
+ */
+int FrameAverager::ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                               unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth)
+{
+   if (byteDepth != 1 && byteDepth != 2)
+      return ERR_UNSUPPORTED_IMAGE_TYPE;
+
+   MMThreadGuard guard(lock_);
+   // the chain negotiated the format before Output or Binning changed
+   if (dstWidth != width / binning_ || dstHeight != height / binning_ || dstByteDepth != (sumOutput_ ? 2 : byteDepth))
+      return DEVICE_INCOMPATIBLE_IMAGE;
+
+   Accumulate(src, width, height, byteDepth);
+   if (summedFrames_ < frames_)
+      return DEVICE_IMAGE_ACCUMULATED;
+
+   Emit(dst, dstByteDepth);
+   summedFrames_ = 0;
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int FrameAverager::OnFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(frames_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long frames;
+      pProp->Get(frames);
+      MMThreadGuard guard(lock_);
+      frames_ = frames < 1 ? 1 : (frames > maxAveragedFrames ? maxAveragedFrames : frames);
+      summedFrames_ = 0;
+   }
+   return DEVICE_OK;
+}
+
+int FrameAverager::OnOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sumOutput_ ? g_OutputSum : g_OutputAverage);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      MMThreadGuard guard(lock_);
+      sumOutput_ = val.compare(g_OutputSum) == 0;
+      summedFrames_ = 0;
+   }
+   return DEVICE_OK;
+}
+
+int FrameAverager::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long)binning_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long binning;
+      pProp->Get(binning);
+      MMThreadGuard guard(lock_);
+      binning_ = binning > 0 ? (unsigned)binning : 1;
+      summedFrames_ = 0;
+   }
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private methods
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Adds the image to the 32-bit sums. The first frame of each group, or a
+ * frame of another format, overwrites the sums instead.
+ */
+void FrameAverager::Accumulate(const unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth)
+{
+   size_t count = (size_t)width * height;
+   if (width != sumWidth_ || height != sumHeight_ || byteDepth != sumDepth_)
+   {
+      sums_.resize(count);
+      summedFrames_ = 0;
+      sumWidth_ = width;
+      sumHeight_ = height;
+      sumDepth_ = byteDepth;
+   }
+
+   bool first = summedFrames_ == 0;
+#ifdef FRAMEAVERAGER_SSE2
+   if (byteDepth == 1)
+      Add8SSE2(buffer, &sums_[0], count, first);
+   else
+      Add16SSE2((const unsigned short*)buffer, &sums_[0], count, first);
+#else
+   if (byteDepth == 1)
+      Add8(buffer, &sums_[0], 0, count, first);
+   else
+      Add16((const unsigned short*)buffer, &sums_[0], 0, count, first);
+#endif
+   summedFrames_++;
+}
+
+/**
+ * Bins the sums and writes the average of the frames summed so far, or
+ * the sum saturated to the output depth. Remainder rows and columns that
+ * do not fill a whole bin are left out.
+ */
+void FrameAverager::Emit(unsigned char* dst, unsigned outByteDepth)
+{
+   const unsigned bin = binning_;
+   const unsigned outWidth = sumWidth_ / bin;
+   const unsigned outHeight = sumHeight_ / bin;
+   const unsigned maxValue = outByteDepth == 1 ? 0xff : 0xffff;
+   const double scale = sumOutput_ ? 1.0 : 1.0 / ((double)summedFrames_ * bin * bin);
+
+   binnedRow_.resize(outWidth);
+   for (unsigned y=0; y<outHeight; y++)
+   {
+      const unsigned* pRow;
+      if (bin == 1)
+         pRow = &sums_[(size_t)y * sumWidth_];
+      else
+      {
+         unsigned* pBinned = &binnedRow_[0];
+         for (unsigned x=0; x<outWidth; x++)
+            pBinned[x] = 0;
+         for (unsigned dy=0; dy<bin; dy++)
+         {
+            const unsigned* pSums = &sums_[((size_t)y * bin + dy) * sumWidth_];
+            for (unsigned x=0; x<outWidth; x++)
+               for (unsigned dx=0; dx<bin; dx++)
+                  pBinned[x] += pSums[x * bin + dx];
+         }
+         pRow = pBinned;
+      }
+
+      for (unsigned x=0; x<outWidth; x++)
+      {
+         unsigned v = sumOutput_ ? pRow[x] : (unsigned)(pRow[x] * scale + 0.5);
+         v = v < maxValue ? v : maxValue;
+         if (outByteDepth == 1)
+            dst[(size_t)y * outWidth + x] = (unsigned char)v;
+         else
+            ((unsigned short*)dst)[(size_t)y * outWidth + x] = (unsigned short)v;
+      }
+   }
+}
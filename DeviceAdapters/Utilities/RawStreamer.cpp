@@ -0,0 +1,750 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          RawStreamer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image streamer saving sequences as raw pixel data with an
+//                index file. Reference implementation of MM::ImageStreamer.
+//
+//                Raw+Index format:
+//                <path>.raw - images back to back, no headers
+//                <path>.idx - text: image size, then one line per image with
+//                             the byte offset in the raw file and the
+//                             elapsed time reported by the camera
+//                Stack format:
+//                <path>.mmstack - header, images, index and metadata in one
+//                             file, see ImageStack.h; the images of 8 and
+//                             16-bit streams may be compressed losslessly
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "Utilities.h"
+#include "../../MMDevice/ImageMetadata.h"
+#include "../../MMDevice/ImageCodec.h"
+
+#ifdef WIN32
+   #define snprintf _snprintf
+   #include <malloc.h>
+#else
+   #include <sys/types.h>
+   #include <sys/stat.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+   #include <errno.h>
+   #include <stdlib.h>
+#endif
+#include <string.h>
+#include <new>
+
+extern const char* g_DeviceNameRawStreamer;
+const char* g_BlockSizeProp = "BlockSizeMB";
+const char* g_DirectIOProp = "DirectIO";
+const char* g_FileFormatProp = "FileFormat";
+const char* g_FormatRaw = "Raw+Index";
+const char* g_FormatStack = "Stack";
+const char* g_CompressionProp = "Compression";
+const char* g_CompressionNone = "None";
+const char* g_CompressionLossless = "Lossless";
+const char* g_Yes = "Yes";
+const char* g_No = "No";
+
+// direct I/O needs the buffers, sizes and file offsets aligned to the
+// sector size; the page size covers all common devices
+const size_t blockAlignment = 4096;
+const size_t bytesInMB = 1048576;
+
+RawStreamer::RawStreamer() :
+   initialized_(false),
+   open_(false),
+   blockSizeMB_(16),
+   directIO_(true),
+   stackFormat_(false),
+   compression_(false),
+   compressing_(false),
+   blockSize_(0),
+   fillBlock_(0),
+   fillBytes_(0),
+   blockAcquired_(false),
+   freeBlocks_(2),
+   fullBlocks_(0),
+   writeError_(DEVICE_OK),
+   thread_(0),
+#ifdef WIN32
+   file_(INVALID_HANDLE_VALUE),
+#else
+   file_(-1),
+#endif
+   indexFile_(0),
+   bytesSaved_(0),
+   imageCount_(0),
+   width_(0),
+   height_(0),
+   depth_(0)
+{
+   InitializeDefaultErrorMessages();
+
+   SetErrorText(ERR_FILE_OPEN_FAILED, "Failed to create the stream files");
+   SetErrorText(ERR_FILE_WRITE_FAILED, "Failed to write the stream to disk");
+   SetErrorText(ERR_NO_STREAMING_CONTEXT, "No stream is open");
+   SetErrorText(ERR_STREAMING_CONTEXT_OPEN, "Not allowed while a stream is open");
+   SetErrorText(ERR_INCOMPATIBLE_IMAGE, "Image size does not match the open stream");
+   SetErrorText(ERR_OUT_OF_MEMORY, "Not enough memory for the stream buffers");
+
+   blocks_[0] = blocks_[1] = 0;
+   blockBytes_[0] = blockBytes_[1] = 0;
+
+   // Name
+   CreateProperty(MM::g_Keyword_Name, g_DeviceNameRawStreamer, MM::String, true);
+
+   // Description
+   CreateProperty(MM::g_Keyword_Description, "Saves image sequences as raw pixels with an index file, or as stack files", MM::String, true);
+}
+
+RawStreamer::~RawStreamer()
+{
+   Shutdown();
+}
+
+void RawStreamer::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameRawStreamer);
+}
+
+int RawStreamer::Initialize()
+{
+   if (initialized_)
+      return DEVICE_OK;
+
+   // size of each of the two write blocks
+   CPropertyAction* pAct = new CPropertyAction (this, &RawStreamer::OnBlockSize);
+   int ret = CreateProperty(g_BlockSizeProp, CDeviceUtils::ConvertToString(blockSizeMB_), MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   std::vector<std::string> sizes;
+   for (long mb=1; mb<=64; mb*=2)
+      sizes.push_back(CDeviceUtils::ConvertToString(mb));
+   SetAllowedValues(g_BlockSizeProp, sizes);
+
+   // bypass the OS cache
+   pAct = new CPropertyAction (this, &RawStreamer::OnDirectIO);
+   ret = CreateProperty(g_DirectIOProp, directIO_ ? g_Yes : g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_DirectIOProp, g_Yes);
+   AddAllowedValue(g_DirectIOProp, g_No);
+
+   pAct = new CPropertyAction (this, &RawStreamer::OnFileFormat);
+   ret = CreateProperty(g_FileFormatProp, stackFormat_ ? g_FormatStack : g_FormatRaw, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_FileFormatProp, g_FormatRaw);
+   AddAllowedValue(g_FileFormatProp, g_FormatStack);
+
+   // applies to the stack format only
+   pAct = new CPropertyAction (this, &RawStreamer::OnCompression);
+   ret = CreateProperty(g_CompressionProp, compression_ ? g_CompressionLossless : g_CompressionNone, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_CompressionProp, g_CompressionNone);
+   AddAllowedValue(g_CompressionProp, g_CompressionLossless);
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int RawStreamer::Shutdown()
+{
+   if (open_)
+      CloseContext();
+   FreeBlocks();
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ImageStreamer API
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Creates <path>.raw and <path>.idx, or <path>.mmstack, and starts the
+ * writer thread.
+ */
+int RawStreamer::OpenContext(unsigned width, unsigned height, unsigned depth, const char* path, const Metadata* /*contextMd*/)
+{
+   if (open_)
+      return ERR_STREAMING_CONTEXT_OPEN;
+
+   if (!AllocateBlocks())
+      return ERR_OUT_OF_MEMORY;
+
+   std::string base(path);
+   dataFileName_ = base + (stackFormat_ ? ".mmstack" : ".raw");
+   int ret = OpenDataFile(dataFileName_.c_str());
+   if (ret != DEVICE_OK)
+      return ret;
+
+   if (!stackFormat_)
+   {
+      indexFile_ = fopen((base + ".idx").c_str(), "w");
+      if (indexFile_ == 0)
+      {
+         CloseDataFile(0);
+         return ERR_FILE_OPEN_FAILED;
+      }
+      fprintf(indexFile_, "# data file: %s\n", dataFileName_.c_str());
+      fprintf(indexFile_, "# width\theight\tbytes per pixel\n%u\t%u\t%u\n", width, height, depth);
+      fprintf(indexFile_, "# image\toffset\t%s\n", MM::g_Keyword_Elapsed_Time_ms);
+   }
+
+   width_ = width;
+   height_ = height;
+   depth_ = depth;
+   compressing_ = stackFormat_ && compression_ && ImageCodec::CanCompress(depth);
+   bytesSaved_ = 0;
+   imageCount_ = 0;
+   fillBlock_ = 0;
+   fillBytes_ = 0;
+   blockAcquired_ = false;
+   writeError_ = DEVICE_OK;
+   stackIndex_.clear();
+   stackMetadata_.clear();
+
+   if (stackFormat_)
+   {
+      // the header goes through the writer thread, to keep the frames
+      // aligned; the frame count and the index are filled in on close
+      freeBlocks_.Wait();
+      blockAcquired_ = true;
+      memset(blocks_[fillBlock_], 0, g_ImageStackHeaderSize);
+      ImageStackHeader header = MakeStackHeader(0);
+      memcpy(blocks_[fillBlock_], &header, sizeof(header));
+      fillBytes_ = g_ImageStackHeaderSize;
+      bytesSaved_ = g_ImageStackHeaderSize;
+   }
+
+   thread_ = new WriterThread(this);
+   thread_->activate();
+   open_ = true;
+
+   LogMessage(("Streaming to " + dataFileName_).c_str(), true);
+   return DEVICE_OK;
+}
+
+/**
+ * Writes out the last block, waits for the writer thread and closes the files.
+ * Returns the first write error, if any.
+ */
+int RawStreamer::CloseContext()
+{
+   if (!open_)
+      return ERR_NO_STREAMING_CONTEXT;
+
+   // flush the partly filled block, padded for the direct I/O;
+   // the padding is truncated when the file is closed
+   if (blockAcquired_ && fillBytes_ > 0)
+   {
+      size_t bytes = (fillBytes_ + blockAlignment - 1) / blockAlignment * blockAlignment;
+      memset(blocks_[fillBlock_] + fillBytes_, 0, bytes - fillBytes_);
+      QueueBlock(bytes);
+   }
+
+   // an empty block ends the writer thread
+   if (!blockAcquired_)
+      freeBlocks_.Wait();
+   QueueBlock(0);
+
+   thread_->wait();
+   delete thread_;
+   thread_ = 0;
+
+   CloseDataFile(bytesSaved_);
+   if (indexFile_)
+      fclose(indexFile_);
+   indexFile_ = 0;
+   open_ = false;
+
+   if (writeError_ != DEVICE_OK)
+      return writeError_;
+   if (stackFormat_)
+      return WriteStackTrailer();
+   return DEVICE_OK;
+}
+
+/**
+ * Copies the image into the current block, compressed if the stream is.
+ * Blocks only when both blocks are waiting for the disk.
+ */
+int RawStreamer::SaveImage(unsigned char* buffer, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd)
+{
+   if (!open_)
+      return ERR_NO_STREAMING_CONTEXT;
+   if (width != width_ || height != height_ || depth != depth_)
+      return ERR_INCOMPATIBLE_IMAGE;
+   if (writeError_ != DEVICE_OK)
+      return writeError_;
+
+   size_t imageBytes = (size_t)width * height * depth;
+   if (!compressing_)
+      return AppendImage(buffer, imageBytes, imageMd);
+
+   size_t maxBytes = ImageCodec::MaxCompressedBytes(width_, height_, depth_);
+   if (compressBuffer_.size() < maxBytes)
+   {
+      try
+      {
+         compressBuffer_.resize(maxBytes);
+      }
+      catch (std::bad_alloc&)
+      {
+         return ERR_OUT_OF_MEMORY;
+      }
+   }
+   size_t bytes = ImageCodec::Compress(buffer, width, height, depth, &compressBuffer_[0]);
+   return AppendImage(&compressBuffer_[0], bytes, imageMd);
+}
+
+/**
+ * Stack streams with lossless compression take images compressed by the
+ * caller, which may spread the work over several threads.
+ */
+bool RawStreamer::AcceptsCompressedImages()
+{
+   return open_ && compressing_;
+}
+
+/**
+ * Copies the compressed image into the current block, like SaveImage().
+ */
+int RawStreamer::SaveCompressedImage(const unsigned char* data, size_t bytes, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd)
+{
+   if (!open_)
+      return ERR_NO_STREAMING_CONTEXT;
+   if (!compressing_)
+      return DEVICE_UNSUPPORTED_COMMAND;
+   if (width != width_ || height != height_ || depth != depth_)
+      return ERR_INCOMPATIBLE_IMAGE;
+   if (writeError_ != DEVICE_OK)
+      return writeError_;
+
+   return AppendImage(data, bytes, imageMd);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action interface
+///////////////////////////////////////////////////////////////////////////////
+
+int RawStreamer::OnBlockSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(blockSizeMB_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (open_)
+         return ERR_STREAMING_CONTEXT_OPEN;
+      pProp->Get(blockSizeMB_);
+      FreeBlocks();
+   }
+   return DEVICE_OK;
+}
+
+int RawStreamer::OnDirectIO(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(directIO_ ? g_Yes : g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (open_)
+         return ERR_STREAMING_CONTEXT_OPEN;
+      std::string val;
+      pProp->Get(val);
+      directIO_ = (val.compare(g_Yes) == 0);
+   }
+   return DEVICE_OK;
+}
+
+int RawStreamer::OnFileFormat(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stackFormat_ ? g_FormatStack : g_FormatRaw);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (open_)
+         return ERR_STREAMING_CONTEXT_OPEN;
+      std::string val;
+      pProp->Get(val);
+      stackFormat_ = (val.compare(g_FormatStack) == 0);
+   }
+   return DEVICE_OK;
+}
+
+int RawStreamer::OnCompression(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(compression_ ? g_CompressionLossless : g_CompressionNone);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (open_)
+         return ERR_STREAMING_CONTEXT_OPEN;
+      std::string val;
+      pProp->Get(val);
+      compression_ = (val.compare(g_CompressionLossless) == 0);
+   }
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private methods
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Adds the image, as saved in the data file, to the index and copies it
+ * into the blocks.
+ */
+int RawStreamer::AppendImage(const unsigned char* data, size_t bytes, const Metadata* imageMd)
+{
+   if (stackFormat_)
+   {
+      ImageStackIndexEntry entry;
+      entry.frameOffset = bytesSaved_;
+      entry.metadataOffset = stackMetadata_.size(); // relative until the index is written
+      entry.metadataBytes = 0;
+      if (imageMd)
+      {
+         size_t offset = stackMetadata_.size();
+         stackMetadata_.resize(offset + imageMd->GetBinarySize());
+         entry.metadataBytes = imageMd->SerializeBinary(&stackMetadata_[offset]);
+      }
+      stackIndex_.push_back(entry);
+   }
+   else
+   {
+      std::string elapsedMs;
+      if (imageMd)
+      {
+         try
+         {
+            elapsedMs = imageMd->GetSingleTag(MM::g_Keyword_Elapsed_Time_ms).GetValue();
+         }
+         catch (MetadataKeyError&)
+         {
+            // no timestamp for this image
+         }
+      }
+      fprintf(indexFile_, "%ld\t%llu\t%s\n", imageCount_, bytesSaved_, elapsedMs.c_str());
+   }
+
+   size_t done = 0;
+   while (done < bytes)
+   {
+      if (!blockAcquired_)
+      {
+         freeBlocks_.Wait();
+         blockAcquired_ = true;
+         fillBytes_ = 0;
+      }
+
+      size_t chunk = blockSize_ - fillBytes_;
+      if (chunk > bytes - done)
+         chunk = bytes - done;
+      memcpy(blocks_[fillBlock_] + fillBytes_, data + done, chunk);
+      fillBytes_ += chunk;
+      done += chunk;
+
+      if (fillBytes_ == blockSize_)
+         QueueBlock(fillBytes_);
+   }
+
+   bytesSaved_ += bytes;
+   imageCount_++;
+   return DEVICE_OK;
+}
+
+/**
+ * Appends the frame index and the metadata to the closed stack file and
+ * completes the header. The header is written last, so that readers can
+ * tell an incomplete file.
+ */
+int RawStreamer::WriteStackTrailer()
+{
+   unsigned long long indexOffset = bytesSaved_;
+   unsigned long long metadataOffset = indexOffset + stackIndex_.size() * sizeof(ImageStackIndexEntry);
+   for (size_t i=0; i<stackIndex_.size(); i++)
+      stackIndex_[i].metadataOffset += metadataOffset;
+
+   int ret = DEVICE_OK;
+   if (!stackIndex_.empty())
+      ret = PatchDataFile(indexOffset, &stackIndex_[0], stackIndex_.size() * sizeof(ImageStackIndexEntry));
+   if (ret == DEVICE_OK && !stackMetadata_.empty())
+      ret = PatchDataFile(metadataOffset, &stackMetadata_[0], stackMetadata_.size());
+   if (ret != DEVICE_OK)
+      return ret;
+
+   ImageStackHeader header = MakeStackHeader(indexOffset);
+   return PatchDataFile(0, &header, sizeof(header));
+}
+
+/**
+ * Stack file header for the current stream. Until the index is written the
+ * index offset is 0, and readers recover the frames from the file size.
+ */
+ImageStackHeader RawStreamer::MakeStackHeader(unsigned long long indexOffset) const
+{
+   ImageStackHeader header;
+   memset(&header, 0, sizeof(header));
+   strncpy(header.magic, g_ImageStackMagic, sizeof(header.magic));
+   header.version = g_ImageStackVersion;
+   header.headerSize = g_ImageStackHeaderSize;
+   header.width = width_;
+   header.height = height_;
+   header.depth = depth_;
+   header.compression = compressing_ ? g_ImageStackImageCodec : g_ImageStackUncompressed;
+   header.frameBytes = (unsigned long long)width_ * height_ * depth_;
+   header.frameCount = (unsigned long long)imageCount_;
+   header.indexOffset = indexOffset;
+   header.byteOrder = g_ImageStackByteOrder;
+   return header;
+}
+
+/**
+ * Writer thread procedure: writes the queued blocks in order and gives
+ * them back to SaveImage(). After a write error the remaining blocks are
+ * only recycled, so that SaveImage() never blocks forever.
+ */
+int RawStreamer::WriteBlocks()
+{
+   int block = 0;
+   while (true)
+   {
+      fullBlocks_.Wait();
+      size_t bytes = blockBytes_[block];
+      if (bytes == 0)
+      {
+         freeBlocks_.Post();
+         break; // end of the stream
+      }
+
+      if (writeError_ == DEVICE_OK)
+      {
+         int ret = WriteDataFile(blocks_[block], bytes);
+         if (ret != DEVICE_OK)
+            writeError_ = ret;
+      }
+      freeBlocks_.Post();
+      block = 1 - block;
+   }
+   return 0;
+}
+
+/**
+ * Hands the block being filled over to the writer thread.
+ */
+void RawStreamer::QueueBlock(size_t bytes)
+{
+   blockBytes_[fillBlock_] = bytes;
+   blockAcquired_ = false;
+   fillBlock_ = 1 - fillBlock_;
+   fullBlocks_.Post();
+}
+
+bool RawStreamer::AllocateBlocks()
+{
+   size_t blockSize = (size_t)blockSizeMB_ * bytesInMB;
+   if (blocks_[0] != 0 && blockSize == blockSize_)
+      return true;
+
+   FreeBlocks();
+   for (int i=0; i<2; i++)
+   {
+#ifdef WIN32
+      blocks_[i] = (unsigned char*) _aligned_malloc(blockSize, blockAlignment);
+#else
+      void* p = 0;
+      if (posix_memalign(&p, blockAlignment, blockSize) == 0)
+         blocks_[i] = (unsigned char*) p;
+#endif
+      if (blocks_[i] == 0)
+      {
+         FreeBlocks();
+         return false;
+      }
+   }
+   blockSize_ = blockSize;
+   return true;
+}
+
+void RawStreamer::FreeBlocks()
+{
+   for (int i=0; i<2; i++)
+   {
+#ifdef WIN32
+      _aligned_free(blocks_[i]);
+#else
+      free(blocks_[i]);
+#endif
+      blocks_[i] = 0;
+   }
+   blockSize_ = 0;
+}
+
+#ifdef WIN32
+
+int RawStreamer::OpenDataFile(const char* fileName)
+{
+   DWORD flags = FILE_ATTRIBUTE_NORMAL;
+   if (directIO_)
+      flags |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+
+   file_ = CreateFileA(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, flags, NULL);
+   if (file_ == INVALID_HANDLE_VALUE)
+      return ERR_FILE_OPEN_FAILED;
+   return DEVICE_OK;
+}
+
+int RawStreamer::WriteDataFile(const unsigned char* data, size_t bytes)
+{
+   DWORD written = 0;
+   if (!WriteFile(file_, data, (DWORD)bytes, &written, NULL) || written != bytes)
+      return ERR_FILE_WRITE_FAILED;
+   return DEVICE_OK;
+}
+
+/**
+ * Closes the file and cuts off the padding of the last block. The end of
+ * an unbuffered file can not be set at an unaligned offset, so the file
+ * is opened again for that.
+ */
+void RawStreamer::CloseDataFile(unsigned long long size)
+{
+   CloseHandle(file_);
+   file_ = INVALID_HANDLE_VALUE;
+
+   HANDLE file = CreateFileA(dataFileName_.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (file == INVALID_HANDLE_VALUE)
+      return;
+   LARGE_INTEGER pos;
+   pos.QuadPart = (LONGLONG)size;
+   if (SetFilePointerEx(file, pos, NULL, FILE_BEGIN))
+      SetEndOfFile(file);
+   CloseHandle(file);
+}
+
+/**
+ * Writes to the closed data file at the given offset, through the OS cache.
+ */
+int RawStreamer::PatchDataFile(unsigned long long offset, const void* data, size_t bytes)
+{
+   HANDLE file = CreateFileA(dataFileName_.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (file == INVALID_HANDLE_VALUE)
+      return ERR_FILE_OPEN_FAILED;
+
+   LARGE_INTEGER pos;
+   pos.QuadPart = (LONGLONG)offset;
+   DWORD written = 0;
+   bool ok = SetFilePointerEx(file, pos, NULL, FILE_BEGIN) &&
+             WriteFile(file, data, (DWORD)bytes, &written, NULL) && written == bytes;
+   CloseHandle(file);
+   return ok ? DEVICE_OK : ERR_FILE_WRITE_FAILED;
+}
+
+#else
+
+int RawStreamer::OpenDataFile(const char* fileName)
+{
+   int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+   if (directIO_)
+      file_ = open(fileName, flags | O_DIRECT, 0644);
+#endif
+   if (file_ < 0)
+      file_ = open(fileName, flags, 0644); // no direct I/O on this file system
+   if (file_ < 0)
+      return ERR_FILE_OPEN_FAILED;
+
+#ifdef __APPLE__
+   if (directIO_)
+      fcntl(file_, F_NOCACHE, 1);
+#endif
+   return DEVICE_OK;
+}
+
+int RawStreamer::WriteDataFile(const unsigned char* data, size_t bytes)
+{
+   while (bytes > 0)
+   {
+      ssize_t written = write(file_, data, bytes);
+      if (written < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return ERR_FILE_WRITE_FAILED;
+      }
+      data += written;
+      bytes -= (size_t)written;
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Closes the file and cuts off the padding of the last block.
+ */
+void RawStreamer::CloseDataFile(unsigned long long size)
+{
+   if (ftruncate(file_, (off_t)size) != 0)
+      LogMessage("Failed to truncate the stream file", false);
+   close(file_);
+   file_ = -1;
+}
+
+/**
+ * Writes to the closed data file at the given offset, through the OS cache.
+ */
+int RawStreamer::PatchDataFile(unsigned long long offset, const void* data, size_t bytes)
+{
+   int file = open(dataFileName_.c_str(), O_WRONLY);
+   if (file < 0)
+      return ERR_FILE_OPEN_FAILED;
+
+   const char* p = (const char*) data;
+   int ret = DEVICE_OK;
+   while (bytes > 0)
+   {
+      ssize_t written = pwrite(file, p, bytes, (off_t)offset);
+      if (written < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         ret = ERR_FILE_WRITE_FAILED;
+         break;
+      }
+      p += written;
+      offset += written;
+      bytes -= (size_t)written;
+   }
+   close(file);
+   return ret;
+}
+
+#endif
@@ -35,6 +35,9 @@ const char* g_Undefined = "Undefined";
 const char* g_DeviceNameDAShutter = "DA Shutter";
 const char* g_DeviceNameDAZStage = "DA Z Stage";
 const char* g_DeviceNameStateDeviceShutter = "State Device Shutter";
+const char* g_DeviceNameRawStreamer = "Raw Streamer";
+const char* g_DeviceNameFlatField = "Flat Field Correction";
+const char* g_DeviceNameFrameAverager = "Frame Averager";
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
@@ -45,6 +48,9 @@ MODULE_API void InitializeModuleData()
    AddAvailableDeviceName(g_DeviceNameDAShutter, "DA used as a shutter");
    AddAvailableDeviceName(g_DeviceNameDAZStage, "DA-controlled Z-stage");
    AddAvailableDeviceName(g_DeviceNameStateDeviceShutter, "State device used as a shutter");
+   AddAvailableDeviceName(g_DeviceNameRawStreamer, "Saves image sequences as raw pixels with an index file, or as stack files");
+   AddAvailableDeviceName(g_DeviceNameFlatField, "Dark frame subtraction and flat field correction");
+   AddAvailableDeviceName(g_DeviceNameFrameAverager, "Averages or sums N frames and bins them in software");
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)                  
@@ -60,6 +66,12 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
       return new DAZStage();
    } else if (strcmp(deviceName, g_DeviceNameStateDeviceShutter) == 0) {
       return new StateDeviceShutter();
+   } else if (strcmp(deviceName, g_DeviceNameRawStreamer) == 0) {
+      return new RawStreamer();
+   } else if (strcmp(deviceName, g_DeviceNameFlatField) == 0) {
+      return new FlatFieldProcessor();
+   } else if (strcmp(deviceName, g_DeviceNameFrameAverager) == 0) {
+      return new FrameAverager();
    }
 
    return 0;
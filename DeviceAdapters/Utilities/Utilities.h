@@ -25,6 +25,8 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include "../../MMDevice/ImageStack.h"
+#include <stdio.h>
 #include <string>
 #include <map>
 
@@ -38,6 +40,14 @@
 #define ERR_NO_DA_DEVICE_FOUND             10005
 #define ERR_NO_STATE_DEVICE                10006
 #define ERR_NO_STATE_DEVICE_FOUND          10007
+#define ERR_FILE_OPEN_FAILED               10008
+#define ERR_FILE_WRITE_FAILED              10009
+#define ERR_NO_STREAMING_CONTEXT           10010
+#define ERR_STREAMING_CONTEXT_OPEN         10011
+#define ERR_INCOMPATIBLE_IMAGE             10012
+#define ERR_OUT_OF_MEMORY                  10013
+#define ERR_UNSUPPORTED_IMAGE_TYPE         10014
+#define ERR_REFERENCE_MISMATCH             10015
 
 /*
  * MultiShutter: Combines multiple physical shutters into one logical device
@@ -192,4 +202,215 @@ private:
    bool initialized_;
 };
 
+/**
+ * RawStreamer: saves image sequences to a raw pixel file and a text index,
+ * or to a single stack file (see ImageStack.h).
+ * Images are collected in two large, page aligned blocks: while one is
+ * written to disk by a background thread (bypassing the OS cache when
+ * the file system allows it) the other one is filled by SaveImage().
+ * Stack files may hold the images compressed with ImageCodec, by the
+ * caller or by SaveImage() itself.
+ */
+class RawStreamer : public CImageStreamerBase<RawStreamer>
+{
+public:
+   RawStreamer();
+   ~RawStreamer();
+
+   // Device API
+   // ----------
+   int Initialize();
+   int Shutdown();
+
+   void GetName(char* pszName) const;
+   bool Busy() {return false;}
+
+   // ImageStreamer API
+   // -----------------
+   int OpenContext(unsigned width, unsigned height, unsigned depth, const char* path, const Metadata* contextMd = 0);
+   int CloseContext();
+   int SaveImage(unsigned char* buffer, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd = 0);
+   bool AcceptsCompressedImages();
+   int SaveCompressedImage(const unsigned char* data, size_t bytes, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd = 0);
+
+   // action interface
+   // ----------------
+   int OnBlockSize(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDirectIO(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFileFormat(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCompression(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   class WriterThread : public MMDeviceThreadBase
+   {
+   public:
+      WriterThread(RawStreamer* pStreamer) : streamer_(pStreamer) {}
+      int svc() {return streamer_->WriteBlocks();}
+
+   private:
+      RawStreamer* streamer_;
+   };
+
+   int AppendImage(const unsigned char* data, size_t bytes, const Metadata* imageMd);
+   int WriteBlocks();
+   void QueueBlock(size_t bytes);
+   int OpenDataFile(const char* fileName);
+   int WriteDataFile(const unsigned char* data, size_t bytes);
+   void CloseDataFile(unsigned long long size);
+   int PatchDataFile(unsigned long long offset, const void* data, size_t bytes);
+   int WriteStackTrailer();
+   ImageStackHeader MakeStackHeader(unsigned long long indexOffset) const;
+   bool AllocateBlocks();
+   void FreeBlocks();
+
+   bool initialized_;
+   bool open_;
+   long blockSizeMB_;
+   bool directIO_;
+   bool stackFormat_;
+   bool compression_;
+   bool compressing_;         // the open stream is compressed
+   std::vector<unsigned char> compressBuffer_; // for SaveImage()
+   unsigned char* blocks_[2];
+   size_t blockSize_;
+   size_t blockBytes_[2];     // bytes to write from each queued block
+   int fillBlock_;            // block being filled by SaveImage()
+   size_t fillBytes_;
+   bool blockAcquired_;       // fillBlock_ was taken from freeBlocks_
+   MMThreadSemaphore freeBlocks_;
+   MMThreadSemaphore fullBlocks_;
+   volatile int writeError_;
+   WriterThread* thread_;
+#ifdef WIN32
+   HANDLE file_;
+#else
+   int file_;
+#endif
+   FILE* indexFile_;
+   std::vector<ImageStackIndexEntry> stackIndex_;
+   std::vector<unsigned char> stackMetadata_;
+   std::string dataFileName_;
+   unsigned long long bytesSaved_;
+   long imageCount_;
+   unsigned width_;
+   unsigned height_;
+   unsigned depth_;
+};
+
+/**
+ * FlatFieldProcessor: subtracts a dark frame and corrects the pixel gain
+ * with a flat frame, for 8 and 16-bit images. The reference frames are
+ * built by averaging the next N frames passed to the processor, e.g. from
+ * a sequence acquisition with the shutter closed (dark) or on an even
+ * sample (flat).
+ */
+class FlatFieldProcessor : public CImageProcessorBase<FlatFieldProcessor>
+{
+public:
+   FlatFieldProcessor();
+   ~FlatFieldProcessor();
+
+   // Device API
+   // ----------
+   int Initialize();
+   int Shutdown();
+   void GetName(char* pszName) const;
+   bool Busy() {return false;}
+
+   // ImageProcessor API
+   // ------------------
+   int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   int ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                   unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth);
+
+   // action interface
+   // ----------------
+   int OnMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnReferenceFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDarkFrame(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFlatFrame(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   enum Mode {ModeOff, ModeCorrect, ModeAcquireDark, ModeAcquireFlat};
+
+   int CheckCorrection(unsigned width, unsigned height, unsigned byteDepth) const;
+   void Correct(const unsigned char* src, unsigned char* dst) const;
+   void Accumulate(const unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   bool FinishReference();
+   void ComputeGains();
+   bool AllocateReferences(unsigned width, unsigned height, unsigned byteDepth);
+   void FreeReferences();
+   std::string DescribeReference(bool present) const;
+
+   bool initialized_;
+   Mode mode_;
+   long referenceFrames_;     // frames averaged into a reference
+   unsigned width_;           // format of the reference frames
+   unsigned height_;
+   unsigned depth_;
+   size_t pixels_;
+   unsigned char* dark_;      // aligned, in the image depth, zero if there is no dark frame
+   unsigned short* gain_;     // aligned, fixed point, one if there is no flat frame
+   std::vector<unsigned short> flat_; // averaged flat frame, kept for new dark frames
+   bool hasDark_;
+   bool hasFlat_;
+   std::vector<unsigned> sums_;
+   long summedFrames_;
+   unsigned sumWidth_;
+   unsigned sumHeight_;
+   unsigned sumDepth_;
+   MMThreadLock lock_;
+};
+
+/**
+ * FrameAverager: integrates N consecutive frames and passes on one frame
+ * per N, the average or the 16-bit saturated sum, optionally binned NxN.
+ * In the core processor chain the other frames are dropped, so that only
+ * the integrated frames reach the circular buffer consumers.
+ */
+class FrameAverager : public CImageProcessorBase<FrameAverager>
+{
+public:
+   FrameAverager();
+   ~FrameAverager();
+
+   // Device API
+   // ----------
+   int Initialize();
+   int Shutdown();
+   void GetName(char* pszName) const;
+   bool Busy() {return false;}
+
+   // ImageProcessor API
+   // ------------------
+   int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   int GetOutputFormat(unsigned width, unsigned height, unsigned byteDepth,
+                       unsigned& outWidth, unsigned& outHeight, unsigned& outByteDepth);
+   bool PrefersProcessInto() {return true;}
+   int ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                   unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth);
+
+   // action interface
+   // ----------------
+   int OnFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnOutput(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   void Accumulate(const unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   void Emit(unsigned char* dst, unsigned outByteDepth);
+
+   bool initialized_;
+   long frames_;              // frames integrated into each output frame
+   bool sumOutput_;           // sum instead of average
+   unsigned binning_;
+   std::vector<unsigned> sums_;
+   std::vector<unsigned> binnedRow_;
+   long summedFrames_;
+   unsigned sumWidth_;
+   unsigned sumHeight_;
+   unsigned sumDepth_;
+   MMThreadLock lock_;
+};
+
 #endif //_UTILITIES_H_
@@ -120,7 +120,9 @@ Cdc1394::Cdc1394() :
    lnBin_(1),
    stopOnOverflow_(false),
    multi_shot_(false),
-   acquiring_(false)
+   acquiring_(false),
+   imageCounter_(0),
+   firstTimestamp_(0)
 {
    SetErrorText(ERR_CAMERA_NOT_FOUND, "Did not find a IIDC firewire camera");
    SetErrorText(ERR_SET_CAPTURE_FAILED, "Failed to set capture");
@@ -1602,6 +1604,18 @@ int Cdc1394::PushImage(dc1394video_frame_t *myframe)
    logMsg << "Pushing image " <<imageCounter_<< endl;
    LogMessage(logMsg.str().c_str());
 
+   // the timestamp is taken by the driver when the frame arrived, in
+   // microseconds, free of the latency of the copy into the core; the
+   // elapsed time counts from the first frame of the sequence
+   // the driver has no frame counter: frames it drops leave no gap in ours,
+   // but are announced by the frames waiting behind this one approaching
+   // the size of the DMA ring
+   if (imageCounter_ == 0)
+      firstTimestamp_ = myframe->timestamp;
+   FrameMetadata md;
+   AddDeviceFrameTags(md, imageCounter_, (double)myframe->timestamp);
+   md.SetNumber(FrameKey_ElapsedTime, (double)(myframe->timestamp - firstTimestamp_) / 1000.0);
+   md.SetNumber(FrameKey_DeviceFramesBehind, myframe->frames_behind);
    imageCounter_++;
    // TODO: call core to finish image snap
 
@@ -1617,33 +1631,21 @@ int Cdc1394::PushImage(dc1394video_frame_t *myframe)
    
    // process image
 
-   int numChars = GetImageWidth() * GetImageHeight() * GetImageBytesPerPixel() ;
-   unsigned char* buf = (unsigned char *)malloc(numChars);
-   ProcessImage(myframe, buf);
+   // read out directly into the next free slot of the circular MMCore buffer
+   // when not stopping on overflow, the core overwrites the oldest frame
+   unsigned char* pSlot = 0;
+   int ret = GetCoreCallback()->AcquireImageSlot(this, width, height, bytesPerPixel, pSlot);
 
-   /*
-   MM::ImageProcessor* ip = GetCoreCallback()->GetImageProcessor(this);
-   if (ip)
+   if (ret == DEVICE_OK)
    {
-      int ret = ip->Process(img_.GetPixels(), width, height,bytesPerPixel);
-      if (ret != DEVICE_OK) return ret;
-   }
-   */
-
-   // insert image into the circular MMCore buffer
-   int ret =  GetCoreCallback()->InsertImage(this, buf, width, height, bytesPerPixel);
-
-   if (!stopOnOverflow_ && ret == DEVICE_BUFFER_OVERFLOW) {
-      // do not stop on overflow - just reset the buffer                     
-      GetCoreCallback()->ClearImageBuffer(this);                             
-      ret =  GetCoreCallback()->InsertImage(this, buf, width, height, bytesPerPixel);
+      ProcessImage(myframe, pSlot);
+      ret = GetCoreCallback()->CommitImageSlot(this, md);
    }
 
    std::ostringstream os;
    os << "Inserted Image in circular buffer, with result: " << ret;
    LogMessage (os.str().c_str(), true);
 
-   free(buf);
    return ret;
 }
 
@@ -189,6 +189,7 @@ private:
    bool multi_shot_;
    bool acquiring_;
    unsigned long imageCounter_;
+   uint64_t firstTimestamp_;      // driver timestamp of the first frame, us
    unsigned long sequenceLength_;
    bool init_seqStarted_;
    AcqSequenceThread* acqThread_; // burst mode thread
@@ -7,6 +7,12 @@
 //                allows only one thread to enter at a time by using a mutex lock.
 //                This makes the buffer succeptible to race conditions if the
 //                calling threads are mutally dependent.
+//                In the lock-free mode a single producer (camera thread) and
+//                a single consumer exchange frames through the atomic insert
+//                and save indices, and the mutex is taken only for
+//                re-allocation, clearing and peeking at the top image.
+//                In the overwrite mode the producer then drops the oldest
+//                frame by a compare-and-swap of the save index.
 //              
 // COPYRIGHT:     University of California, San Francisco, 2007,
 //
@@ -36,76 +42,320 @@
 #include <ace/Mutex.h>
 #include <ace/Guard_T.h>
 #include "ace/High_Res_Timer.h"
+#include <math.h>
 
 #ifdef WIN32
 #pragma warning (default : 4312 4244)
 #endif
 
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#ifdef __APPLE__
+#include <libkern/OSAtomic.h>
+#endif
+#include <limits.h>
+
 #ifdef WIN32
 #undef min // avoid clash with the system defined macros
 #endif
 
-const int bytesInMB = 1048576;
-const long adjustThreshold = LONG_MAX / 2;
-const int maxCBSize = 1000;    //a reasonable limit to circular buffer size
+const size_t bytesInMB = 1048576;
+const unsigned long defaultMaxFrames = 1000; // a reasonable default limit to circular buffer size
+const unsigned long imageAlignment = 64; // start of each image in the pool
+const size_t hugePageSize = 2 * 1048576;
+const unsigned long intervalWindow = 100; // number of intervals in the rolling statistics
 
-// mutex
-static ACE_Mutex g_bufferLock;
+/**
+ * Holds the buffer lock for the scope, unless the buffer runs in the
+ * lock-free mode.
+ */
+class BufferGuard
+{
+public:
+   BufferGuard(ACE_Mutex& lock, bool lockFree) : lock_(lock), locked_(!lockFree)
+   {
+      if (locked_)
+         lock_.acquire();
+   }
+   ~BufferGuard()
+   {
+      if (locked_)
+         lock_.release();
+   }
+
+private:
+   ACE_Mutex& lock_;
+   bool locked_;
+};
+
+/**
+ * Replaces the value with desired if it still equals expected, atomically.
+ * Returns true if the value was replaced.
+ */
+static bool CompareAndSwap(volatile long& value, long expected, long desired)
+{
+#ifdef WIN32
+   return InterlockedCompareExchange(&value, desired, expected) == expected;
+#elif defined(__APPLE__)
+   return OSAtomicCompareAndSwapLongBarrier(expected, desired, &value);
+#else
+   return __sync_bool_compare_and_swap(&value, expected, desired);
+#endif
+}
 
 CircularBuffer::CircularBuffer(unsigned int memorySizeMB) :
-   width_(0), height_(0), pixDepth_(0), insertIndex_(0), saveIndex_(0), memorySizeMB_(memorySizeMB), overflow_(false), estimatedIntervalMs_(0)
+   width_(0), height_(0), pixDepth_(0), outWidth_(0), outHeight_(0), outDepth_(0), fmtWidth_(0), fmtHeight_(0), fmtDepth_(0), fmtMaxBytes_(0), fmtScratch_(false), imageStride_(0), scratchOffset_(0), insertIndex_(0), saveIndex_(0), readyIndex_(0), stageEpoch_(0), reservedIndex_(-1), lockFree_(false), overwrite_(false), readerHoldsFrame_(false), droppedFrames_(0), memorySizeMB_(memorySizeMB), maxFrames_(defaultMaxFrames), frameSizeBytes_(0), overflow_(false), intervals_(intervalWindow, 0.0), intervalPos_(0), intervalCount_(0), previousTimeMs_(-1.0),
+   frameArrived_(waitLock_), waiters_(0), pool_(0), poolSize_(0), poolHuge_(false), poolLocked_(false), hugePages_(false), lockMemory_(false)
 {
 }
 
-CircularBuffer::~CircularBuffer() {}
+CircularBuffer::~CircularBuffer()
+{
+   ReleaseFrames();
+   ReleasePool();
+}
 
 bool CircularBuffer::Initialize(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth)
 {
    if (w == 0 || h==0 || pixDepth == 0 || channels == 0 || slices == 0)
       return false; // does not make sense
 
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
    if (w == width_ && height_ == h && pixDepth_ == pixDepth && channels == numChannels_ && slices == numSlices_)
       return true; // nothing to change
 
    width_ = w;
    height_ = h;
    pixDepth_ = pixDepth;
+   outWidth_ = fmtWidth_ > 0 ? fmtWidth_ : w;
+   outHeight_ = fmtHeight_ > 0 ? fmtHeight_ : h;
+   outDepth_ = fmtDepth_ > 0 ? fmtDepth_ : pixDepth;
    numChannels_ = channels;
    numSlices_ = slices;
 
    insertIndex_ = 0;
    saveIndex_ = 0;
+   reservedIndex_ = -1;
+   ResetStages(0);
    overflow_ = false;
+   ResetIntervalStats();
+
+   // all frames are carved out of one contiguous pool, which is kept
+   // across changes of the image dimensions
+   // all sizes in bytes are size_t, so that buffers above 4 GB work
+   // on platforms with 32-bit long
+   size_t poolSize = (size_t)memorySizeMB_ * bytesInMB;
+   if (pool_ == 0 && !AllocatePool(poolSize))
+      return false;
 
-   // calculate the size of the entire buffer array once all images get allocated
-   // the acutual size at the time of the creation is going to be less, because
-   // images are not allocated until pixels become available
-   unsigned long frameSizeBytes = width_ * height_ * pixDepth_ * numChannels_ * numSlices_;
-   unsigned long cbSize = (memorySizeMB_ * bytesInMB) / frameSizeBytes;
+   // the storage of an image also holds the larger formats the processing
+   // stages may produce, and a second storage for out-of-place stages
+   size_t imageBytes = (size_t)width_ * height_ * pixDepth_;
+   if ((size_t)outWidth_ * outHeight_ * outDepth_ > imageBytes)
+      imageBytes = (size_t)outWidth_ * outHeight_ * outDepth_;
+   if (fmtMaxBytes_ > imageBytes)
+      imageBytes = fmtMaxBytes_;
+   size_t imageStride = (imageBytes + imageAlignment - 1) / imageAlignment * imageAlignment;
+   scratchOffset_ = fmtScratch_ ? imageStride : 0;
+   if (fmtScratch_)
+      imageStride *= 2;
+   size_t frameSizeBytes = imageStride * numChannels_ * numSlices_;
+   size_t cbSize = poolSize_ / frameSizeBytes;
 
    if (cbSize == 0)
       return false; // memory footprint too small
 
-   // set a reasonable limit to circular buffer capacity 
-   if (cbSize > maxCBSize)
-      cbSize=maxCBSize; 
+   // apply the configured limit to circular buffer capacity
+   if (maxFrames_ > 0 && cbSize > maxFrames_)
+      cbSize = maxFrames_;
 
-   // TODO: verify if we have enough RAM to satisfy this request
+   frameSizeBytes_ = frameSizeBytes;
+   imageStride_ = imageStride;
 
-   for (unsigned long i=0; i<frameArray_.size(); i++)
-      frameArray_[i].Clear();
-
-   // allocate buffers
+   // no pixels are touched here: pages of the pool are faulted in on the
+   // first lap, or up front if the pool is locked in memory
+   frameArray_.clear();
    frameArray_.resize(cbSize);
-   for (unsigned long i=0; i<frameArray_.size(); i++)
+   slots_.resize(cbSize);
+   discarded_.assign(cbSize, 0);
+   for (size_t i=0; i<frameArray_.size(); i++)
    {
       frameArray_[i].Resize(w, h, pixDepth);
-      frameArray_[i].Preallocate(numChannels_, numSlices_);
+      frameArray_[i].Preallocate(numChannels_, numSlices_, pool_ + i * frameSizeBytes, (unsigned long)imageStride);
+      slots_[i] = (unsigned long)i;
+   }
+   droppedFrames_ = 0;
+
+   return true;
+}
+
+/**
+ * Changes the memory footprint of the buffer. The pool is re-mapped only if
+ * the size actually changes. The buffer must be initialized again before use.
+ */
+void CircularBuffer::SetMemorySizeMB(unsigned int memorySizeMB)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   ReleaseFrames();
+   if (memorySizeMB != memorySizeMB_)
+      ReleasePool();
+   memorySizeMB_ = memorySizeMB;
+}
+
+/**
+ * Limits the number of frames the buffer holds regardless of the memory
+ * footprint; 0 means no limit. The buffer must be initialized again before use.
+ */
+void CircularBuffer::SetMaxFrames(unsigned long maxFrames)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   ReleaseFrames();
+   maxFrames_ = maxFrames;
+}
+
+/**
+ * Returns the number of bytes taken by the frames the buffer can hold.
+ */
+size_t CircularBuffer::GetTotalBytes() const
+{
+   return frameArray_.size() * frameSizeBytes_;
+}
+
+/**
+ * Selects how the pool is mapped: backed by huge pages and/or locked in
+ * physical memory, so that streaming never page-faults. Both are hints;
+ * the buffer falls back to regular pages if the system refuses.
+ * The buffer must be initialized again before use.
+ */
+void CircularBuffer::SetMemoryOptions(bool hugePages, bool lockMemory)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   ReleaseFrames();
+   if (hugePages != hugePages_ || lockMemory != lockMemory_)
+      ReleasePool();
+   hugePages_ = hugePages;
+   lockMemory_ = lockMemory;
+}
+
+/**
+ * Discards all frames; the pool itself stays mapped.
+ */
+void CircularBuffer::ReleaseFrames()
+{
+   frameArray_.clear();
+   slots_.clear();
+   discarded_.clear();
+   frameSizeBytes_ = 0;
+   width_ = 0;
+   height_ = 0;
+   pixDepth_ = 0;
+   outWidth_ = 0;
+   outHeight_ = 0;
+   outDepth_ = 0;
+   imageStride_ = 0;
+   scratchOffset_ = 0;
+   numChannels_ = 0;
+   numSlices_ = 0;
+   insertIndex_ = 0;
+   saveIndex_ = 0;
+   reservedIndex_ = -1;
+   overflow_ = false;
+}
+
+/**
+ * Maps an anonymous region for the frames. The memory is not initialized.
+ */
+bool CircularBuffer::AllocatePool(size_t bytes)
+{
+   poolHuge_ = false;
+   poolLocked_ = false;
+
+#ifdef WIN32
+   if (hugePages_ && GetLargePageMinimum() > 0)
+   {
+      size_t largePage = GetLargePageMinimum();
+      size_t hugeBytes = (bytes + largePage - 1) / largePage * largePage;
+      pool_ = (unsigned char*) VirtualAlloc(0, hugeBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+      if (pool_)
+      {
+         // large pages are always resident
+         poolSize_ = hugeBytes;
+         poolHuge_ = true;
+         poolLocked_ = true;
+         return true;
+      }
+   }
+
+   pool_ = (unsigned char*) VirtualAlloc(0, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+   if (pool_ == 0)
+      return false;
+   poolSize_ = bytes;
+   if (lockMemory_)
+      poolLocked_ = VirtualLock(pool_, poolSize_) != 0;
+#else
+   void* region = MAP_FAILED;
+#ifdef MAP_HUGETLB
+   if (hugePages_)
+   {
+      size_t hugeBytes = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+      region = mmap(0, hugeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+      if (region != MAP_FAILED)
+      {
+         poolSize_ = hugeBytes;
+         poolHuge_ = true;
+      }
+   }
+#endif
+   if (region == MAP_FAILED)
+   {
+      region = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (region == MAP_FAILED)
+         return false;
+      poolSize_ = bytes;
+#ifdef MADV_HUGEPAGE
+      // no reserved huge pages, let the kernel use transparent ones
+      if (hugePages_)
+         madvise(region, poolSize_, MADV_HUGEPAGE);
+#endif
    }
+   pool_ = (unsigned char*) region;
+
+   // locking faults in all pages now instead of during the first lap
+   if (lockMemory_)
+      poolLocked_ = mlock(pool_, poolSize_) == 0;
+#endif
 
    return true;
 }
 
+void CircularBuffer::ReleasePool()
+{
+   if (pool_ == 0)
+      return;
+
+#ifdef WIN32
+   if (poolLocked_ && !poolHuge_)
+      VirtualUnlock(pool_, poolSize_);
+   VirtualFree(pool_, 0, MEM_RELEASE);
+#else
+   if (poolLocked_)
+      munlock(pool_, poolSize_);
+   munmap(pool_, poolSize_);
+#endif
+
+   pool_ = 0;
+   poolSize_ = 0;
+   poolHuge_ = false;
+   poolLocked_ = false;
+}
+
 unsigned long CircularBuffer::GetSize() const
 {
    return (unsigned long)frameArray_.size();
@@ -113,7 +363,7 @@ unsigned long CircularBuffer::GetSize() const
 
 unsigned long CircularBuffer::GetFreeSize() const
 {
-   long freeSize = (long)frameArray_.size() - (insertIndex_ - saveIndex_);
+   long freeSize = Capacity() - Occupancy(insertIndex_.value(), saveIndex_.value());
    if (freeSize < 0)
       return 0;
    else
@@ -122,7 +372,70 @@ unsigned long CircularBuffer::GetFreeSize() const
 
 unsigned long CircularBuffer::GetRemainingImageCount() const
 {
-   return (unsigned long)(insertIndex_ - saveIndex_);
+   return (unsigned long)VisibleCount(saveIndex_.value());
+}
+
+/**
+ * Discards all images in the buffer.
+ * In the lock-free mode only the consumer index is moved, so the camera
+ * thread may keep inserting while the buffer is being cleared.
+ */
+void CircularBuffer::Clear()
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   if (lockFree_)
+      saveIndex_ = insertIndex_.value();
+   else
+   {
+      insertIndex_ = 0;
+      saveIndex_ = 0;
+   }
+   ResetStages(insertIndex_.value());
+   overflow_ = false;
+   ResetIntervalStats();
+}
+
+/**
+ * Switches between the mutex protected and the lock-free access.
+ * The lock-free mode supports exactly one inserting thread and one thread
+ * calling GetNextImage()/GetNextImageBuffer(). Buffer contents are discarded.
+ */
+void CircularBuffer::SetLockFree(bool lockFree)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   lockFree_ = lockFree;
+   insertIndex_ = 0;
+   saveIndex_ = 0;
+   reservedIndex_ = -1;
+   ResetStages(0);
+   overflow_ = false;
+}
+
+/**
+ * In the overwrite mode a full buffer drops its oldest frame to make room
+ * for the new one, instead of refusing it. Dropped frames are counted.
+ * The producer then moves the consumer index as well; in the lock-free mode
+ * both threads move it by compare-and-swap, see AdvanceSaveIndex().
+ */
+void CircularBuffer::SetOverwrite(bool overwrite)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   overwrite_ = overwrite;
+   droppedFrames_ = 0;
+}
+
+/**
+ * Declares that the consumer keeps using the frame it popped last, outside
+ * the buffer lock, until it pops the next one (e.g. the disk writer thread).
+ * The producer then never reuses that frame.
+ */
+void CircularBuffer::SetReaderHoldsFrame(bool holds)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+   readerHoldsFrame_ = holds;
 }
 
 /**
@@ -138,60 +451,46 @@ bool CircularBuffer::InsertImage(const unsigned char* pixArray, unsigned int wid
  */
 bool CircularBuffer::InsertMultiChannel(const unsigned char* pixArray, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd) throw (CMMError)
 {
-   ACE_Guard<ACE_Mutex> guard(g_bufferLock);
+   // received before waiting for the lock and copying
+   double receivedMs = GetMMTimeNow().getMsec();
+   double cameraMs = CameraTimeMs(pMd, 0);
+   BufferGuard guard(bufferLock_, lockFree_);
 
    unsigned long singleChannelSize = (unsigned long)width * height * byteDepth;
-   static unsigned long previousTicks = 0;
-
-   if (previousTicks > 0)
-      estimatedIntervalMs_ = GetClockTicksMs() - previousTicks;
-   else
-      estimatedIntervalMs_ = 0;
 
    // check image dimensions
    if (width != width_ || height_ != height || byteDepth != byteDepth)
       throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
 
-   
-   if ((long)frameArray_.size() - (insertIndex_ - saveIndex_) > 0)
+   long insertIndex = insertIndex_.value();
+   if (MakeRoom(insertIndex))
    {
+      RestoreInputFormat(insertIndex);
+      discarded_[insertIndex % discarded_.size()] = 0;
+      ImgBuffer* pFirst = 0;
       for (unsigned i=0; i<numChannels; i++)
       {
          // check if the requested (channel, slice) combination exists
          // we assume that all buffers are pre-allocated
-         ImgBuffer* pImg = frameArray_[insertIndex_ % frameArray_.size()].FindImage(i, 0);
+         ImgBuffer* pImg = FrameAt(insertIndex).FindImage(i, 0);
          if (!pImg)
             return false;
 
-         if (pMd)
+         // the metadata is stored once per frame
+         if (pFirst == 0)
          {
-            // TODO: the same metadata is inserted for each channel ???
-            // Perhaps we need to add specific tags to each channel
-            pImg->SetMetadata(*pMd);
+            SetFrameMetadata(pImg, pMd, 0, cameraMs < 0.0, receivedMs);
+            pFirst = pImg;
          }
          else
-         {
-            // if metadata was not supplied by the camera insert current timestamp
-            MM::MMTime timestamp = GetMMTimeNow();
-            Metadata md;
-            MetadataSingleTag mst(MM::g_Keyword_Elapsed_Time_ms, "Buffer", true);
-            mst.SetValue(CDeviceUtils::ConvertToString(timestamp.getMsec()));
-            md.SetTag(mst);
-            pImg->SetMetadata(md);
-         }
+            pImg->ShareMetadata(pFirst);
          pImg->SetPixels(pixArray + i*singleChannelSize);
       }
 
-      insertIndex_++;
-      if ((insertIndex_ - (long)frameArray_.size()) > adjustThreshold && (saveIndex_- (long)frameArray_.size()) > adjustThreshold)
-      {
-         printf("adjusting indices\n");
-         // adjust buffer indices to avoid overflowing integer size
-         insertIndex_ -= adjustThreshold;
-         saveIndex_ -= adjustThreshold;
-      }
-      
-      previousTicks = GetClockTicksMs();
+      // publish the frame only after the pixels are in place
+      insertIndex_ = NextIndex(insertIndex);
+      UpdateInterval(cameraMs < 0.0 ? receivedMs : cameraMs);
+      NotifyWaiters();
 
       return true;
    }
@@ -202,97 +501,647 @@ bool CircularBuffer::InsertMultiChannel(const unsigned char* pixArray, unsigned
 }
 
 
-const unsigned char* CircularBuffer::GetTopImage() const
+/**
+ * Reserves the next free slot for a single channel image and returns the
+ * pointer to its pixels, so that the camera can read out directly into
+ * the buffer. Returns 0 if the buffer is full.
+ * The slot is not visible to the consumers until CommitSlot() is called.
+ * Only one slot can be reserved at a time; reserving again before the commit
+ * returns the same slot.
+ */
+unsigned char* CircularBuffer::ReserveSlot(unsigned int width, unsigned int height, unsigned int byteDepth) throw (CMMError)
 {
-   ACE_Guard<ACE_Mutex> guard(g_bufferLock);
+   BufferGuard guard(bufferLock_, lockFree_);
 
-   if (frameArray_.size() == 0)
+   // check image dimensions
+   if (width != width_ || height != height_ || byteDepth != pixDepth_)
+      throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
+
+   long insertIndex = insertIndex_.value();
+   if (reservedIndex_ != insertIndex && !MakeRoom(insertIndex))
       return 0;
+   RestoreInputFormat(insertIndex);
+   discarded_[insertIndex % discarded_.size()] = 0;
 
-   if (insertIndex_ == 0)
-      return frameArray_[0].GetPixels(0, 0);
-   else
-      return frameArray_[(insertIndex_-1) % frameArray_.size()].GetPixels(0, 0);
+   ImgBuffer* pImg = FrameAt(insertIndex).FindImage(0, 0);
+   if (!pImg)
+      return 0;
+
+   reservedIndex_ = insertIndex;
+   return pImg->GetPixelsRW();
+}
+
+/**
+ * Publishes the slot obtained with ReserveSlot().
+ * If the buffer was cleared in the meantime the frame is silently discarded.
+ * Returns false if there is no reserved slot.
+ */
+bool CircularBuffer::CommitSlot(const Metadata* pMd)
+{
+   return PublishSlot(pMd, 0);
+}
+
+/**
+ * Publishes the slot obtained with ReserveSlot(), with numeric metadata
+ * that is formatted only if a consumer asks for it.
+ */
+bool CircularBuffer::CommitSlot(const FrameMetadata& md)
+{
+   return PublishSlot(0, &md);
+}
+
+bool CircularBuffer::PublishSlot(const Metadata* pMd, const FrameMetadata* pFrameMd)
+{
+   double receivedMs = GetMMTimeNow().getMsec();
+   double cameraMs = CameraTimeMs(pMd, pFrameMd);
+   BufferGuard guard(bufferLock_, lockFree_);
+
+   if (reservedIndex_ < 0)
+      return false;
+
+   long insertIndex = insertIndex_.value();
+   if (reservedIndex_ == insertIndex)
+   {
+      SetFrameMetadata(FrameAt(insertIndex).FindImage(0, 0), pMd, pFrameMd, cameraMs < 0.0, receivedMs);
+      insertIndex_ = NextIndex(insertIndex);
+      UpdateInterval(cameraMs < 0.0 ? receivedMs : cameraMs);
+      NotifyWaiters();
+   }
+   reservedIndex_ = -1;
+
+   return true;
+}
+
+const unsigned char* CircularBuffer::GetTopImage() const
+{
+   const ImgBuffer* pImg = GetTopImageBuffer(0, 0);
+   return pImg ? pImg->GetPixels() : 0;
 }
 
 const ImgBuffer* CircularBuffer::GetTopImageBuffer(unsigned channel, unsigned slice) const
 {
-   ACE_Guard<ACE_Mutex> guard(g_bufferLock);
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
 
    if (frameArray_.size() == 0)
       return 0;
 
    // TODO: we may return NULL pointer if channel and slice indexes are wrong
    // this will cause problem in the SWIG - Java layer
-   if (insertIndex_ == 0)
-      return frameArray_[0].FindImage(channel, slice);
-   else
-      return frameArray_[(insertIndex_-1) % frameArray_.size()].FindImage(channel, slice);
+   // the last frame that was not dropped by the processing stages
+   long size = (long)frameArray_.size();
+   long range = IndexRange();
+   long topIndex = (ReadyIndex() + range - 1) % range;
+   for (long i=1; i<size && discarded_[topIndex % size]; i++)
+      topIndex = (topIndex + range - 1) % range;
+   return FrameAt(topIndex).FindImage(channel, slice);
 }
 
 
 const unsigned char* CircularBuffer::GetNextImage()
 {
-   ACE_Guard<ACE_Mutex> guard(g_bufferLock);
-
-   if (saveIndex_ < insertIndex_)
-   {
-      const unsigned char* pBuf = frameArray_[(saveIndex_) % frameArray_.size()].GetPixels(0, 0);
-      saveIndex_++;
-      return pBuf;
-   }
+   const ImgBuffer* pBuf = GetNextImageBuffer(0, 0);
+   if (pBuf)
+      return pBuf->GetPixels();
    return 0;
 }
 
 const ImgBuffer* CircularBuffer::GetNextImageBuffer(unsigned channel, unsigned slice)
 {
-   ACE_Guard<ACE_Mutex> guard(g_bufferLock);
+   BufferGuard guard(bufferLock_, lockFree_);
 
    // TODO: we may return NULL pointer if channel and slice indexes are wrong
    // this will cause problem in the SWIG - Java layer
-   if (saveIndex_ < insertIndex_)
+   for (;;)
    {
-      const ImgBuffer* pBuf = frameArray_[(saveIndex_) % frameArray_.size()].FindImage(channel, slice);
-      saveIndex_++;
-      return pBuf;
+      long current = saveIndex_.value();
+      long saveIndex = SkipDiscarded(current);
+      const ImgBuffer* pBuf = 0;
+      if (Occupancy(ReadyIndex(), saveIndex) > 0)
+      {
+         pBuf = FrameAt(saveIndex).FindImage(channel, slice);
+         saveIndex = NextIndex(saveIndex);
+      }
+      if (AdvanceSaveIndex(current, saveIndex))
+         return pBuf;
    }
-   return 0;
 }
 
+/**
+ * Removes the oldest frame from the buffer and returns it with all its
+ * channels, or 0 if the buffer is empty.
+ */
+const FrameBuffer* CircularBuffer::GetNextFrame()
+{
+   BufferGuard guard(bufferLock_, lockFree_);
+
+   for (;;)
+   {
+      long current = saveIndex_.value();
+      long saveIndex = SkipDiscarded(current);
+      const FrameBuffer* pFrame = 0;
+      if (Occupancy(ReadyIndex(), saveIndex) > 0)
+      {
+         pFrame = &FrameAt(saveIndex);
+         saveIndex = NextIndex(saveIndex);
+      }
+      if (AdvanceSaveIndex(current, saveIndex))
+         return pFrame;
+   }
+}
+
+/**
+ * Blocks until the buffer holds at least one frame or the timeout expires.
+ * Returns false on timeout.
+ */
+bool CircularBuffer::WaitForImage(long timeoutMs)
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(waitLock_);
+
+   if (VisibleCount(saveIndex_.value()) > 0)
+      return true;
+
+   ACE_Time_Value deadline = ACE_OS::gettimeofday() + ACE_Time_Value(timeoutMs / 1000, (timeoutMs % 1000) * 1000);
+   waiters_++;
+   while (VisibleCount(saveIndex_.value()) == 0)
+   {
+      if (frameArrived_.wait(&deadline) == -1)
+         break; // timed out
+   }
+   waiters_--;
+
+   return VisibleCount(saveIndex_.value()) > 0;
+}
+
+/**
+ * Wakes up the consumers blocked in WaitForImage(). Called after a frame is
+ * published; the insert index is already updated when the waiters check it.
+ */
+void CircularBuffer::NotifyWaiters()
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(waitLock_);
+   if (waiters_ > 0)
+      frameArrived_.broadcast();
+}
+
+/**
+ * Inserts processing stages between the producer and the consumers. Each
+ * inserted frame passes through the stages in order, see WaitForStage(),
+ * and becomes visible to the consumers only after the last stage completes
+ * it. Frames already in the buffer count as processed. The stages must be
+ * idle while their number changes; 0 removes them.
+ */
+void CircularBuffer::SetProcessingStages(unsigned stages)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+   ACE_Guard<ACE_Thread_Mutex> waitGuard(waitLock_);
+
+   stageIndex_.assign(stages, insertIndex_.value());
+   readyIndex_ = insertIndex_.value();
+   stageEpoch_++;
+}
+
+/**
+ * Blocks until the given stage has a frame to process, i.e. a frame the
+ * previous stage (or the producer, for the first stage) has completed.
+ * Returns the frame, or 0 on timeout; the ticket is passed back to
+ * CompleteStage(). The frame is not reused by the producer until all stages
+ * and the consumer are done with it.
+ */
+FrameBuffer* CircularBuffer::WaitForStage(unsigned stage, long timeoutMs, StageTicket& ticket)
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(waitLock_);
+
+   if (stage >= stageIndex_.size())
+      return 0;
+
+   ACE_Time_Value deadline = ACE_OS::gettimeofday() + ACE_Time_Value(timeoutMs / 1000, (timeoutMs % 1000) * 1000);
+   waiters_++;
+   while (Occupancy(stage == 0 ? insertIndex_.value() : stageIndex_[stage - 1], stageIndex_[stage]) == 0)
+   {
+      if (frameArrived_.wait(&deadline) == -1)
+         break; // timed out
+   }
+   waiters_--;
+
+   if (Occupancy(stage == 0 ? insertIndex_.value() : stageIndex_[stage - 1], stageIndex_[stage]) == 0)
+      return 0;
+
+   ticket.index = stageIndex_[stage];
+   ticket.epoch = stageEpoch_;
+   return &FrameAt(ticket.index);
+}
+
+/**
+ * Hands the frame obtained from WaitForStage() to the next stage, or to the
+ * consumers after the last stage. A frame discarded by Clear() in the
+ * meantime is ignored.
+ * With discard the frame still passes the remaining stages, which should
+ * skip it (see IsDiscarded()), but the consumers never see it; e.g. a stage
+ * that integrates several frames keeps one out of N.
+ */
+void CircularBuffer::CompleteStage(unsigned stage, const StageTicket& ticket, bool discard)
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(waitLock_);
+
+   if (stage >= stageIndex_.size() || ticket.epoch != stageEpoch_ || stageIndex_[stage] != ticket.index)
+      return;
+
+   // the flag is in place before the frame becomes ready
+   if (discard)
+      discarded_[ticket.index % discarded_.size()] = 1;
+   stageIndex_[stage] = NextIndex(ticket.index);
+   if (stage == stageIndex_.size() - 1)
+      readyIndex_ = stageIndex_[stage];
+   if (waiters_ > 0)
+      frameArrived_.broadcast();
+}
+
+/**
+ * True if an earlier stage dropped the frame obtained from WaitForStage().
+ */
+bool CircularBuffer::IsDiscarded(const StageTicket& ticket) const
+{
+   return discarded_[ticket.index % discarded_.size()] != 0;
+}
+
+/**
+ * Sets the format of the images leaving the processing stages, and the size
+ * of the largest image format in between; 0 keeps the input format. With
+ * scratch each image gets a second storage, so that out-of-place stages can
+ * alternate between the two without copying, see GetScratchPixels().
+ * Takes effect when the buffer is initialized again.
+ */
+void CircularBuffer::SetProcessingFormat(unsigned width, unsigned height, unsigned byteDepth, size_t maxImageBytes, bool scratch)
+{
+   ACE_Guard<ACE_Mutex> guard(bufferLock_);
+
+   if (width == fmtWidth_ && height == fmtHeight_ && byteDepth == fmtDepth_ && maxImageBytes == fmtMaxBytes_ && scratch == fmtScratch_)
+      return;
+
+   fmtWidth_ = width;
+   fmtHeight_ = height;
+   fmtDepth_ = byteDepth;
+   fmtMaxBytes_ = maxImageBytes;
+   fmtScratch_ = scratch;
+   ReleaseFrames();
+}
+
+/**
+ * Returns the storage of the image that the image does not currently use,
+ * for an out-of-place stage to write into. The stage then attaches the
+ * image to it. Returns 0 if the buffer has no second storage.
+ */
+unsigned char* CircularBuffer::GetScratchPixels(const StageTicket& ticket, unsigned channel)
+{
+   if (scratchOffset_ == 0)
+      return 0;
+
+   unsigned char* pStorage = ImageStorage(ticket.index, channel, 0);
+   const ImgBuffer* pImg = FrameAt(ticket.index).FindImage(channel, 0);
+   if (pImg == 0)
+      return 0;
+   return pImg->GetPixels() == pStorage ? pStorage + scratchOffset_ : pStorage;
+}
+
+/**
+ * First storage of the image in the frame at the given index.
+ */
+unsigned char* CircularBuffer::ImageStorage(long index, unsigned channel, unsigned slice)
+{
+   unsigned long slot = slots_[index % slots_.size()];
+   return pool_ + slot * frameSizeBytes_ + (channel * numSlices_ + slice) * imageStride_;
+}
+
+/**
+ * Points the images of the frame back to their first storage with the input
+ * format, after the processing stages may have changed either.
+ */
+void CircularBuffer::RestoreInputFormat(long index)
+{
+   if (scratchOffset_ == 0 && outWidth_ == width_ && outHeight_ == height_ && outDepth_ == pixDepth_)
+      return; // the stages process in place and keep the format
+
+   FrameBuffer& frame = FrameAt(index);
+   for (unsigned i=0; i<numChannels_; i++)
+      for (unsigned j=0; j<numSlices_; j++)
+      {
+         ImgBuffer* pImg = frame.FindImage(i, j);
+         if (pImg)
+            pImg->AttachPixels(ImageStorage(index, i, j), width_, height_, pixDepth_);
+      }
+}
+
+/**
+ * Moves all processing stages to the given index, dropping the frames they
+ * have not completed yet.
+ */
+void CircularBuffer::ResetStages(long index)
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(waitLock_);
+
+   for (size_t i=0; i<stageIndex_.size(); i++)
+      stageIndex_[i] = index;
+   readyIndex_ = index;
+   stageEpoch_++;
+}
+
+/**
+ * End of the frames the consumers may see: all inserted frames, or only
+ * the ones that passed the processing stages.
+ */
+long CircularBuffer::ReadyIndex() const
+{
+   return stageIndex_.empty() ? insertIndex_.value() : readyIndex_.value();
+}
+
+/**
+ * Moves the given consumer index past the ready frames the processing
+ * stages dropped.
+ */
+long CircularBuffer::SkipDiscarded(long saveIndex) const
+{
+   long readyIndex = ReadyIndex();
+   while (Occupancy(readyIndex, saveIndex) > 0 && discarded_[saveIndex % discarded_.size()])
+      saveIndex = NextIndex(saveIndex);
+   return saveIndex;
+}
+
+/**
+ * Number of ready frames from the given consumer index on, not counting the
+ * frames the processing stages dropped.
+ */
+long CircularBuffer::VisibleCount(long saveIndex) const
+{
+   long readyIndex = ReadyIndex();
+   long count = Occupancy(readyIndex, saveIndex);
+   long visible = 0;
+   for (long i=0; i<count; i++)
+      if (!discarded_[(saveIndex + i) % discarded_.size()])
+         visible++;
+   return visible;
+}
+
+/**
+ * Removes up to maxCount of the oldest frames from the buffer, copying them
+ * back to back into dest. Channels and slices of each frame follow each other.
+ * The metadata of the first channel of each frame is returned in metadata.
+ * Returns the number of frames copied, limited by the frames available and by
+ * the frames that fit into destBytes.
+ */
+unsigned long CircularBuffer::CopyNextImages(unsigned char* dest, size_t destBytes, unsigned long maxCount, std::vector<Metadata>& metadata)
+{
+   BufferGuard guard(bufferLock_, lockFree_);
+
+   metadata.clear();
+   size_t imageBytes = (size_t)outWidth_ * outHeight_ * outDepth_;
+   size_t frameBytes = imageBytes * numChannels_ * numSlices_;
+   if (frameBytes == 0)
+      return 0;
+
+   unsigned long count = (unsigned long)VisibleCount(saveIndex_.value());
+   if (count > maxCount)
+      count = maxCount;
+   if (count > destBytes / frameBytes)
+      count = (unsigned long)(destBytes / frameBytes);
+
+   // the frames are popped one by one: in the lock-free overwrite mode the
+   // producer may drop the frame being copied, which is then copied again
+   // from the new oldest frame; a popped frame is not reused by the producer
+   // until the next one is popped, so its metadata is safe to read
+   metadata.reserve(count);
+   unsigned long copied = 0;
+   while (copied < count)
+   {
+      long current = saveIndex_.value();
+      long saveIndex = SkipDiscarded(current);
+      if (Occupancy(ReadyIndex(), saveIndex) == 0)
+      {
+         AdvanceSaveIndex(current, saveIndex);
+         break;
+      }
+      const FrameBuffer& frame = FrameAt(saveIndex);
+      for (unsigned j=0; j<numChannels_ * numSlices_; j++)
+      {
+         const ImgBuffer* pImg = frame.FindImage(j / numSlices_, j % numSlices_);
+         memcpy(dest + copied * frameBytes + j * imageBytes, pImg->GetPixels(), imageBytes);
+      }
+      if (!AdvanceSaveIndex(current, NextIndex(saveIndex)))
+         continue;
+      metadata.push_back(frame.FindImage(0, 0)->GetMetadata());
+      copied++;
+   }
+
+   return copied;
+}
+
+/**
+ * Mean interval between the recently inserted frames.
+ */
 double CircularBuffer::GetAverageIntervalMs() const
 {
-   ACE_Guard<ACE_Mutex> guard(g_bufferLock);
+   double meanMs, minMs, maxMs, jitterMs;
+   GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return meanMs;
+}
+
+/**
+ * Statistics of the intervals between the last (up to 100) inserted frames:
+ * mean, minimum, maximum and jitter (standard deviation), all in ms.
+ * All values are zero until at least two frames arrived.
+ */
+void CircularBuffer::GetIntervalStats(double& meanMs, double& minMs, double& maxMs, double& jitterMs) const
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(statsLock_);
+
+   meanMs = minMs = maxMs = jitterMs = 0.0;
+   if (intervalCount_ == 0)
+      return;
+
+   double sum = 0.0;
+   minMs = maxMs = intervals_[0];
+   for (unsigned long i=0; i<intervalCount_; i++)
+   {
+      sum += intervals_[i];
+      if (intervals_[i] < minMs)
+         minMs = intervals_[i];
+      if (intervals_[i] > maxMs)
+         maxMs = intervals_[i];
+   }
+   meanMs = sum / intervalCount_;
 
-   // TODO: below is not working properly
-   //const unsigned avgSize = 10;
+   double sumSq = 0.0;
+   for (unsigned long i=0; i<intervalCount_; i++)
+      sumSq += (intervals_[i] - meanMs) * (intervals_[i] - meanMs);
+   jitterMs = sqrt(sumSq / intervalCount_);
+}
 
-   //if (insertIndex_ < 2 || imgArray_.size() < avgSize+2)
-   //   return 0.0;
+/**
+ * Number of frames between the save and the insert index.
+ * A save index that got ahead of the insert index (Clear() racing with the
+ * consumer) reads as empty.
+ */
+long CircularBuffer::Occupancy(long insertIndex, long saveIndex) const
+{
+   long size = (long)frameArray_.size();
+   if (size == 0)
+      return 0;
 
-   //double sum = 0.0;
-   //int count = 0;
-   //for (unsigned i=1; i<=avgSize; i++)
-   //{
-   //   sum += ((imgArray_[(insertIndex_-i) % imgArray_.size()].elapsedTimeMs - imgArray_[(insertIndex_-i-1) % imgArray_.size()].elapsedTimeMs));
-   //   count++;
-   //}
+   long range = IndexRange();
+   long count = (insertIndex - saveIndex + range) % range;
+   if (count > size)
+      return 0;
+   return count;
+}
 
-   //if (count > 0)
-   //   sum /= count;
+/**
+ * Indices run modulo a multiple of the buffer size, so that full and empty
+ * buffer can be told apart without a shared counter. The multiple is as
+ * large as the index arithmetic allows: in the lock-free mode the threads
+ * compare-and-swap the save index, and an index value must not come back
+ * while the other thread is between reading and swapping it.
+ */
+long CircularBuffer::IndexRange() const
+{
+   long size = (long)frameArray_.size();
+   return LONG_MAX / 2 / size * size;
+}
 
-   //return (double)((long)(sum + 0.5));
-   return (double)estimatedIntervalMs_;
+/**
+ * Moves the save index from the value the caller read to the given one.
+ * In the lock-free mode the producer or Clear() may have moved it in the
+ * meantime; the frames read at the old value may be overwritten already,
+ * so the caller has to start over. Returns false in that case.
+ */
+bool CircularBuffer::AdvanceSaveIndex(long saveIndex, long nextIndex)
+{
+   if (!lockFree_)
+   {
+      saveIndex_ = nextIndex;
+      return true;
+   }
+   return CompareAndSwap(saveIndex_.value_i(), saveIndex, nextIndex);
 }
 
-unsigned long CircularBuffer::GetClockTicksMs() const
+/**
+ * Number of frames the producer may fill before the buffer counts as full.
+ * When the consumer reads outside the lock, or the producer may overwrite,
+ * the slot handed to the consumer last is never given back to the producer.
+ */
+long CircularBuffer::Capacity() const
 {
-#ifdef __APPLE__
-      struct timeval t;
-      gettimeofday(&t,NULL);
-      return t.tv_sec * 1000L + t.tv_usec * 1000L;
-#else
-      ACE_High_Res_Timer timer;
-      ACE_Time_Value t = timer.gettimeofday();
-      return (unsigned long) (t.sec() * 1000L + t.usec() / 1000L);
-#endif
+   return (long)frameArray_.size() - ((lockFree_ || overwrite_ || readerHoldsFrame_) ? 1 : 0);
+}
+
+/**
+ * Makes sure the frame at insertIndex can be written. In the overwrite mode
+ * a full buffer drops its oldest frame: the frame storage of the oldest
+ * frame is swapped into the insert position, so that the storage last
+ * handed to the consumer stays untouched. Otherwise a full buffer flags
+ * the overflow and returns false.
+ */
+bool CircularBuffer::MakeRoom(long insertIndex)
+{
+   if (frameArray_.size() == 0)
+      return false;
+
+   long saveIndex = saveIndex_.value();
+   if (Capacity() - Occupancy(insertIndex, saveIndex) > 0)
+      return true;
+
+   // a frame still in the processing stages can not be dropped
+   if (!overwrite_ || Capacity() < 1 || Occupancy(ReadyIndex(), saveIndex) == 0)
+   {
+      overflow_ = true;
+      return false;
+   }
+
+   // the consumer popping the oldest frame at the same time makes room too;
+   // the storages are swapped only if the producer wins the frame
+   if (!AdvanceSaveIndex(saveIndex, NextIndex(saveIndex)))
+      return true;
+
+   unsigned long insertPos = insertIndex % frameArray_.size();
+   unsigned long oldestPos = saveIndex % frameArray_.size();
+   unsigned long oldest = slots_[oldestPos];
+   slots_[oldestPos] = slots_[insertPos];
+   slots_[insertPos] = oldest;
+   if (!discarded_[oldestPos])
+      droppedFrames_++;
+   return true;
+}
+
+FrameBuffer& CircularBuffer::FrameAt(long index)
+{
+   return frameArray_[slots_[index % slots_.size()]];
+}
+
+const FrameBuffer& CircularBuffer::FrameAt(long index) const
+{
+   return frameArray_[slots_[index % slots_.size()]];
+}
+
+/**
+ * Time of the frame from the camera supplied elapsed time, numeric or as a
+ * string tag, or a negative value if there is none. The interval statistics
+ * use it when available, so that they reflect the acquisition and not the
+ * delivery to the buffer.
+ */
+double CircularBuffer::CameraTimeMs(const Metadata* pMd, const FrameMetadata* pFrameMd) const
+{
+   double timeMs;
+   if (pFrameMd && pFrameMd->GetNumber(FrameKey_ElapsedTime, timeMs))
+      return timeMs;
+   if (pFrameMd)
+      pMd = &pFrameMd->GetTags();
+   const MetadataSingleTag* pTag = pMd ? pMd->FindSingleTag(MM::g_Keyword_Elapsed_Time_ms) : 0;
+   return pTag ? atof(pTag->GetValue().c_str()) : -1.0;
+}
+
+/**
+ * Adds the interval since the previous frame to the rolling statistics.
+ */
+void CircularBuffer::UpdateInterval(double timeMs)
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(statsLock_);
+
+   if (previousTimeMs_ >= 0.0)
+   {
+      intervals_[intervalPos_] = timeMs - previousTimeMs_;
+      intervalPos_ = (intervalPos_ + 1) % intervals_.size();
+      if (intervalCount_ < intervals_.size())
+         intervalCount_++;
+   }
+   previousTimeMs_ = timeMs;
+}
+
+void CircularBuffer::ResetIntervalStats()
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(statsLock_);
+   intervalPos_ = 0;
+   intervalCount_ = 0;
+   previousTimeMs_ = -1.0;
+}
+
+/**
+ * Attaches the camera supplied metadata and the time the core received the
+ * frame to the image. Frames without the camera elapsed time get the
+ * receive time as their elapsed time. The times are kept as numbers and
+ * formatted only if a consumer asks for the metadata.
+ */
+void CircularBuffer::SetFrameMetadata(ImgBuffer* pImg, const Metadata* pMd, const FrameMetadata* pFrameMd, bool stampElapsed, double receivedMs)
+{
+   if (pFrameMd)
+      pImg->SetFrameMetadata(*pFrameMd);
+   else if (pMd)
+      pImg->SetMetadata(*pMd);
+   else
+      pImg->ClearMetadata();
+   if (stampElapsed)
+      pImg->SetMetadataNumber(FrameKey_BufferElapsedTime, receivedMs);
+   pImg->SetMetadataNumber(FrameKey_ReceivedTime, receivedMs);
+}
+
+long CircularBuffer::NextIndex(long index) const
+{
+   return (index + 1) % IndexRange();
 }
@@ -33,6 +33,19 @@
 #include "ErrorCodes.h"
 #include "Error.h"
 
+#ifdef WIN32
+#pragma warning (disable : 4312 4244)
+#endif
+
+#include <ace/Mutex.h>
+#include <ace/Thread_Mutex.h>
+#include <ace/Condition_Thread_Mutex.h>
+#include <ace/Atomic_Op.h>
+
+#ifdef WIN32
+#pragma warning (default : 4312 4244)
+#endif
+
 #pragma warning( disable : 4290 ) // exception declaration warning
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -51,35 +64,136 @@ public:
    unsigned long GetFreeSize() const;
    unsigned long GetRemainingImageCount() const;
 
-   unsigned int Width() const {return width_;}
-   unsigned int Height() const {return height_;}
-   unsigned int Depth() const {return pixDepth_;}
+   // format of the images handed to the consumers
+   unsigned int Width() const {return outWidth_;}
+   unsigned int Height() const {return outHeight_;}
+   unsigned int Depth() const {return outDepth_;}
+   // format of the images inserted by the camera
+   unsigned int InputWidth() const {return width_;}
+   unsigned int InputHeight() const {return height_;}
+   unsigned int InputDepth() const {return pixDepth_;}
 
    bool InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError);
    bool InsertMultiChannel(const unsigned char* pixArray, unsigned int numChannels, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError);
+   unsigned char* ReserveSlot(unsigned int width, unsigned int height, unsigned int byteDepth) throw (CMMError);
+   bool CommitSlot(const Metadata* pMd);
+   bool CommitSlot(const FrameMetadata& md);
    const unsigned char* GetTopImage() const;
    const unsigned char* GetNextImage();
    const ImgBuffer* GetTopImageBuffer(unsigned channel, unsigned slice) const;
    const ImgBuffer* GetNextImageBuffer(unsigned channel, unsigned slice);
-   void Clear() {insertIndex_=0; saveIndex_=0; overflow_ = false;}
+   const FrameBuffer* GetNextFrame();
+   bool WaitForImage(long timeoutMs);
+   unsigned long CopyNextImages(unsigned char* dest, size_t destBytes, unsigned long maxCount, std::vector<Metadata>& metadata);
+   void Clear();
+
+   // identifies the frame a processing stage is working on
+   struct StageTicket
+   {
+      long index;
+      unsigned long epoch;
+   };
+   void SetProcessingStages(unsigned stages);
+   unsigned GetProcessingStages() const {return (unsigned)stageIndex_.size();}
+   FrameBuffer* WaitForStage(unsigned stage, long timeoutMs, StageTicket& ticket);
+   void CompleteStage(unsigned stage, const StageTicket& ticket, bool discard = false);
+   bool IsDiscarded(const StageTicket& ticket) const;
+   void SetProcessingFormat(unsigned width, unsigned height, unsigned byteDepth, size_t maxImageBytes, bool scratch);
+   unsigned char* GetScratchPixels(const StageTicket& ticket, unsigned channel);
+
+   void SetLockFree(bool lockFree);
+   bool IsLockFree() const {return lockFree_;}
+   void SetOverwrite(bool overwrite);
+   bool IsOverwrite() const {return overwrite_;}
+   void SetReaderHoldsFrame(bool holds);
+   long GetDroppedFrames() const {return droppedFrames_;}
+   void SetMemorySizeMB(unsigned int memorySizeMB);
+   unsigned int GetMemorySizeMB() const {return memorySizeMB_;}
+   void SetMaxFrames(unsigned long maxFrames);
+   unsigned long GetMaxFrames() const {return maxFrames_;}
+   size_t GetTotalBytes() const;
+   void SetMemoryOptions(bool hugePages, bool lockMemory);
+   bool UsesHugePages() const {return poolHuge_;}
+   bool IsMemoryLocked() const {return poolLocked_;}
 
    double GetAverageIntervalMs() const;
+   void GetIntervalStats(double& meanMs, double& minMs, double& maxMs, double& jitterMs) const;
    bool Overflow() {return overflow_;}
 
 private:
+   typedef ACE_Atomic_Op<ACE_Thread_Mutex, long> AtomicIndex;
+
    unsigned int width_;
    unsigned int height_;
    unsigned int pixDepth_;
-   long insertIndex_;
-   long saveIndex_;
+   unsigned int outWidth_;
+   unsigned int outHeight_;
+   unsigned int outDepth_;
+   unsigned int fmtWidth_;    // output format requested by the processing stages, 0 if none
+   unsigned int fmtHeight_;
+   unsigned int fmtDepth_;
+   size_t fmtMaxBytes_;       // largest image passing through the stages
+   bool fmtScratch_;          // every image gets a second storage for out-of-place stages
+   size_t imageStride_;
+   size_t scratchOffset_;     // from an image storage to its second storage, 0 if none
+   AtomicIndex insertIndex_;
+   AtomicIndex saveIndex_;
+   AtomicIndex readyIndex_;   // end of the frames that passed all processing stages
+   std::vector<long> stageIndex_; // next frame of each processing stage, guarded by waitLock_
+   unsigned long stageEpoch_;     // counts the resets of the stages, guarded by waitLock_
+   long reservedIndex_;
+   bool lockFree_;
+   bool overwrite_;
+   bool readerHoldsFrame_;    // the consumer keeps using the last frame after the pop
+   long droppedFrames_;
    unsigned int memorySizeMB_;
+   unsigned long maxFrames_;
+   size_t frameSizeBytes_;
    unsigned int numChannels_;
    unsigned int numSlices_;
    bool overflow_;
-   long estimatedIntervalMs_;
+   std::vector<double> intervals_; // rolling window of inter-frame intervals
+   unsigned long intervalPos_;
+   unsigned long intervalCount_;
+   double previousTimeMs_;         // arrival of the previous frame, < 0 if none
+   mutable ACE_Thread_Mutex statsLock_;
+   mutable ACE_Mutex bufferLock_;
+   ACE_Thread_Mutex waitLock_;
+   ACE_Condition_Thread_Mutex frameArrived_;
+   int waiters_;              // consumers and stages blocked on frameArrived_, guarded by waitLock_
    std::vector<FrameBuffer> frameArray_;
+   std::vector<unsigned long> slots_; // frame storage at each ring position
+   std::vector<char> discarded_;      // at each ring position: a stage dropped the frame
+   unsigned char* pool_;      // contiguous pixel memory shared by all frames
+   size_t poolSize_;
+   bool poolHuge_;            // pool_ is backed by huge pages
+   bool poolLocked_;          // pool_ is locked in physical memory
+   bool hugePages_;
+   bool lockMemory_;
 
-   unsigned long GetClockTicksMs() const;
+   double CameraTimeMs(const Metadata* pMd, const FrameMetadata* pFrameMd) const;
+   void UpdateInterval(double timeMs);
+   void ResetIntervalStats();
+   void NotifyWaiters();
+   void ResetStages(long index);
+   long ReadyIndex() const;
+   long SkipDiscarded(long saveIndex) const;
+   long VisibleCount(long saveIndex) const;
+   unsigned char* ImageStorage(long index, unsigned channel, unsigned slice);
+   void RestoreInputFormat(long index);
+   bool AllocatePool(size_t bytes);
+   void ReleasePool();
+   void ReleaseFrames();
+   bool PublishSlot(const Metadata* pMd, const FrameMetadata* pFrameMd);
+   void SetFrameMetadata(ImgBuffer* pImg, const Metadata* pMd, const FrameMetadata* pFrameMd, bool stampElapsed, double receivedMs);
+   long Occupancy(long insertIndex, long saveIndex) const;
+   long IndexRange() const;
+   bool AdvanceSaveIndex(long saveIndex, long nextIndex);
+   long Capacity() const;
+   bool MakeRoom(long insertIndex);
+   FrameBuffer& FrameAt(long index);
+   const FrameBuffer& FrameAt(long index) const;
+   long NextIndex(long index) const;
 
 };
 
@@ -0,0 +1,278 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CodecStage.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pool of core threads compressing the frames on their way
+//                from the circular buffer to an image streamer device.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// CVS:           $Id$
+//
+#include "CodecStage.h"
+#include "../MMDevice/ImgBuffer.h"
+#include "../MMDevice/ImageCodec.h"
+#include <ace/Guard_T.h>
+#include <ace/OS.h>
+#include <new>
+#include <string.h>
+
+const long codecWaitMs = 100; // how often an idle thread checks for the stop request
+
+CodecStage::CodecStage(unsigned threads, unsigned slots) :
+   threads_(threads), slots_(slots > 0 ? slots : 1), width_(0), height_(0), depth_(0), tiles_(0),
+   oldest_(0), queued_(0), started_(false), stop_(false), workReady_(lock_), unitDone_(lock_)
+{
+}
+
+CodecStage::~CodecStage()
+{
+   Stop();
+}
+
+/**
+ * Allocates the slots for frames of the given format and starts the
+ * threads. Returns false if the format can not be compressed or the
+ * memory is not available.
+ */
+bool CodecStage::Start(unsigned width, unsigned height, unsigned depth)
+{
+   if (started_ || !ImageCodec::CanCompress(depth) || width == 0 || height == 0)
+      return false;
+
+   width_ = width;
+   height_ = height;
+   depth_ = depth;
+   tiles_ = ImageCodec::TileCount(height);
+   oldest_ = 0;
+   queued_ = 0;
+   try
+   {
+      // room for one channel; frames with more channels grow their slot
+      for (unsigned i=0; i<slots_.size(); i++)
+      {
+         Slot& slot = slots_[i];
+         slot.channels = 0;
+         slot.pixels.assign(1, std::vector<unsigned char>((size_t)width * height * depth));
+         slot.compressed.assign(1, std::vector<unsigned char>(ImageCodec::MaxCompressedBytes(width, height, depth)));
+         slot.compressedBytes.assign(1, 0);
+         slot.tileBytes.assign(tiles_, 0);
+         slot.metadata.assign(1, FrameMetadata());
+         slot.nextUnit = 0;
+         slot.unitsLeft = 0;
+      }
+   }
+   catch (std::bad_alloc&)
+   {
+      slots_.assign(slots_.size(), Slot());
+      return false;
+   }
+
+   stop_ = false;
+   started_ = true;
+   if (threads_ > 0)
+      activate(THR_NEW_LWP | THR_JOINABLE, (int)threads_);
+   return true;
+}
+
+/**
+ * Stops the threads. Frames still in the slots are dropped.
+ */
+void CodecStage::Stop()
+{
+   if (!started_)
+      return;
+
+   {
+      ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+      stop_ = true;
+      workReady_.broadcast();
+   }
+   if (threads_ > 0)
+      wait();
+   started_ = false;
+   queued_ = 0;
+}
+
+bool CodecStage::HasFreeSlot() const
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+   return queued_ < slots_.size();
+}
+
+unsigned CodecStage::GetQueuedCount() const
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+   return queued_;
+}
+
+/**
+ * Copies the images of the frame into the next free slot and hands its
+ * tiles to the threads. Requires HasFreeSlot().
+ */
+void CodecStage::Submit(const FrameBuffer& frame)
+{
+   unsigned index;
+   {
+      ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+      index = (oldest_ + queued_) % (unsigned)slots_.size();
+   }
+
+   // the slot is not visible to the threads yet
+   Slot& slot = slots_[index];
+   unsigned channels = 0;
+   for (const ImgBuffer* pImg; (pImg = frame.FindImage(channels, 0)) != 0; channels++)
+   {
+      if (channels == slot.pixels.size())
+      {
+         slot.pixels.push_back(std::vector<unsigned char>(slot.pixels[0].size()));
+         slot.compressed.push_back(std::vector<unsigned char>(slot.compressed[0].size()));
+         slot.compressedBytes.push_back(0);
+         slot.tileBytes.resize(slot.tileBytes.size() + tiles_);
+         slot.metadata.push_back(FrameMetadata());
+      }
+      memcpy(&slot.pixels[channels][0], pImg->GetPixels(), slot.pixels[channels].size());
+      slot.metadata[channels] = pImg->GetFrameMetadata();
+   }
+
+   ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+   slot.channels = channels;
+   slot.nextUnit = 0;
+   slot.unitsLeft = channels * tiles_;
+   queued_++;
+   workReady_.broadcast();
+}
+
+/**
+ * Completes the compression of the oldest frame: compresses the tiles no
+ * thread has taken yet, waits for the others and assembles the channels.
+ * Returns the number of channels. Requires GetQueuedCount() > 0.
+ */
+unsigned CodecStage::FinishOldest()
+{
+   unsigned slot, unit;
+   while (TakeUnit(slot, unit, true))
+      CompressUnit(slot, unit);
+
+   Slot& oldest = slots_[oldest_];
+   {
+      ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+      while (oldest.unitsLeft > 0)
+      {
+         ACE_Time_Value deadline = ACE_OS::gettimeofday() + ACE_Time_Value(0, codecWaitMs * 1000);
+         unitDone_.wait(&deadline);
+      }
+   }
+
+   for (unsigned ch=0; ch<oldest.channels; ch++)
+      oldest.compressedBytes[ch] = ImageCodec::Assemble(&oldest.compressed[ch][0], width_, height_, depth_, &oldest.tileBytes[ch * tiles_]);
+   return oldest.channels;
+}
+
+/**
+ * Compressed image of the given channel of the oldest frame, valid after
+ * FinishOldest() until ReleaseOldest().
+ */
+const unsigned char* CodecStage::GetImage(unsigned channel, size_t& bytes) const
+{
+   const Slot& oldest = slots_[oldest_];
+   if (channel >= oldest.channels)
+   {
+      bytes = 0;
+      return 0;
+   }
+   bytes = oldest.compressedBytes[channel];
+   return &oldest.compressed[channel][0];
+}
+
+/**
+ * Metadata of the given channel of the oldest frame. The frames keep the
+ * compact metadata of the buffer until they are saved.
+ */
+void CodecStage::GetMetadata(unsigned channel, Metadata& md) const
+{
+   slots_[oldest_].metadata[channel].ToMetadata(md);
+}
+
+/**
+ * Gives the slot of the oldest frame back for the next Submit().
+ */
+void CodecStage::ReleaseOldest()
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+   if (queued_ == 0)
+      return;
+   oldest_ = (oldest_ + 1) % (unsigned)slots_.size();
+   queued_--;
+}
+
+/**
+ * Thread procedure: compresses tiles, oldest frames first, until stopped.
+ */
+int CodecStage::svc()
+{
+   while (!stop_)
+   {
+      unsigned slot, unit;
+      if (TakeUnit(slot, unit, false))
+      {
+         CompressUnit(slot, unit);
+         continue;
+      }
+
+      ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+      if (stop_)
+         break;
+      ACE_Time_Value deadline = ACE_OS::gettimeofday() + ACE_Time_Value(0, codecWaitMs * 1000);
+      workReady_.wait(&deadline);
+   }
+   return 0;
+}
+
+/**
+ * Hands out the next tile that nobody works on, from the oldest frame
+ * that has one, or only from the oldest frame.
+ */
+bool CodecStage::TakeUnit(unsigned& slot, unsigned& unit, bool oldestOnly)
+{
+   ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+   unsigned frames = oldestOnly && queued_ > 0 ? 1 : queued_;
+   for (unsigned i=0; i<frames; i++)
+   {
+      unsigned index = (oldest_ + i) % (unsigned)slots_.size();
+      Slot& s = slots_[index];
+      if (s.nextUnit < s.channels * tiles_)
+      {
+         slot = index;
+         unit = s.nextUnit++;
+         return true;
+      }
+   }
+   return false;
+}
+
+void CodecStage::CompressUnit(unsigned slot, unsigned unit)
+{
+   Slot& s = slots_[slot];
+   unsigned ch = unit / tiles_;
+   unsigned tile = unit % tiles_;
+   unsigned char* pDst = ImageCodec::TileSlot(&s.compressed[ch][0], width_, height_, depth_, tile);
+   size_t bytes = ImageCodec::CompressTile(&s.pixels[ch][0], width_, height_, depth_, tile, pDst);
+
+   ACE_Guard<ACE_Thread_Mutex> guard(lock_);
+   s.tileBytes[unit] = bytes;
+   if (--s.unitsLeft == 0)
+      unitDone_.broadcast();
+}
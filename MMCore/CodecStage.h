@@ -0,0 +1,100 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CodecStage.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pool of core threads compressing the frames on their way
+//                from the circular buffer to an image streamer device.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// CVS:           $Id$
+//
+#ifndef _CODEC_STAGE_H_
+#define _CODEC_STAGE_H_
+
+#include <vector>
+#include <ace/Task.h>
+#include <ace/Thread_Mutex.h>
+#include <ace/Condition_Thread_Mutex.h>
+#include "../MMDevice/FrameMetadata.h"
+
+class FrameBuffer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CodecStage class
+// ~~~~~~~~~~~~~~~~
+// The frames are copied into a small ring of slots, so that the circular
+// buffer gets them back at once, and compressed with ImageCodec. The unit
+// of work is one tile of one channel: the threads take the tiles of the
+// oldest frames first, so that several frames are in compression at the
+// same time while the oldest one finishes as soon as possible. The thread
+// saving the frames helps with the tiles of the oldest frame instead of
+// waiting for it. Used by the StreamWriter thread only.
+
+class CodecStage : public ACE_Task_Base
+{
+public:
+   CodecStage(unsigned threads, unsigned slots);
+   ~CodecStage();
+
+   bool Start(unsigned width, unsigned height, unsigned depth);
+   void Stop();
+
+   bool HasFreeSlot() const;
+   unsigned GetQueuedCount() const;
+   void Submit(const FrameBuffer& frame);
+   unsigned FinishOldest();
+   const unsigned char* GetImage(unsigned channel, size_t& bytes) const;
+   void GetMetadata(unsigned channel, Metadata& md) const;
+   void ReleaseOldest();
+
+   int svc();
+
+private:
+   struct Slot
+   {
+      unsigned channels;
+      std::vector<std::vector<unsigned char> > pixels;     // copy of each channel
+      std::vector<std::vector<unsigned char> > compressed; // of each channel
+      std::vector<size_t> compressedBytes;
+      std::vector<size_t> tileBytes;                       // channels x tiles
+      std::vector<FrameMetadata> metadata;
+      unsigned nextUnit;   // next tile to hand out
+      unsigned unitsLeft;  // tiles not compressed yet
+   };
+
+   CodecStage(const CodecStage&);
+   CodecStage& operator=(const CodecStage&);
+
+   bool TakeUnit(unsigned& slot, unsigned& unit, bool oldestOnly);
+   void CompressUnit(unsigned slot, unsigned unit);
+
+   unsigned threads_;
+   std::vector<Slot> slots_;
+   unsigned width_;
+   unsigned height_;
+   unsigned depth_;
+   unsigned tiles_;       // per channel
+   unsigned oldest_;      // slot of the oldest frame
+   unsigned queued_;      // frames in the slots
+   bool started_;
+   volatile bool stop_;
+   mutable ACE_Thread_Mutex lock_;
+   ACE_Condition_Thread_Mutex workReady_;
+   ACE_Condition_Thread_Mutex unitDone_;
+};
+
+#endif //_CODEC_STAGE_H_
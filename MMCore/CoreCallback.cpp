@@ -34,11 +34,11 @@
 #include <ace/Mutex.h>
 #include <ace/Guard_T.h>
 
-int CoreCallback::InsertImage(const MM::Device* /*caller*/, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd)
+int CoreCallback::InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd)
 {
    try 
    {
-      if (core_->cbuf_->InsertImage(buf, width, height, byteDepth, pMd))
+      if (core_->getCircularBuffer(caller)->InsertImage(buf, width, height, byteDepth, pMd))
          return DEVICE_OK;
       else
          return DEVICE_BUFFER_OVERFLOW;
@@ -56,17 +56,17 @@ int CoreCallback::InsertImage(const MM::Device* caller, const ImgBuffer & imgBuf
       imgBuf.Height(), imgBuf.Depth(), &md);
 }
 
-void CoreCallback::ClearImageBuffer(const MM::Device* /*caller*/)
+void CoreCallback::ClearImageBuffer(const MM::Device* caller)
 {
-   core_->cbuf_->Clear();
+   core_->getCircularBuffer(caller)->Clear();
 }
 
-bool CoreCallback::InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth)
+bool CoreCallback::InitializeImageBuffer(const MM::Device* caller, unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth)
 {
-   return core_->cbuf_->Initialize(channels, slices, w, h, pixDepth);
+   return core_->getCircularBuffer(caller)->Initialize(channels, slices, w, h, pixDepth);
 }
 
-int CoreCallback::InsertMultiChannel(const MM::Device* /*caller*/,
+int CoreCallback::InsertMultiChannel(const MM::Device* caller,
                               const unsigned char* buf,
                               unsigned numChannels,
                               unsigned width,
@@ -76,7 +76,7 @@ int CoreCallback::InsertMultiChannel(const MM::Device* /*caller*/,
 {
    try
    {
-      if (core_->cbuf_->InsertMultiChannel(buf, numChannels, width, height, byteDepth, pMd))
+      if (core_->getCircularBuffer(caller)->InsertMultiChannel(buf, numChannels, width, height, byteDepth, pMd))
          return DEVICE_OK;
       else
          return DEVICE_BUFFER_OVERFLOW;
@@ -88,6 +88,39 @@ int CoreCallback::InsertMultiChannel(const MM::Device* /*caller*/,
 
 }
 
+int CoreCallback::AcquireImageSlot(const MM::Device* caller, unsigned width, unsigned height, unsigned byteDepth, unsigned char*& pSlot)
+{
+   try
+   {
+      pSlot = core_->getCircularBuffer(caller)->ReserveSlot(width, height, byteDepth);
+      if (pSlot)
+         return DEVICE_OK;
+      else
+         return DEVICE_BUFFER_OVERFLOW;
+   }
+   catch (CMMError& /*e*/)
+   {
+      pSlot = 0;
+      return DEVICE_INCOMPATIBLE_IMAGE;
+   }
+}
+
+int CoreCallback::CommitImageSlot(const MM::Device* caller, const Metadata* pMd)
+{
+   if (core_->getCircularBuffer(caller)->CommitSlot(pMd))
+      return DEVICE_OK;
+   else
+      return DEVICE_ERR;
+}
+
+int CoreCallback::CommitImageSlot(const MM::Device* caller, const FrameMetadata& md)
+{
+   if (core_->getCircularBuffer(caller)->CommitSlot(md))
+      return DEVICE_OK;
+   else
+      return DEVICE_ERR;
+}
+
 void CoreCallback::SetAcqStatus(const MM::Device* /*caller*/, int /*statusCode*/)
 {
    // ???
@@ -172,8 +172,11 @@ public:
    int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd = 0);
    int InsertMultiChannel(const MM::Device* caller, const unsigned char* buf, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, Metadata* pMd = 0);
    void SetAcqStatus(const MM::Device* caller, int statusCode);
+   int AcquireImageSlot(const MM::Device* caller, unsigned width, unsigned height, unsigned byteDepth, unsigned char*& pSlot);
+   int CommitImageSlot(const MM::Device* caller, const Metadata* pMd = 0);
+   int CommitImageSlot(const MM::Device* caller, const FrameMetadata& md);
    void ClearImageBuffer(const MM::Device* caller);
-   bool InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth);
+   bool InitializeImageBuffer(const MM::Device* caller, unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth);
 
    int OpenFrame(const MM::Device* caller);
    int CloseFrame(const MM::Device* caller);
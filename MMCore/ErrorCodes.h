@@ -72,5 +72,7 @@
 #define MMERR_BadConfigName            44
 #define MMERR_CircularBufferIncompatibleImage  45
 #define MMERR_NotAllowedDuringSequenceAcquisition  46
+#define MMERR_ImageStreamingFailed     47
+#define MMERR_ProcessorNotInChain      48
 
 #endif //_ERRORCODES_H_
@@ -76,6 +76,9 @@
 #include "CoreCallback.h"
 #include "CoreProperty.h"
 #include "CircularBuffer.h"
+#include "StreamWriter.h"
+#include "../MMDevice/ImageCodec.h"
+#include "ProcessorChain.h"
 #include <assert.h>
 #include <sstream>
 #include <algorithm>
@@ -116,7 +119,7 @@ ACE_Mutex CMMCore::deviceLock_;
  */
 CMMCore::CMMCore() :
    camera_(0), shutter_(0), focusStage_(0), xyStage_(0), autoFocus_(0), imageProcessor_(0), pollingIntervalMs_(10), timeoutMs_(5000),
-   logStream_(0), autoShutter_(true), callback_(0), configGroups_(0), properties_(0), externalCallback_(0), pixelSizeGroup_(0), cbuf_(0)
+   logStream_(0), autoShutter_(true), callback_(0), configGroups_(0), properties_(0), externalCallback_(0), pixelSizeGroup_(0), cbuf_(0), bufferHugePages_(false), bufferLockMemory_(false), streamWriter_(0), streamer_(0), streamedImages_(0), streamingThreads_(4), processorChain_(0)
 {
    configGroups_ = new ConfigGroupCollection();
    pixelSizeGroup_ = new PixelSizeConfigGroup();
@@ -165,6 +168,8 @@ CMMCore::CMMCore() :
    errorText_[MMERR_ContFocusNotAvailable] = "Auto-focus focus device not defined.";
    errorText_[MMERR_BadConfigName] = "Configuration name contains illegale characters (/\\*!')";
    errorText_[MMERR_NotAllowedDuringSequenceAcquisition] = "This operation can not be executed while sequence acquisition is runnning.";
+   errorText_[MMERR_ImageStreamingFailed] = "Image streaming failed.";
+   errorText_[MMERR_ProcessorNotInChain] = "Device is not in the image processor chain.";
 
    initializeLogging();
    CORE_LOG("-------->>\n");
@@ -173,6 +178,7 @@ CMMCore::CMMCore() :
 
    callback_ = new CoreCallback(this);
    cbuf_ = new CircularBuffer(10); // allocate 10MB initially
+   processorChain_ = new ProcessorChain();
 
    // build the core property collection
    properties_ = new CorePropertyCollection(this);
@@ -241,6 +247,8 @@ CMMCore::~CMMCore()
       CORE_LOG("Exception occured in MMCore destructor.\n");
       ; // don't let any exceptions leak through
    }
+   closeImageStreaming(); // in case reset() failed before unloading the devices
+   stopProcessorChain();
    CORE_LOG("Core session ended on %D\n");
 
    shutdownLogging();
@@ -249,7 +257,9 @@ CMMCore::~CMMCore()
    delete callback_;
    delete configGroups_;
    delete properties_;
+   delete processorChain_;
    delete cbuf_;
+   deleteCameraBuffers();
    delete pixelSizeGroup_;
 }
 
@@ -563,6 +573,9 @@ void CMMCore::loadDevice(const char* label, const char* library, const char* dev
             assert(camera_);
             */
             camera_ = static_cast<MM::Camera*>(pDevice);
+            // reserve the entry now, so that the map never changes its
+            // structure while other cameras are streaming
+            cameraBuffers_[pDevice] = 0;
             CORE_LOG1("Device %s set as camera.\n", label);
          break;
 
@@ -616,8 +629,14 @@ void CMMCore::unloadAllDevices() throw (CMMError)
       autoFocus_ = 0;
       imageProcessor_ = 0;
 
+      // the writer thread must not outlive the streamer device
+      closeImageStreaming();
+      stopProcessorChain();
+      chainProcessors_.clear();
+
       // unload modules
       pluginManager_.UnloadAllDevices();
+      deleteCameraBuffers();
       CORE_LOG("All devices unloaded.\n");
       imageSynchro_.clear();
       
@@ -1483,12 +1502,9 @@ void CMMCore::startSequenceAcquisition(long numImages, double intervalMs, bool s
             ,MMERR_NotAllowedDuringSequenceAcquisition);
       }
 
-      if (!cbuf_->Initialize(camera_->GetNumberOfChannels(), 1, camera_->GetImageWidth(), camera_->GetImageHeight(), camera_->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera_).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
-      cbuf_->Clear();
+      initializeCircularBuffer(camera_, getCircularBuffer(camera_));
+      // without stopping on overflow the buffer drops its oldest frames
+      getCircularBuffer(camera_)->SetOverwrite(!stopOnOverflow);
       int nRet = camera_->StartSequenceAcquisition(numImages, intervalMs, stopOnOverflow);
       if (nRet != DEVICE_OK)
          throw CMMError(getDeviceErrorText(nRet, camera_).c_str(), MMERR_DEVICE_GENERIC);
@@ -1505,7 +1521,10 @@ void CMMCore::startSequenceAcquisition(long numImages, double intervalMs, bool s
  * Starts straming camera sequence acquisition for a specified camera.
  * This command does not block the calling thread for the uration of the acquisition.
  * The difference between this method and the one with the same name but operating on the "default"
- * camera is that it does not automatically intitialize the circular buffer.
+ * camera is that it does not automatically intitialize the circular buffer of the current camera.
+ * Any other camera gets its own circular buffer, sized according to its current settings,
+ * so that several cameras can stream at the same time. Images from such a camera are
+ * retrieved with popNextImage(label) and getLastImage(label).
  */
 void CMMCore::startSequenceAcquisition(const char* label, long numImages, double intervalMs, bool stopOnOverflow) throw (CMMError)
 {
@@ -1514,6 +1533,20 @@ void CMMCore::startSequenceAcquisition(const char* label, long numImages, double
    if(pCam->IsCapturing())
       throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(), 
                      MMERR_NotAllowedDuringSequenceAcquisition);
+
+   CCameraBufferMap::iterator it = cameraBuffers_.find(pCam);
+   if (it != cameraBuffers_.end() && (pCam != camera_ || it->second != 0))
+   {
+      if (it->second == 0)
+      {
+         it->second = new CircularBuffer(cbuf_->GetMemorySizeMB());
+         it->second->SetLockFree(cbuf_->IsLockFree());
+         it->second->SetMemoryOptions(bufferHugePages_, bufferLockMemory_);
+         it->second->SetMaxFrames(cbuf_->GetMaxFrames());
+      }
+      initializeCircularBuffer(pCam, it->second);
+   }
+   getCircularBuffer(pCam)->SetOverwrite(!stopOnOverflow);
    
    int nRet = pCam->StartSequenceAcquisition(numImages, intervalMs, stopOnOverflow);
    if (nRet != DEVICE_OK)
@@ -1549,12 +1582,7 @@ void CMMCore::intializeCircularBuffer() throw (CMMError)
 {
    if (camera_)
    {
-      if (!cbuf_->Initialize(camera_->GetNumberOfChannels(), 1, camera_->GetImageWidth(), camera_->GetImageHeight(), camera_->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera_).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
-      cbuf_->Clear();
+      initializeCircularBuffer(camera_, getCircularBuffer(camera_));
    }
    else
    {
@@ -1564,6 +1592,106 @@ void CMMCore::intializeCircularBuffer() throw (CMMError)
    CORE_DEBUG("Circular buffer intitialized based on the current camera.\n");
 }
 
+/**
+ * Returns the circular buffer the specified camera inserts into: its own buffer
+ * if it has one, otherwise the default one.
+ * The lookup is lock-free, because entries are added only when cameras get loaded.
+ */
+CircularBuffer* CMMCore::getCircularBuffer(const MM::Device* pCam) const
+{
+   CCameraBufferMap::const_iterator it = cameraBuffers_.find(pCam);
+   if (it != cameraBuffers_.end() && it->second != 0)
+      return it->second;
+   return cbuf_;
+}
+
+/**
+ * Sizes the circular buffer for the current settings of the camera and empties it.
+ */
+void CMMCore::initializeCircularBuffer(MM::Camera* pCam, CircularBuffer* pBuf) throw (CMMError)
+{
+   // the stages must not hold frames while the buffer is reallocated
+   bool chained = !chainProcessors_.empty() && camera_ != 0 && pBuf == getCircularBuffer(camera_);
+   if (chained || processorChain_->GetBuffer() == pBuf)
+      processorChain_->Stop();
+
+   // the images must have room for every format produced by the chain
+   ProcessorChain::Format input;
+   input.width = pCam->GetImageWidth();
+   input.height = pCam->GetImageHeight();
+   input.byteDepth = pCam->GetImageBytesPerPixel();
+   std::vector<ProcessorChain::Format> formats(1, input);
+   if (chained)
+   {
+      int nRet = ProcessorChain::Negotiate(chainProcessors_, input, formats);
+      if (nRet != DEVICE_OK)
+      {
+         MM::ImageProcessor* pProc = chainProcessors_[formats.size() - 1];
+         logError(getDeviceName(pProc).c_str(), getDeviceErrorText(nRet, pProc).c_str());
+         throw CMMError(getDeviceErrorText(nRet, pProc).c_str(), MMERR_DEVICE_GENERIC);
+      }
+   }
+   size_t maxImageBytes = 0;
+   bool scratch = false;
+   for (size_t i=0; i<formats.size(); i++)
+   {
+      size_t bytes = (size_t)formats[i].width * formats[i].height * formats[i].byteDepth;
+      if (bytes > maxImageBytes)
+         maxImageBytes = bytes;
+      if (i > 0 && ProcessorChain::IsOutOfPlace(chainProcessors_[i-1], formats[i-1], formats[i]))
+         scratch = true;
+   }
+   if (chained)
+      pBuf->SetProcessingFormat(formats.back().width, formats.back().height, formats.back().byteDepth, maxImageBytes, scratch);
+   else
+      pBuf->SetProcessingFormat(0, 0, 0, 0, false);
+
+   bool initialized = pBuf->Initialize(pCam->GetNumberOfChannels(), 1, input.width, input.height, input.byteDepth);
+   if (initialized && chained)
+   {
+      int nRet = processorChain_->Start(pBuf, chainProcessors_);
+      if (nRet != DEVICE_OK)
+         throw CMMError(getCoreErrorText(MMERR_DEVICE_GENERIC).c_str(), MMERR_DEVICE_GENERIC);
+   }
+   if (!initialized)
+   {
+      logError(getDeviceName(pCam).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
+   }
+   pBuf->Clear();
+}
+
+/**
+ * Throws if any camera owning a dedicated circular buffer is streaming, or
+ * images are being streamed to disk.
+ */
+void CMMCore::checkCameraBuffersIdle() const throw (CMMError)
+{
+   if (streamWriter_)
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+
+   CCameraBufferMap::const_iterator it;
+   for (it = cameraBuffers_.begin(); it != cameraBuffers_.end(); it++)
+   {
+      MM::Camera* pCam = static_cast<MM::Camera*>(const_cast<MM::Device*>(it->first));
+      if (it->second != 0 && pCam->IsCapturing())
+         throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                        MMERR_NotAllowedDuringSequenceAcquisition);
+   }
+}
+
+/**
+ * Releases the dedicated circular buffers of all cameras.
+ */
+void CMMCore::deleteCameraBuffers()
+{
+   CCameraBufferMap::iterator it;
+   for (it = cameraBuffers_.begin(); it != cameraBuffers_.end(); it++)
+      delete it->second;
+   cameraBuffers_.clear();
+}
+
 /**
  * Stops streming camera sequence acquisition for a specified camera.
  */
@@ -1595,12 +1723,8 @@ void CMMCore::startContinuousSequenceAcquisition(double intervalMs) throw (CMMEr
             ,MMERR_NotAllowedDuringSequenceAcquisition);
       }
 
-      if (!cbuf_->Initialize(camera_->GetNumberOfChannels(), 1, camera_->GetImageWidth(), camera_->GetImageHeight(), camera_->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera_).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
-      cbuf_->Clear();
+      initializeCircularBuffer(camera_, getCircularBuffer(camera_));
+      getCircularBuffer(camera_)->SetOverwrite(true);
       int nRet = camera_->StartSequenceAcquisition(intervalMs);
       if (nRet != DEVICE_OK)
          throw CMMError(getDeviceErrorText(nRet, camera_).c_str(), MMERR_DEVICE_GENERIC);
@@ -1661,7 +1785,7 @@ bool CMMCore::isSequenceRunning(const char* label) throw (CMMError)
  */
 void* CMMCore::getLastImage() const throw (CMMError)
 {
-   unsigned char* pBuf = const_cast<unsigned char*>(cbuf_->GetTopImage());
+   unsigned char* pBuf = const_cast<unsigned char*>(getCircularBuffer(camera_)->GetTopImage());
    if (pBuf != 0)
       return pBuf;
    else
@@ -1671,9 +1795,25 @@ void* CMMCore::getLastImage() const throw (CMMError)
    }
 }
 
+/**
+ * Gets the last image from the circular buffer of the specified camera.
+ */
+void* CMMCore::getLastImage(const char* label) const throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   unsigned char* pBuf = const_cast<unsigned char*>(getCircularBuffer(pCam)->GetTopImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+   {
+      logError(label, getCoreErrorText(MMERR_CircularBufferEmpty).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   }
+}
+
 void* CMMCore::getLastImageMD(unsigned channel, unsigned slice, Metadata& md) const throw (CMMError)
 {
-   const ImgBuffer* pBuf = cbuf_->GetTopImageBuffer(channel, slice);
+   const ImgBuffer* pBuf = getCircularBuffer(camera_)->GetTopImageBuffer(channel, slice);
    if (pBuf != 0)
    {
       md = pBuf->GetMetadata();
@@ -1689,7 +1829,20 @@ void* CMMCore::getLastImageMD(unsigned channel, unsigned slice, Metadata& md) co
  */
 void* CMMCore::popNextImage() throw (CMMError)
 {
-   unsigned char* pBuf = const_cast<unsigned char*>(cbuf_->GetNextImage());
+   unsigned char* pBuf = const_cast<unsigned char*>(getCircularBuffer(camera_)->GetNextImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Gets and removes the next image from the circular buffer of the specified camera.
+ */
+void* CMMCore::popNextImage(const char* label) throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   unsigned char* pBuf = const_cast<unsigned char*>(getCircularBuffer(pCam)->GetNextImage());
    if (pBuf != 0)
       return pBuf;
    else
@@ -1698,7 +1851,7 @@ void* CMMCore::popNextImage() throw (CMMError)
 
 void* CMMCore::popNextImageMD(unsigned channel, unsigned slice, Metadata& md) throw (CMMError)
 {
-   const ImgBuffer* pBuf = cbuf_->GetNextImageBuffer(channel, slice);
+   const ImgBuffer* pBuf = getCircularBuffer(camera_)->GetNextImageBuffer(channel, slice);
    if (pBuf != 0)
    {
       md = pBuf->GetMetadata();
@@ -1708,6 +1861,59 @@ void* CMMCore::popNextImageMD(unsigned channel, unsigned slice, Metadata& md) th
       throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
 }
 
+void* CMMCore::popNextImageMD(const char* label, unsigned channel, unsigned slice, Metadata& md) throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   const ImgBuffer* pBuf = getCircularBuffer(pCam)->GetNextImageBuffer(channel, slice);
+   if (pBuf != 0)
+   {
+      md = pBuf->GetMetadata();
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Removes up to maxCount images from the circular buffer at once and copies
+ * them back to back into the supplied array of pixelsBytes bytes, in the order
+ * they were acquired. Multi-channel images are copied channel after channel.
+ * The metadata of each image is returned in the metadata vector.
+ * This is much cheaper than calling popNextImage() repeatedly, e.g. when a
+ * writer catches up after a stall.
+ * @return number of images copied, 0 if the buffer is empty
+ */
+long CMMCore::popNextImages(void* pixels, long pixelsBytes, long maxCount, std::vector<Metadata>& metadata)
+{
+   if (pixels == 0 || pixelsBytes <= 0 || maxCount <= 0)
+   {
+      metadata.clear();
+      return 0;
+   }
+   return (long)getCircularBuffer(camera_)->CopyNextImages((unsigned char*)pixels, (size_t)pixelsBytes, (unsigned long)maxCount, metadata);
+}
+
+/**
+ * Blocks until the circular buffer holds an image or the timeout expires.
+ * The waiting thread is woken up as soon as the camera inserts an image, so
+ * it is not necessary to poll getRemainingImageCount().
+ * @return true if an image is ready to be popped, false on timeout
+ */
+bool CMMCore::waitForNextImage(long timeoutMs)
+{
+   return getCircularBuffer(camera_)->WaitForImage(timeoutMs);
+}
+
+/**
+ * Blocks until the circular buffer of the specified camera holds an image or
+ * the timeout expires.
+ */
+bool CMMCore::waitForNextImage(const char* label, long timeoutMs) throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   return getCircularBuffer(pCam)->WaitForImage(timeoutMs);
+}
+
 long CMMCore::snapImageMD() throw (CMMError)
 {
    return 0;
@@ -1730,42 +1936,539 @@ Metadata CMMCore::getImageMetadata(long /*handle*/, unsigned /*channel*/, unsign
  */
 void CMMCore::setCircularBufferMemoryFootprint(unsigned sizeMB) throw (CMMError)
 {
-   delete cbuf_; // discard old buffer
-   cbuf_ = new CircularBuffer(sizeMB);
+   if (camera_ && camera_->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+   checkCameraBuffersIdle();
+   processorChain_->Stop(); // restarted when the buffer is initialized
+
+   // the memory is re-mapped only if the size changes
+   cbuf_->SetMemorySizeMB(sizeMB);
+   CCameraBufferMap::iterator it;
+   for (it = cameraBuffers_.begin(); it != cameraBuffers_.end(); it++)
+      if (it->second)
+         it->second->SetMemorySizeMB(sizeMB);
+
+   // attempt to initialize based on the current camera settings
+   if (camera_)
+      initializeCircularBuffer(camera_, getCircularBuffer(camera_));
+
+   CORE_DEBUG1("Circular buffer set to %d MB.\n", sizeMB);
+}
+
+/**
+ * Selects how the circular buffer memory is mapped. Huge pages reduce the TLB
+ * pressure of multi-GB buffers, locking keeps the whole buffer resident so that
+ * streaming never waits for a page fault. Both fall back to regular memory if
+ * the system does not allow them. Pending images are discarded.
+ */
+void CMMCore::setCircularBufferMemoryOptions(bool useHugePages, bool lockInMemory) throw (CMMError)
+{
+   if (camera_ && camera_->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+   checkCameraBuffersIdle();
+   processorChain_->Stop(); // restarted when the buffer is initialized
+
+   bufferHugePages_ = useHugePages;
+   bufferLockMemory_ = lockInMemory;
+   cbuf_->SetMemoryOptions(useHugePages, lockInMemory);
+   CCameraBufferMap::iterator it;
+   for (it = cameraBuffers_.begin(); it != cameraBuffers_.end(); it++)
+      if (it->second)
+         it->second->SetMemoryOptions(useHugePages, lockInMemory);
+
+   // attempt to initialize based on the current camera settings
+   if (camera_)
+      initializeCircularBuffer(camera_, getCircularBuffer(camera_));
+
+   CORE_DEBUG2("Circular buffer memory: huge pages %s, locked %s.\n", useHugePages ? "on" : "off", lockInMemory ? "on" : "off");
+}
+
+/**
+ * Sets the maximum number of frames the circular buffer holds, regardless of its
+ * memory footprint. Use 0 to let the footprint alone determine the capacity, e.g.
+ * to keep a long burst of small ROI frames in memory. Pending images are discarded.
+ */
+void CMMCore::setCircularBufferMaxFrames(long maxFrames) throw (CMMError)
+{
+   if (maxFrames < 0)
+      throw CMMError(getCoreErrorText(MMERR_InvalidCoreValue).c_str(), MMERR_InvalidCoreValue);
+   if (camera_ && camera_->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+   checkCameraBuffersIdle();
+   processorChain_->Stop(); // restarted when the buffer is initialized
+
+   cbuf_->SetMaxFrames(maxFrames);
+   CCameraBufferMap::iterator it;
+   for (it = cameraBuffers_.begin(); it != cameraBuffers_.end(); it++)
+      if (it->second)
+         it->second->SetMaxFrames(maxFrames);
 
    // attempt to initialize based on the current camera settings
    if (camera_)
+      initializeCircularBuffer(camera_, getCircularBuffer(camera_));
+
+   CORE_DEBUG1("Circular buffer limited to %d frames.\n", (int)maxFrames);
+}
+
+/**
+ * Returns the maximum number of frames in the circular buffer, 0 if not limited.
+ */
+long CMMCore::getCircularBufferMaxFrames() const
+{
+   return cbuf_->GetMaxFrames();
+}
+
+/**
+ * Returns true if the circular buffer of the current camera is locked in physical memory.
+ */
+bool CMMCore::isBufferMemoryLocked() const
+{
+   return getCircularBuffer(camera_)->IsMemoryLocked();
+}
+
+/**
+ * Enables the lock-free exchange of images between the camera thread and
+ * a single consumer thread calling popNextImage()/popNextImageMD().
+ * In this mode the camera never waits for the consumer, also when it
+ * overwrites the oldest images in live mode, but only one thread may pop
+ * images at a time. Pending images are discarded.
+ */
+void CMMCore::enableLockFreeBuffer(bool enable) throw (CMMError)
+{
+   if (camera_ && camera_->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+   checkCameraBuffersIdle();
+
+   cbuf_->SetLockFree(enable);
+   CCameraBufferMap::iterator it;
+   for (it = cameraBuffers_.begin(); it != cameraBuffers_.end(); it++)
+      if (it->second)
+         it->second->SetLockFree(enable);
+   CORE_DEBUG1("Lock-free circular buffer %s.\n", enable ? "enabled" : "disabled");
+}
+
+/**
+ * Returns true if the circular buffer runs in the lock-free mode.
+ */
+bool CMMCore::isLockFreeBufferEnabled() const
+{
+   return cbuf_->IsLockFree();
+}
+
+/**
+ * Starts saving the images acquired by the current camera through the
+ * specified image streamer device. A core thread pops the images from the
+ * circular buffer as soon as they arrive and passes them to the streamer,
+ * so the application must not pop images from the buffer at the same time.
+ * Start the streaming after the sequence acquisition was started.
+ * If the streamer takes compressed images, the images are compressed by
+ * the number of threads set with setImageStreamingThreads() on the way.
+ * @param streamerLabel label of the image streamer device
+ * @param path destination, interpreted by the streamer
+ */
+void CMMCore::startImageStreaming(const char* streamerLabel, const char* path) throw (CMMError)
+{
+   if (streamWriter_)
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(), MMERR_NotAllowedDuringSequenceAcquisition);
+
+   if (!camera_)
    {
-      if (!cbuf_->Initialize(camera_->GetNumberOfChannels(), 1, camera_->GetImageWidth(), camera_->GetImageHeight(), camera_->GetImageBytesPerPixel()))
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
+      logError("no camera", getCoreErrorText(MMERR_CameraNotAvailable).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CameraNotAvailable).c_str(), MMERR_CameraNotAvailable);
    }
 
-   CORE_DEBUG1("Circular buffer set to %d MB.\n", sizeMB);
+   MM::ImageStreamer* pStreamer = getSpecificDevice<MM::ImageStreamer>(streamerLabel);
+   CircularBuffer* pBuf = getCircularBuffer(camera_);
+   if (pBuf->GetSize() == 0)
+      initializeCircularBuffer(camera_, pBuf);
+
+   int nRet = pStreamer->OpenContext(pBuf->Width(), pBuf->Height(), pBuf->Depth(), path);
+   if (nRet != DEVICE_OK)
+   {
+      logError(streamerLabel, getDeviceErrorText(nRet, pStreamer).c_str());
+      throw CMMError(getDeviceErrorText(nRet, pStreamer).c_str(), MMERR_DEVICE_GENERIC);
+   }
+
+   unsigned codecThreads = 0;
+   if (streamingThreads_ > 0 && ImageCodec::CanCompress(pBuf->Depth()) && pStreamer->AcceptsCompressedImages())
+      codecThreads = (unsigned)streamingThreads_;
+
+   streamer_ = pStreamer;
+   streamedImages_ = 0;
+   streamWriter_ = new StreamWriter(pBuf, pStreamer, codecThreads);
+   streamWriter_->Start();
+   CORE_LOG3("Image streaming from %s started by %s, %s.\n", getDeviceName(camera_).c_str(), streamerLabel,
+             streamWriter_->IsCompressing() ? "compressed by the core" : "uncompressed");
+}
+
+/**
+ * Saves the images already in the circular buffer, stops the streaming and
+ * closes the streamer context. Throws if the streamer failed on the way.
+ */
+void CMMCore::stopImageStreaming() throw (CMMError)
+{
+   if (!streamWriter_)
+      return;
+
+   streamWriter_->Stop();
+   int writeRet = streamWriter_->GetErrorCode();
+   streamedImages_ = streamWriter_->GetImageCount();
+   delete streamWriter_;
+   streamWriter_ = 0;
+
+   MM::ImageStreamer* pStreamer = streamer_;
+   streamer_ = 0;
+   int nRet = pStreamer->CloseContext();
+
+   if (writeRet != DEVICE_OK)
+   {
+      logError(getDeviceName(pStreamer).c_str(), getDeviceErrorText(writeRet, pStreamer).c_str());
+      throw CMMError(getDeviceErrorText(writeRet, pStreamer).c_str(), MMERR_ImageStreamingFailed);
+   }
+   if (nRet != DEVICE_OK)
+   {
+      logError(getDeviceName(pStreamer).c_str(), getDeviceErrorText(nRet, pStreamer).c_str());
+      throw CMMError(getDeviceErrorText(nRet, pStreamer).c_str(), MMERR_DEVICE_GENERIC);
+   }
+   CORE_LOG1("Image streaming stopped after %d images.\n", (int)streamedImages_);
+}
+
+/**
+ * Returns true while the streaming thread is saving images. Returns false
+ * if the streamer failed; stopImageStreaming() then reports the error.
+ */
+bool CMMCore::isImageStreaming() const
+{
+   return streamWriter_ != 0 && streamWriter_->IsRunning();
+}
+
+/**
+ * Returns the number of images saved by the current or the last streaming session.
+ */
+long CMMCore::getStreamedImageCount() const
+{
+   if (streamWriter_)
+      return streamWriter_->GetImageCount();
+   return streamedImages_;
+}
+
+/**
+ * Sets the number of core threads compressing the images of the next
+ * streaming sessions, for streamers that take compressed images. With 0
+ * the images are passed to the streamer as they are. Default is 4.
+ */
+void CMMCore::setImageStreamingThreads(long threads) throw (CMMError)
+{
+   if (threads < 0)
+      throw CMMError(getCoreErrorText(MMERR_InvalidCoreValue).c_str(), MMERR_InvalidCoreValue);
+   streamingThreads_ = threads;
+   CORE_DEBUG1("Image streaming compressed by %d threads.\n", (int)threads);
+}
+
+long CMMCore::getImageStreamingThreads() const
+{
+   return streamingThreads_;
+}
+
+/**
+ * Processes the frames of the current camera with the given image processor
+ * devices, in the given order. Each processor runs in its own core thread
+ * while the camera goes on acquiring, and the frames become available to
+ * getNextImage() and the image streaming after the last processor is done
+ * with them. The chain is independent of the image processor set with
+ * setImageProcessorDevice(), which the cameras apply themselves.
+ * An empty list removes the chain.
+ * @param procLabels labels of the image processor devices
+ */
+void CMMCore::setImageProcessorChain(const std::vector<std::string>& procLabels) throw (CMMError)
+{
+   if (camera_ && camera_->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(), MMERR_NotAllowedDuringSequenceAcquisition);
+   checkCameraBuffersIdle();
+
+   std::vector<MM::ImageProcessor*> processors;
+   for (size_t i=0; i<procLabels.size(); i++)
+   {
+      MM::ImageProcessor* pProc = getSpecificDevice<MM::ImageProcessor>(procLabels[i].c_str());
+      // a processor is called from a single thread only
+      if (std::find(processors.begin(), processors.end(), pProc) != processors.end())
+         throw CMMError(getCoreErrorText(MMERR_DuplicateLabel).c_str(), MMERR_DuplicateLabel);
+      processors.push_back(pProc);
+   }
+
+   stopProcessorChain();
+   chainProcessors_ = processors;
+   startProcessorChain();
+   CORE_LOG1("Image processor chain set to %d devices.\n", (int)processors.size());
+}
+
+/**
+ * Returns the labels of the image processors in the chain, in order.
+ */
+std::vector<std::string> CMMCore::getImageProcessorChain()
+{
+   std::vector<std::string> labels;
+   for (size_t i=0; i<chainProcessors_.size(); i++)
+      labels.push_back(pluginManager_.GetDeviceLabel(*chainProcessors_[i]));
+   return labels;
+}
+
+/**
+ * Returns the number of frames the processor handled since the chain or
+ * the circular buffer was last set up.
+ */
+long CMMCore::getImageProcessorFrameCount(const char* procLabel) throw (CMMError)
+{
+   return processorChain_->GetStageStats(getProcessorChainStage(procLabel)).frames;
+}
+
+/**
+ * Returns the number of frames the processor failed on.
+ */
+long CMMCore::getImageProcessorErrorCount(const char* procLabel) throw (CMMError)
+{
+   return processorChain_->GetStageStats(getProcessorChainStage(procLabel)).errors;
+}
+
+/**
+ * Returns the mean time the processor spent on a frame, in milliseconds.
+ */
+double CMMCore::getImageProcessorMeanMs(const char* procLabel) throw (CMMError)
+{
+   return processorChain_->GetStageStats(getProcessorChainStage(procLabel)).meanMs;
+}
+
+/**
+ * Returns the longest time the processor spent on a frame, in milliseconds.
+ */
+double CMMCore::getImageProcessorMaxMs(const char* procLabel) throw (CMMError)
+{
+   return processorChain_->GetStageStats(getProcessorChainStage(procLabel)).maxMs;
+}
+
+/**
+ * Attaches the processor chain to the buffer of the current camera. The
+ * buffer is set up again for the formats the processors negotiate.
+ */
+void CMMCore::startProcessorChain() throw (CMMError)
+{
+   if (chainProcessors_.empty() || !camera_)
+      return;
+
+   initializeCircularBuffer(camera_, getCircularBuffer(camera_));
+}
+
+/**
+ * Processes the frames left in the chain and stops its threads. The buffer
+ * goes back to the camera format the next time it is initialized.
+ */
+void CMMCore::stopProcessorChain()
+{
+   CircularBuffer* pBuf = processorChain_->GetBuffer();
+   processorChain_->Stop();
+   if (pBuf)
+      pBuf->SetProcessingFormat(0, 0, 0, 0, false);
+}
+
+/**
+ * Returns the position of the processor in the chain.
+ */
+unsigned CMMCore::getProcessorChainStage(const char* procLabel) throw (CMMError)
+{
+   MM::ImageProcessor* pProc = getSpecificDevice<MM::ImageProcessor>(procLabel);
+   for (unsigned i=0; i<chainProcessors_.size() && i<processorChain_->GetStageCount(); i++)
+   {
+      if (chainProcessors_[i] == pProc)
+         return i;
+   }
+   throw CMMError(getCoreErrorText(MMERR_ProcessorNotInChain).c_str(), MMERR_ProcessorNotInChain);
+}
+
+/**
+ * Stops the streaming without reporting errors, before the devices go away.
+ */
+void CMMCore::closeImageStreaming()
+{
+   try {
+      stopImageStreaming();
+   } catch (CMMError&) {
+      CORE_LOG("Image streaming failed.\n");
+   }
 }
 
 long CMMCore::getRemainingImageCount()
 {
-   return cbuf_->GetRemainingImageCount();
+   return getCircularBuffer(camera_)->GetRemainingImageCount();
+}
+
+/**
+ * Returns the number of images waiting in the circular buffer of the specified camera.
+ */
+long CMMCore::getRemainingImageCount(const char* label) throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   return getCircularBuffer(pCam)->GetRemainingImageCount();
 }
 
 long CMMCore::getBufferTotalCapacity()
 {
-   return cbuf_->GetSize();
+   return getCircularBuffer(camera_)->GetSize();
 }
 
 long CMMCore::getBufferFreeCapacity()
 {
-   return cbuf_->GetFreeSize();
+   return getCircularBuffer(camera_)->GetFreeSize();
+}
+
+/**
+ * Returns the number of bytes taken by the frames the circular buffer can hold,
+ * i.e. getBufferTotalCapacity() times the size of a frame.
+ */
+long long CMMCore::getBufferTotalBytes()
+{
+   return (long long)getCircularBuffer(camera_)->GetTotalBytes();
+}
+
+/**
+ * Returns the width of the images popped from the circular buffer of the
+ * current camera. It differs from getImageWidth() if the image processor
+ * chain changes the image format.
+ */
+unsigned CMMCore::getBufferImageWidth()
+{
+   return getCircularBuffer(camera_)->Width();
+}
+
+/**
+ * Returns the height of the images popped from the circular buffer.
+ */
+unsigned CMMCore::getBufferImageHeight()
+{
+   return getCircularBuffer(camera_)->Height();
 }
 
+/**
+ * Returns the bytes per pixel of the images popped from the circular buffer.
+ */
+unsigned CMMCore::getBufferBytesPerPixel()
+{
+   return getCircularBuffer(camera_)->Depth();
+}
+
+/**
+ * Returns the mean interval between the last (up to 100) images inserted in
+ * the circular buffer of the current camera, in ms. The intervals are
+ * computed from the camera supplied elapsed time, when available.
+ * Together with getBufferIntervalMinMs(), getBufferIntervalMaxMs() and
+ * getBufferIntervalJitterMs() this can be used to detect late or missing frames.
+ */
 double CMMCore::getBufferIntervalMs() const
 {
-   return cbuf_->GetAverageIntervalMs();
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(camera_)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return meanMs;
+}
+
+/**
+ * Mean interval between the last images inserted in the circular buffer of the specified camera, in ms.
+ */
+double CMMCore::getBufferIntervalMs(const char* label) const throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(pCam)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return meanMs;
+}
+
+/**
+ * Shortest interval between the last images inserted in the circular buffer of the current camera, in ms.
+ */
+double CMMCore::getBufferIntervalMinMs() const
+{
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(camera_)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return minMs;
+}
+
+/**
+ * Shortest interval between the last images inserted in the circular buffer of the specified camera, in ms.
+ */
+double CMMCore::getBufferIntervalMinMs(const char* label) const throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(pCam)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return minMs;
+}
+
+/**
+ * Longest interval between the last images inserted in the circular buffer of the current camera, in ms.
+ */
+double CMMCore::getBufferIntervalMaxMs() const
+{
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(camera_)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return maxMs;
+}
+
+/**
+ * Longest interval between the last images inserted in the circular buffer of the specified camera, in ms.
+ */
+double CMMCore::getBufferIntervalMaxMs(const char* label) const throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(pCam)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return maxMs;
+}
+
+/**
+ * Jitter (standard deviation of the intervals) between the last images inserted in the circular buffer of the current camera, in ms.
+ */
+double CMMCore::getBufferIntervalJitterMs() const
+{
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(camera_)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return jitterMs;
+}
+
+/**
+ * Jitter (standard deviation of the intervals) between the last images inserted in the circular buffer of the specified camera, in ms.
+ */
+double CMMCore::getBufferIntervalJitterMs(const char* label) const throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   double meanMs, minMs, maxMs, jitterMs;
+   getCircularBuffer(pCam)->GetIntervalStats(meanMs, minMs, maxMs, jitterMs);
+   return jitterMs;
 }
 
 bool CMMCore::isBufferOverflowed() const
 {
-   return cbuf_->Overflow();
+   return getCircularBuffer(camera_)->Overflow();
+}
+
+/**
+ * Returns the number of images the circular buffer of the current camera dropped
+ * since the sequence acquisition started. Images are dropped, oldest first, when
+ * the acquisition does not stop on overflow and the buffer is full.
+ */
+long CMMCore::getDroppedImageCount() const
+{
+   return getCircularBuffer(camera_)->GetDroppedFrames();
+}
+
+/**
+ * Returns the number of images dropped by the circular buffer of the specified camera.
+ */
+long CMMCore::getDroppedImageCount(const char* label) const throw (CMMError)
+{
+   MM::Camera* pCam = getSpecificDevice<MM::Camera>(label);
+   return getCircularBuffer(pCam)->GetDroppedFrames();
 }
 
 /**
@@ -2012,6 +2715,13 @@ void CMMCore::setXYStageDevice(const char* xyDeviceLabel) throw (CMMError)
  */
 void CMMCore::setCameraDevice(const char* cameraLabel) throw (CMMError)
 {
+   // the processor chain of a running sequence can't move to another camera
+   if (camera_ && camera_->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+
+   // the processor chain follows the current camera
+   stopProcessorChain();
    if (cameraLabel && strlen(cameraLabel) > 0)
    {
       camera_ = getSpecificDevice<MM::Camera>(cameraLabel);
@@ -2022,6 +2732,7 @@ void CMMCore::setCameraDevice(const char* cameraLabel) throw (CMMError)
       camera_ = 0;
       CORE_LOG("Camera device removed.\n");
    }
+   startProcessorChain();
    properties_->Refresh(); // TODO: more efficient
    stateCache_.addSetting(PropertySetting(MM::g_Keyword_CoreDevice, MM::g_Keyword_CoreCamera, getCameraDevice().c_str()));
 }
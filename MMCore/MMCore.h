@@ -71,6 +71,8 @@ class ACE_Mutex;
 
 // forward declarations
 class CircularBuffer;
+class StreamWriter;
+class ProcessorChain;
 class Configuration;
 class PropertyBlock;
 class CSerial;
@@ -255,22 +257,72 @@ public:
    bool isSequenceRunning() throw ();
    bool isSequenceRunning(const char* label) throw (CMMError);
    void* getLastImage() const throw (CMMError);
+   void* getLastImage(const char* cameraLabel) const throw (CMMError);
    void* popNextImage() throw (CMMError);
+   void* popNextImage(const char* cameraLabel) throw (CMMError);
 
    void* getLastImageMD(unsigned channel, unsigned slice, Metadata& md) const throw (CMMError);
    void* popNextImageMD(unsigned channel, unsigned slice, Metadata& md) throw (CMMError);
+   void* popNextImageMD(const char* cameraLabel, unsigned channel, unsigned slice, Metadata& md) throw (CMMError);
+   long popNextImages(void* pixels, long pixelsBytes, long maxCount, std::vector<Metadata>& metadata);
+   bool waitForNextImage(long timeoutMs);
+   bool waitForNextImage(const char* cameraLabel, long timeoutMs) throw (CMMError);
 
    long snapImageMD() throw (CMMError);
    void* getImageMD(long handle, unsigned channel, unsigned slice) throw (CMMError);
    Metadata getImageMetadata(long handle, unsigned channel, unsigned slice) throw (CMMError);
 
    long getRemainingImageCount();
+   long getRemainingImageCount(const char* cameraLabel) throw (CMMError);
    long getBufferTotalCapacity();
    long getBufferFreeCapacity();
+   long long getBufferTotalBytes();
+   unsigned getBufferImageWidth();
+   unsigned getBufferImageHeight();
+   unsigned getBufferBytesPerPixel();
    double getBufferIntervalMs() const;
+   double getBufferIntervalMs(const char* cameraLabel) const throw (CMMError);
+   double getBufferIntervalMinMs() const;
+   double getBufferIntervalMinMs(const char* cameraLabel) const throw (CMMError);
+   double getBufferIntervalMaxMs() const;
+   double getBufferIntervalMaxMs(const char* cameraLabel) const throw (CMMError);
+   double getBufferIntervalJitterMs() const;
+   double getBufferIntervalJitterMs(const char* cameraLabel) const throw (CMMError);
    bool isBufferOverflowed() const;
+   long getDroppedImageCount() const;
+   long getDroppedImageCount(const char* cameraLabel) const throw (CMMError);
    void setCircularBufferMemoryFootprint(unsigned sizeMB) throw (CMMError);
+   void setCircularBufferMemoryOptions(bool useHugePages, bool lockInMemory) throw (CMMError);
+   void setCircularBufferMaxFrames(long maxFrames) throw (CMMError);
+   long getCircularBufferMaxFrames() const;
+   bool isBufferMemoryLocked() const;
    void intializeCircularBuffer() throw (CMMError);
+   void enableLockFreeBuffer(bool enable) throw (CMMError);
+   bool isLockFreeBufferEnabled() const;
+   //@ }
+
+   /** @name Image streaming
+    * API for saving the sequence acquisition to disk through an image streamer device.
+    */
+   //@ {
+   void startImageStreaming(const char* streamerLabel, const char* path) throw (CMMError);
+   void stopImageStreaming() throw (CMMError);
+   bool isImageStreaming() const;
+   long getStreamedImageCount() const;
+   void setImageStreamingThreads(long threads) throw (CMMError);
+   long getImageStreamingThreads() const;
+   //@ }
+
+   /** @name Image processor chain
+    * API for processing the sequence acquisition with a chain of image processor devices.
+    */
+   //@ {
+   void setImageProcessorChain(const std::vector<std::string>& procLabels) throw (CMMError);
+   std::vector<std::string> getImageProcessorChain();
+   long getImageProcessorFrameCount(const char* procLabel) throw (CMMError);
+   long getImageProcessorErrorCount(const char* procLabel) throw (CMMError);
+   double getImageProcessorMeanMs(const char* procLabel) throw (CMMError);
+   double getImageProcessorMaxMs(const char* procLabel) throw (CMMError);
    //@ }
 
    /** @name Auto-focusing
@@ -352,6 +404,7 @@ private:
 
    typedef std::map<std::string, Configuration*> CConfigMap;
    typedef std::map<std::string, PropertyBlock*> CPropBlockMap;
+   typedef std::map<const MM::Device*, CircularBuffer*> CCameraBufferMap;
 
    static ACE_Mutex deviceLock_;
 
@@ -371,6 +424,15 @@ private:
    MMEventCallback* externalCallback_;  // notification hook to the higher layer (e.g. GUI)
    PixelSizeConfigGroup* pixelSizeGroup_;
    CircularBuffer* cbuf_;
+   CCameraBufferMap cameraBuffers_; // dedicated buffers of cameras streaming alongside the current one
+   bool bufferHugePages_;
+   bool bufferLockMemory_;
+   StreamWriter* streamWriter_;    // drains the buffer of the current camera into streamer_
+   MM::ImageStreamer* streamer_;
+   long streamedImages_;           // images saved in the last streaming session
+   long streamingThreads_;         // compressing the streamed images, 0 for none
+   ProcessorChain* processorChain_; // processes the buffer of the current camera
+   std::vector<MM::ImageProcessor*> chainProcessors_;
 
    std::vector<MM::Device*> imageSynchro_;
    CPluginManager pluginManager_;
@@ -386,6 +448,14 @@ private:
    template <class T>
    T* getSpecificDevice(const char* deviceLabel) const throw (CMMError);
    void waitForDevice(MM::Device* pDev) throw (CMMError);
+   CircularBuffer* getCircularBuffer(const MM::Device* pCam) const;
+   void initializeCircularBuffer(MM::Camera* pCam, CircularBuffer* pBuf) throw (CMMError);
+   void checkCameraBuffersIdle() const throw (CMMError);
+   void deleteCameraBuffers();
+   void closeImageStreaming();
+   void startProcessorChain() throw (CMMError);
+   void stopProcessorChain();
+   unsigned getProcessorChainStage(const char* procLabel) throw (CMMError);
    std::string getDeviceErrorText(int deviceCode, MM::Device* pDevice) const;
    std::string getDeviceName(MM::Device* pDev);
    void logError(const char* device, const char* msg, const char* file=0, int line=0) const;
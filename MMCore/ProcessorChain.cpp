@@ -0,0 +1,252 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ProcessorChain.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Ordered chain of image processor devices applied to the
+//                frames of the circular buffer by core worker threads.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// CVS:           $Id$
+//
+#include "ProcessorChain.h"
+#include "CircularBuffer.h"
+#include "../MMDevice/DeviceUtils.h"
+#include <ace/Task.h>
+#include <ace/Guard_T.h>
+#include <ace/Thread_Mutex.h>
+
+const long stageWaitMs = 100; // how often a stage checks for the stop request
+
+/**
+ * Worker thread running one processor of the chain.
+ */
+class ProcessorChain::Stage : public ACE_Task_Base
+{
+public:
+   Stage(CircularBuffer* pBuf, MM::ImageProcessor* pProc, unsigned index, const Format& input, const Format& output) :
+      buf_(pBuf), proc_(pProc), index_(index), input_(input), output_(output),
+      outOfPlace_(IsOutOfPlace(pProc, input, output)), stop_(false), totalMs_(0.0)
+   {
+      stats_.frames = 0;
+      stats_.errors = 0;
+      stats_.lastError = DEVICE_OK;
+      stats_.meanMs = 0.0;
+      stats_.maxMs = 0.0;
+   }
+
+   void Start()
+   {
+      stop_ = false;
+      activate(THR_NEW_LWP | THR_JOINABLE);
+   }
+
+   /**
+    * Finishes the frames the previous stage has completed and stops.
+    */
+   void Stop()
+   {
+      stop_ = true;
+      wait();
+   }
+
+   StageStats GetStats() const
+   {
+      ACE_Guard<ACE_Thread_Mutex> guard(statsLock_);
+      return stats_;
+   }
+
+   int svc()
+   {
+      while (true)
+      {
+         CircularBuffer::StageTicket ticket;
+         FrameBuffer* pFrame = buf_->WaitForStage(index_, stop_ ? 0 : stageWaitMs, ticket);
+         if (pFrame == 0)
+         {
+            if (stop_)
+               break;
+            continue;
+         }
+
+         if (buf_->IsDiscarded(ticket))
+         {
+            // dropped by an earlier stage
+            buf_->CompleteStage(index_, ticket);
+            continue;
+         }
+
+         double startMs = CDeviceUtils::GetMonotonicTimeMs();
+         int ret = DEVICE_OK;
+         bool accumulated = false;
+         for (unsigned ch=0; ; ch++)
+         {
+            ImgBuffer* pImg = pFrame->FindImage(ch, 0);
+            if (pImg == 0)
+               break;
+            int chRet;
+            if (outOfPlace_)
+            {
+               // the frame goes on in the output format even if the processor
+               // fails, so that the next stages get what they expect
+               unsigned char* pDst = buf_->GetScratchPixels(ticket, ch);
+               if (pDst == 0)
+               {
+                  ret = DEVICE_BUFFER_OVERFLOW; // buffer set up without the processing format
+                  break;
+               }
+               chRet = proc_->ProcessInto(pImg->GetPixels(), input_.width, input_.height, input_.byteDepth,
+                                          pDst, output_.width, output_.height, output_.byteDepth);
+               pImg->AttachPixels(pDst, output_.width, output_.height, output_.byteDepth);
+            }
+            else
+               chRet = proc_->Process(pImg->GetPixelsRW(), pImg->Width(), pImg->Height(), pImg->Depth());
+            if (chRet == DEVICE_IMAGE_ACCUMULATED)
+               accumulated = true;
+            else if (chRet != DEVICE_OK)
+               ret = chRet;
+         }
+         double elapsedMs = CDeviceUtils::GetMonotonicTimeMs() - startMs;
+
+         // a failed frame still goes on, so that the chain does not stall;
+         // a frame the processor only accumulated is not shown to anyone
+         buf_->CompleteStage(index_, ticket, accumulated);
+
+         ACE_Guard<ACE_Thread_Mutex> guard(statsLock_);
+         stats_.frames++;
+         totalMs_ += elapsedMs;
+         stats_.meanMs = totalMs_ / stats_.frames;
+         if (elapsedMs > stats_.maxMs)
+            stats_.maxMs = elapsedMs;
+         if (ret != DEVICE_OK)
+         {
+            stats_.errors++;
+            stats_.lastError = ret;
+         }
+      }
+      return 0;
+   }
+
+private:
+   CircularBuffer* buf_;
+   MM::ImageProcessor* proc_;
+   unsigned index_;
+   Format input_;
+   Format output_;
+   bool outOfPlace_;
+   volatile bool stop_;
+   double totalMs_;
+   StageStats stats_;
+   mutable ACE_Thread_Mutex statsLock_;
+};
+
+ProcessorChain::ProcessorChain() : buf_(0)
+{
+}
+
+ProcessorChain::~ProcessorChain()
+{
+   Stop();
+   for (size_t i=0; i<stages_.size(); i++)
+      delete stages_[i];
+}
+
+/**
+ * Asks each processor in turn for the format it produces from the output of
+ * the previous one. formats receives the input format followed by the output
+ * format of every processor. Returns the error of the first processor that
+ * does not accept its input.
+ */
+int ProcessorChain::Negotiate(const std::vector<MM::ImageProcessor*>& processors, const Format& input, std::vector<Format>& formats)
+{
+   formats.assign(1, input);
+   for (size_t i=0; i<processors.size(); i++)
+   {
+      const Format& in = formats.back();
+      Format out;
+      int ret = processors[i]->GetOutputFormat(in.width, in.height, in.byteDepth, out.width, out.height, out.byteDepth);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (out.width == 0 || out.height == 0 || out.byteDepth == 0)
+         return DEVICE_UNSUPPORTED_DATA_FORMAT;
+      formats.push_back(out);
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * True if the processor must be called through ProcessInto().
+ */
+bool ProcessorChain::IsOutOfPlace(MM::ImageProcessor* pProc, const Format& input, const Format& output)
+{
+   return input.width != output.width || input.height != output.height || input.byteDepth != output.byteDepth ||
+          pProc->PrefersProcessInto();
+}
+
+/**
+ * Inserts the processors between the producer and the consumers of the
+ * buffer and starts one thread per processor. Statistics of the previous
+ * run are discarded. The buffer must have been initialized with the
+ * processing format of the chain.
+ */
+int ProcessorChain::Start(CircularBuffer* pBuf, const std::vector<MM::ImageProcessor*>& processors)
+{
+   Stop();
+   for (size_t i=0; i<stages_.size(); i++)
+      delete stages_[i];
+   stages_.clear();
+
+   if (processors.empty())
+      return DEVICE_OK;
+
+   Format input;
+   input.width = pBuf->InputWidth();
+   input.height = pBuf->InputHeight();
+   input.byteDepth = pBuf->InputDepth();
+   std::vector<Format> formats;
+   int ret = Negotiate(processors, input, formats);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   buf_ = pBuf;
+   buf_->SetProcessingStages((unsigned)processors.size());
+   for (unsigned i=0; i<processors.size(); i++)
+   {
+      stages_.push_back(new Stage(pBuf, processors[i], i, formats[i], formats[i+1]));
+      stages_.back()->Start();
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Processes the frames already in the chain, stops the threads and removes
+ * the stages from the buffer. The statistics remain available.
+ */
+void ProcessorChain::Stop()
+{
+   if (buf_ == 0)
+      return;
+
+   // in order, so that each stage drains what the previous one left
+   for (size_t i=0; i<stages_.size(); i++)
+      stages_[i]->Stop();
+   buf_->SetProcessingStages(0);
+   buf_ = 0;
+}
+
+ProcessorChain::StageStats ProcessorChain::GetStageStats(unsigned stage) const
+{
+   return stages_.at(stage)->GetStats();
+}
@@ -0,0 +1,90 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ProcessorChain.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Ordered chain of image processor devices applied to the
+//                frames of the circular buffer by core worker threads,
+//                between the camera and the consumers.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// CVS:           $Id$
+//
+#ifndef _PROCESSOR_CHAIN_H_
+#define _PROCESSOR_CHAIN_H_
+
+#include <vector>
+#include "../MMDevice/MMDevice.h"
+
+class CircularBuffer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ProcessorChain class
+// ~~~~~~~~~~~~~~~~~~~~
+// Each processor runs in its own thread, one stage of a pipeline: while the
+// second processor works on frame n the first one already works on frame
+// n+1. Frames keep their order, every processor is called from a single
+// thread, and the camera thread only inserts the raw frames. The consumers
+// of the circular buffer see a frame after the last stage is done with it.
+// A processor that changes the image format, or prefers to work out of
+// place, writes into the second storage of the image that the buffer
+// preallocates for it, see CircularBuffer::SetProcessingFormat().
+// A processor that integrates several frames drops the frames it has no
+// output for, so that fewer frames reach the consumers.
+
+class ProcessorChain
+{
+public:
+   struct Format
+   {
+      unsigned width;
+      unsigned height;
+      unsigned byteDepth;
+   };
+
+   struct StageStats
+   {
+      long frames;     // frames processed
+      long errors;     // frames the processor failed on
+      int lastError;
+      double meanMs;   // per frame
+      double maxMs;
+   };
+
+   ProcessorChain();
+   ~ProcessorChain();
+
+   static int Negotiate(const std::vector<MM::ImageProcessor*>& processors, const Format& input, std::vector<Format>& formats);
+   static bool IsOutOfPlace(MM::ImageProcessor* pProc, const Format& input, const Format& output);
+
+   int Start(CircularBuffer* pBuf, const std::vector<MM::ImageProcessor*>& processors);
+   void Stop();
+   bool IsRunning() const {return buf_ != 0;}
+   CircularBuffer* GetBuffer() const {return buf_;}
+   unsigned GetStageCount() const {return (unsigned)stages_.size();}
+   StageStats GetStageStats(unsigned stage) const;
+
+private:
+   class Stage;
+
+   ProcessorChain(const ProcessorChain&);
+   ProcessorChain& operator=(const ProcessorChain&);
+
+   CircularBuffer* buf_;
+   std::vector<Stage*> stages_;
+};
+
+#endif //_PROCESSOR_CHAIN_H_
@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StreamWriter.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Writer thread draining the circular buffer into an image
+//                streamer device.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// CVS:           $Id$
+//
+#include "StreamWriter.h"
+#include "CircularBuffer.h"
+#include "CodecStage.h"
+
+const long writerWaitMs = 100; // how often the writer checks for the stop request
+
+/**
+ * @param codecThreads threads compressing the frames, 0 to save them as they are
+ */
+StreamWriter::StreamWriter(CircularBuffer* pBuf, MM::ImageStreamer* pStreamer, unsigned codecThreads) :
+   buf_(pBuf), streamer_(pStreamer), codecThreads_(codecThreads), codec_(0), started_(false), stop_(false), running_(false), imageCount_(0), errorCode_(DEVICE_OK)
+{
+}
+
+StreamWriter::~StreamWriter()
+{
+   Stop();
+}
+
+/**
+ * Starts the writer thread. The frame popped last stays in use while it is
+ * being saved or copied to the codec, so the buffer is told not to hand it
+ * back to the camera. The codec gets one frame more than it has threads,
+ * for the frame being saved; if its memory is not available the frames
+ * are saved uncompressed.
+ */
+void StreamWriter::Start()
+{
+   if (started_)
+      return;
+
+   if (codecThreads_ > 0)
+   {
+      codec_ = new CodecStage(codecThreads_, codecThreads_ + 1);
+      if (!codec_->Start(buf_->Width(), buf_->Height(), buf_->Depth()))
+      {
+         delete codec_;
+         codec_ = 0;
+      }
+   }
+
+   stop_ = false;
+   imageCount_ = 0;
+   errorCode_ = DEVICE_OK;
+   buf_->SetReaderHoldsFrame(true);
+   running_ = true;
+   started_ = true;
+   activate(THR_NEW_LWP | THR_JOINABLE);
+}
+
+/**
+ * Saves the images remaining in the buffer and stops the writer thread.
+ */
+void StreamWriter::Stop()
+{
+   if (!started_)
+      return;
+
+   stop_ = true;
+   wait();
+   started_ = false;
+   buf_->SetReaderHoldsFrame(false);
+   delete codec_;
+   codec_ = 0;
+}
+
+/**
+ * Thread procedure. Runs until a stop is requested and the buffer is empty,
+ * or until the streamer fails. With the codec, frames are popped while it
+ * has free slots; the oldest compressed frame is saved whenever no more
+ * frames are waiting or the slots are full.
+ */
+int StreamWriter::svc()
+{
+   long pending = -1; // images left to save after the stop request
+   while (true)
+   {
+      // images arriving after the stop request are left in the buffer,
+      // otherwise a running camera would keep the writer going forever
+      if (stop_ && pending < 0)
+         pending = (long)buf_->GetRemainingImageCount();
+
+      bool compressing = codec_ != 0 && codec_->GetQueuedCount() > 0;
+      if (pending != 0 && (codec_ == 0 || codec_->HasFreeSlot()))
+      {
+         // frames in the codec are saved rather than waiting for new ones
+         if (buf_->WaitForImage(compressing ? 0 : writerWaitMs))
+         {
+            const FrameBuffer* pFrame = buf_->GetNextFrame();
+            if (pFrame == 0)
+               continue;
+            if (pending > 0)
+               pending--;
+
+            if (codec_)
+               codec_->Submit(*pFrame);
+            else
+            {
+               int ret = SaveFrame(*pFrame);
+               if (ret != DEVICE_OK)
+               {
+                  errorCode_ = ret;
+                  running_ = false;
+                  return ret;
+               }
+            }
+            continue;
+         }
+      }
+
+      if (compressing)
+      {
+         int ret = SaveCompressedFrame();
+         if (ret != DEVICE_OK)
+         {
+            errorCode_ = ret;
+            running_ = false;
+            return ret;
+         }
+         continue;
+      }
+
+      if (pending >= 0)
+         break; // stop requested and no more images arrived
+   }
+
+   running_ = false;
+   return 0;
+}
+
+int StreamWriter::SaveFrame(const FrameBuffer& frame)
+{
+   for (unsigned ch=0; ; ch++)
+   {
+      const ImgBuffer* pImg = frame.FindImage(ch, 0);
+      if (pImg == 0)
+         break;
+
+      int ret = streamer_->SaveImage(const_cast<unsigned char*>(pImg->GetPixels()), pImg->Width(), pImg->Height(), pImg->Depth(), &pImg->GetMetadata());
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   imageCount_++;
+   return DEVICE_OK;
+}
+
+int StreamWriter::SaveCompressedFrame()
+{
+   unsigned channels = codec_->FinishOldest();
+   for (unsigned ch=0; ch<channels; ch++)
+   {
+      size_t bytes;
+      const unsigned char* pData = codec_->GetImage(ch, bytes);
+      Metadata md;
+      codec_->GetMetadata(ch, md);
+      int ret = streamer_->SaveCompressedImage(pData, bytes, buf_->Width(), buf_->Height(), buf_->Depth(), &md);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   codec_->ReleaseOldest();
+   imageCount_++;
+   return DEVICE_OK;
+}
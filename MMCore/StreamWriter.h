@@ -0,0 +1,76 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StreamWriter.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Writer thread draining the circular buffer into an image
+//                streamer device, so that sequences can be saved to disk
+//                without passing the images through the application layer.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// CVS:           $Id$
+//
+#ifndef _STREAM_WRITER_H_
+#define _STREAM_WRITER_H_
+
+#include <ace/Task.h>
+#include "../MMDevice/MMDevice.h"
+
+class CircularBuffer;
+class CodecStage;
+class FrameBuffer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// StreamWriter class
+// ~~~~~~~~~~~~~~~~~~
+// Pops frames from the circular buffer as soon as they arrive and hands
+// each channel to MM::ImageStreamer::SaveImage(). The streamer context must
+// be opened before Start() and closed after Stop().
+// With compression threads the frames go through a CodecStage first and
+// reach the streamer through MM::ImageStreamer::SaveCompressedImage(), in
+// the same order.
+
+class StreamWriter : public ACE_Task_Base
+{
+public:
+   StreamWriter(CircularBuffer* pBuf, MM::ImageStreamer* pStreamer, unsigned codecThreads = 0);
+   ~StreamWriter();
+
+   void Start();
+   void Stop();
+   bool IsRunning() const {return running_;}
+   bool IsCompressing() const {return codec_ != 0;}
+   long GetImageCount() const {return imageCount_;}
+   int GetErrorCode() const {return errorCode_;}
+
+   int svc();
+
+private:
+   int SaveFrame(const FrameBuffer& frame);
+   int SaveCompressedFrame();
+
+   CircularBuffer* buf_;
+   MM::ImageStreamer* streamer_;
+   unsigned codecThreads_;
+   CodecStage* codec_;
+   bool started_;
+   volatile bool stop_;
+   volatile bool running_;
+   volatile long imageCount_;
+   volatile int errorCode_;
+};
+
+#endif //_STREAM_WRITER_H_
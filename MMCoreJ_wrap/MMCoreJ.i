@@ -205,6 +205,59 @@
    }
 }
 
+// Java typemap
+// map the destination of popNextImages() to a preallocated Java array:
+// byte[], short[] or int[], matching the pixel depth.
+// All images are copied straight into the array, without any intermediate
+// Java objects. The array is not held in a critical region, because the
+// core waits for the buffer lock while filling it; it is obtained in the
+// check typemap, after the other arguments are converted, so that no early
+// return leaves it unreleased.
+
+%typemap(jni) (void* pixels, long pixelsBytes)     "jobject"
+%typemap(jtype) (void* pixels, long pixelsBytes)   "Object"
+%typemap(jstype) (void* pixels, long pixelsBytes)  "Object"
+%typemap(javain) (void* pixels, long pixelsBytes)  "$javainput"
+%typemap(in) (void* pixels, long pixelsBytes) (long elementSize)
+{
+   elementSize = 0;
+   if ($input && JCALL2(IsInstanceOf, jenv, $input, JCALL1(FindClass, jenv, "[B")))
+      elementSize = 1;
+   else if ($input && JCALL2(IsInstanceOf, jenv, $input, JCALL1(FindClass, jenv, "[S")))
+      elementSize = 2;
+   else if ($input && JCALL2(IsInstanceOf, jenv, $input, JCALL1(FindClass, jenv, "[I")))
+      elementSize = 4;
+
+   if (elementSize == 0)
+   {
+      jclass excep = jenv->FindClass("java/lang/IllegalArgumentException");
+      if (excep)
+         jenv->ThrowNew(excep, "Expected byte[], short[] or int[] array.");
+      return $null;
+   }
+
+   $1 = 0;
+   $2 = JCALL1(GetArrayLength, jenv, (jarray)$input) * elementSize;
+}
+%typemap(check) (void* pixels, long pixelsBytes)
+{
+   if (elementSize$argnum == 1)
+      $1 = JCALL2(GetByteArrayElements, jenv, (jbyteArray)$input, 0);
+   else if (elementSize$argnum == 2)
+      $1 = JCALL2(GetShortArrayElements, jenv, (jshortArray)$input, 0);
+   else
+      $1 = JCALL2(GetIntArrayElements, jenv, (jintArray)$input, 0);
+}
+%typemap(freearg) (void* pixels, long pixelsBytes)
+{
+   if ($1 && elementSize$argnum == 1)
+      JCALL3(ReleaseByteArrayElements, jenv, (jbyteArray)$input, (jbyte*)$1, 0);
+   else if ($1 && elementSize$argnum == 2)
+      JCALL3(ReleaseShortArrayElements, jenv, (jshortArray)$input, (jshort*)$1, 0);
+   else if ($1)
+      JCALL3(ReleaseIntArrayElements, jenv, (jintArray)$input, (jint*)$1, 0);
+}
+
 //
 // Map all exception objects coming from C++ level
 // generic Java Exception
@@ -293,6 +346,15 @@ namespace std {
 %include "../MMDevice/MMDeviceConstants.h"
 %include "../MMCore/Error.h"
 %include "../MMCore/Configuration.h"
-%include "../MMCore/MMCore.h"
+// both map to String, the const char* variants are wrapped
+%ignore MetadataSingleTag::SetValue(const std::string&);
+%ignore MetadataArrayTag::AddValue(const std::string&);
 %include "../MMDevice/ImageMetadata.h"
+
+// instantiated ahead of MMCore.h, which uses it in popNextImages()
+namespace std {
+    %template(MetadataVector) vector<Metadata>;
+}
+
+%include "../MMCore/MMCore.h"
 %include "../MMCore/MMEventCallback.h"
@@ -34,7 +34,10 @@
 #include "DeviceUtils.h"
 #include "ModuleInterface.h"
 #include "DeviceThreads.h"
+#include "ImageMetadata.h"
+#include "FrameMetadata.h"
 #include <assert.h>
+#include <string.h>
 
 #include <string>
 #include <vector>
@@ -66,6 +69,7 @@ const char* const g_Msg_EXCEPTION_IN_ON_THREAD_EXITING = "Exception in the OnThr
 const char* const g_Msg_SEQUENCE_ACQUISITION_THREAD_EXITING="Sequence thread exiting";
 const char* const g_Msg_DEVICE_CAMERA_BUSY_ACQUIRING="Camera is busy acquiring images.  Stop camera activity before changing this property";
 const char* const g_Msg_DEVICE_CAN_NOT_SET_PROPERTY="The device can not set this property at this moment";
+const char* const g_Msg_DEVICE_IMAGE_ACCUMULATED="The image processor is accumulating images and has no output for this one";
 
 /**
 * Implements functionality common to all devices.
@@ -455,6 +459,26 @@ protected:
    }
    virtual ~CDeviceBase() {}
 
+   /**
+   * Returns the handle of the property, or -1 if there is no such property.
+   * The handle stays valid for the lifetime of the device, so adapters that
+   * access a property often can keep it and skip the name lookup.
+   */
+   int GetPropertyHandle(const char* name) const
+   {
+      return properties_.GetHandle(name);
+   }
+
+   int GetPropertyByHandle(int handle, std::string& value) const
+   {
+      return properties_.GetByHandle(handle, value);
+   }
+
+   int SetPropertyByHandle(int handle, const char* value)
+   {
+      return properties_.SetByHandle(handle, value);
+   }
+
    /**
    * Defines the error text associated with the code.
    */
@@ -543,6 +567,7 @@ protected:
       SetErrorText(DEVICE_INVALID_PROPERTY_LIMTS, g_Msg_DEVICE_INVALID_PROPERTY_LIMTS);
       SetErrorText(DEVICE_CAMERA_BUSY_ACQUIRING, g_Msg_DEVICE_CAMERA_BUSY_ACQUIRING);
       SetErrorText(DEVICE_CAN_NOT_SET_PROPERTY, g_Msg_DEVICE_CAN_NOT_SET_PROPERTY);
+      SetErrorText(DEVICE_IMAGE_ACCUMULATED, g_Msg_DEVICE_IMAGE_ACCUMULATED);
    }
 
    /**
@@ -765,11 +790,12 @@ public:
    using CDeviceBase<MM::Camera, U>::GetImageWidth;
    using CDeviceBase<MM::Camera, U>::GetImageHeight;
    using CDeviceBase<MM::Camera, U>::GetImageBytesPerPixel;
+   using CDeviceBase<MM::Camera, U>::GetImageBufferSize;
    using CDeviceBase<MM::Camera, U>::SnapImage;
    using CDeviceBase<MM::Camera, U>::SetProperty;
    using CDeviceBase<MM::Camera, U>::LogMessage;
 
-   CCameraBase() : busy_(false), thd_(0), stopOnOverflow_(false)
+   CCameraBase() : busy_(false), thd_(0), stopOnOverflow_(false), pipelinedReadout_(false)
    {
       // create and intialize common transpose properties
       std::vector<std::string> allowedValues;
@@ -855,21 +881,62 @@ public:
       int ret = GetCoreCallback()->PrepareForAcq(this);
       if (ret != DEVICE_OK)
          return ret;
-      thd_->Start(numImages,interval_ms);
       stopOnOverflow_ = stopOnOverflow;
+      thd_->Start(numImages,interval_ms,pipelinedReadout_);
       return DEVICE_OK;
    }
 
+   /**
+   * Reads the last snapped image out directly into the next free slot of the
+   * circular buffer.
+   */
    virtual int InsertImage()
    {
-      int ret = GetCoreCallback()->InsertImage(this, GetImageBuffer(), GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
-      if (!stopOnOverflow_ && ret == DEVICE_BUFFER_OVERFLOW)
-      {
-         // do not stop on overflow - just reset the buffer
-         GetCoreCallback()->ClearImageBuffer(this);
-         return GetCoreCallback()->InsertImage(this, GetImageBuffer(), GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
-      } else
+      // when the acquisition does not stop on overflow, the core drops the
+      // oldest frame instead of reporting the overflow
+      unsigned char* pSlot = 0;
+      int ret = GetCoreCallback()->AcquireImageSlot(this, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel(), pSlot);
+      if (ret != DEVICE_OK)
+         return ret;
+
+      ret = GetImageInto(pSlot);
+      if (ret != DEVICE_OK)
          return ret;
+
+      // frames of a sequence carry the timing of the pacing loop; the last
+      // frame may still be read out after Stop(), so the hand-off decides
+      if (!thd_->IsSequenceFrame())
+         return GetCoreCallback()->CommitImageSlot(this);
+
+      // the numbers are formatted by the core only if a consumer asks
+      FrameMetadata md;
+      AddDeviceFrameTags(md, thd_->GetFrameNumber(), thd_->GetFrameTime().getUsec());
+      md.SetNumber(FrameKey_ElapsedTime, thd_->GetFrameTime().getMsec());
+      md.SetNumber(FrameKey_Interval, thd_->GetFrameIntervalMs());
+      md.SetNumber(FrameKey_Lateness, thd_->GetFrameLatenessMs());
+
+      return GetCoreCallback()->CommitImageSlot(this, md);
+   }
+
+   /**
+   * Transfers the last snapped image into the supplied buffer of
+   * GetImageWidth() * GetImageHeight() * GetImageBytesPerPixel() bytes,
+   * the size of a circular buffer slot.
+   * The default implementation copies the result of GetImageBuffer(), and
+   * fails if the image buffer has a different size, e.g. several channels or
+   * padded lines. Cameras that can read out directly into the destination
+   * should override it to avoid the extra copy.
+   */
+   virtual int GetImageInto(unsigned char* pBuf)
+   {
+      long slotBytes = (long)(GetImageWidth() * GetImageHeight() * GetImageBytesPerPixel());
+      if (GetImageBufferSize() != slotBytes)
+         return DEVICE_INCOMPATIBLE_IMAGE;
+      const unsigned char* pImg = GetImageBuffer();
+      if (pImg == 0)
+         return DEVICE_SNAP_IMAGE_FAILED;
+      memcpy(pBuf, pImg, slotBytes);
+      return DEVICE_OK;
    }
 
    //Do actual capturing
@@ -890,6 +957,17 @@ public:
       return ret;
    };
    virtual bool IsCapturing(){return !thd_->IsStopped();}
+
+   /**
+   * Lets the default sequence acquisition expose the next frame while the
+   * previous one is read out and inserted by a second thread, so that the
+   * frame rate approaches 1/exposure. SnapImage() and InsertImage() are then
+   * called directly instead of ThreadRun(), and SnapImage() may run while
+   * GetImageInto() still reads out the previous exposure: the camera must
+   * keep the two frames apart. Takes effect when the next sequence starts.
+   */
+   void SetPipelinedReadout(bool pipelined) {pipelinedReadout_ = pipelined;}
+   bool IsPipelinedReadout() const {return pipelinedReadout_;}
    
    class CaptureRestartHelper
    {
@@ -908,6 +986,23 @@ public:
    };
 
 protected:
+   /**
+   * Adds the standard tags of the frame counter and the timestamp of the
+   * camera, in microseconds, from which the frame timing and the dropped
+   * frames can be reconstructed offline. Cameras without a clock of their
+   * own report the start of the frame in the sequence thread.
+   * The tags are kept as numbers and reported with the label of the camera;
+   * commit the frame with CommitImageSlot(this, md).
+   */
+   void AddDeviceFrameTags(FrameMetadata& md, long frameCounter, double timestampUs)
+   {
+      char label[MM::MaxStrLength];
+      GetLabel(label);
+      md.SetDevice(label);
+      md.SetNumber(FrameKey_DeviceFrameCounter, frameCounter);
+      md.SetNumber(FrameKey_DeviceTimestamp, timestampUs);
+   }
+
    // called from the thread function before exit 
    virtual void OnThreadExiting() throw()
    {
@@ -929,6 +1024,7 @@ protected:
 protected:
    bool busy_;
    bool stopOnOverflow_;
+   bool pipelinedReadout_;
 
    class BaseSequenceThread;
    BaseSequenceThread * thd_;
@@ -937,6 +1033,12 @@ protected:
    {
       friend class CCameraBase;
       enum { default_numImages=1, default_intervalMS = 100 };
+#ifdef WIN32
+      enum { spinMarginMs = 16 }; // default resolution of Sleep()
+#else
+      enum { spinMarginMs = 2 };
+#endif
+      enum { maxSleepMs = 100 };  // keeps long intervals responsive to Stop()
    public:
       BaseSequenceThread(CCameraBase* pCam)
          :intervalMs_(default_intervalMS)
@@ -947,7 +1049,12 @@ protected:
          ,camera_(pCam)
          ,startTime_(0)
          ,actualDuration_(0)
-         ,lastFrameTime_(0)
+         ,lastFrameTime_(-1.0)
+         ,pipelined_(false)
+         ,readoutQuit_(false)
+         ,readoutError_(DEVICE_OK)
+         ,readoutIdle_(1)
+         ,readoutThd_(this)
       {};
 
       ~BaseSequenceThread() {}
@@ -957,19 +1064,21 @@ protected:
          stop_=true;
       }
 
-      void Start(long numImages, double intervalMs)
+      void Start(long numImages, double intervalMs, bool pipelined = false)
       {
          MMThreadGuard(this->stopLock_);
          MMThreadGuard(this->suspendLock_);
          numImages_=numImages;
          intervalMs_=intervalMs;
+         pipelined_=pipelined;
          imageCounter_=0;
          stop_ = false;
          suspend_=false;
+         lastFrameTime_ = -1.0;
+         readoutFrame_.sequence = false;
          activate();
          actualDuration_ = 0;
          startTime_= camera_->GetCurrentMMTime();
-         lastFrameTime_ = 0;
       }
       bool IsStopped(){
          MMThreadGuard(this->stopLock_);
@@ -992,16 +1101,149 @@ protected:
       long GetImageCounter(){return imageCounter_;}
       MM::MMTime GetStartTime(){return startTime_;}
       MM::MMTime GetActualDuration(){return actualDuration_;}
+      // timing of the frame being inserted
+      MM::MMTime GetFrameTime(){return readoutFrame_.time;}
+      double GetFrameIntervalMs(){return readoutFrame_.intervalMs;}
+      double GetFrameLatenessMs(){return readoutFrame_.latenessMs;}
+      long GetFrameNumber(){return readoutFrame_.number;}
+      bool IsSequenceFrame(){return readoutFrame_.sequence;}
 
    private:
+      /**
+      * Waits for the frame slot on the absolute schedule
+      * start + slot * intervalMs_ and returns the monotonic time at which the
+      * frame starts. Sleeps while the deadline is far and spins for the last
+      * spinMarginMs, which the sleep granularity of the OS can not resolve.
+      * Slots that have already passed are skipped, so a slow frame delays
+      * only itself and the schedule does not drift.
+      */
+      double WaitForSlot(double startMs, long& slot)
+      {
+         double nowMs = CDeviceUtils::GetMonotonicTimeMs();
+         if (intervalMs_ <= 0.0)
+            return nowMs;
+
+         double deadlineMs = startMs + slot * intervalMs_;
+         if (nowMs - deadlineMs >= intervalMs_)
+         {
+            slot = (long)((nowMs - startMs) / intervalMs_);
+            deadlineMs = startMs + slot * intervalMs_;
+         }
+
+         while (nowMs < deadlineMs && !IsStopped())
+         {
+            double remainingMs = deadlineMs - nowMs;
+            if (remainingMs > spinMarginMs + maxSleepMs)
+               CDeviceUtils::SleepMs(maxSleepMs);
+            else if (remainingMs > spinMarginMs)
+               CDeviceUtils::SleepMs((long)(remainingMs - spinMarginMs));
+            nowMs = CDeviceUtils::GetMonotonicTimeMs();
+         }
+         return nowMs;
+      }
+
+      /**
+      * Exposes the next frame, then hands it to the readout thread as soon as
+      * that has inserted the previous one.
+      */
+      int ExposeAndHandOver()
+      {
+         int ret = camera_->SnapImage();
+         if (ret != DEVICE_OK)
+            return ret;
+
+         readoutIdle_.Wait();
+         if (readoutError_ != DEVICE_OK)
+         {
+            readoutIdle_.Post();
+            return readoutError_;
+         }
+         readoutFrame_ = exposedFrame_;
+         frameReady_.Post();
+         return DEVICE_OK;
+      }
+
+      /**
+      * Waits for the frame in readout, if any, and ends the readout thread.
+      */
+      int StopReadout()
+      {
+         readoutIdle_.Wait();
+         readoutQuit_ = true;
+         frameReady_.Post();
+         readoutThd_.wait();
+         readoutIdle_.Post();
+         return readoutError_;
+      }
+
+      int ReadoutLoop()
+      {
+         while (true)
+         {
+            frameReady_.Wait();
+            if (readoutQuit_)
+               break;
+            try
+            {
+               int ret = camera_->InsertImage();
+               if (ret != DEVICE_OK)
+                  readoutError_ = ret;
+            }catch(...)
+            {
+               camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+               readoutError_ = DEVICE_ERR;
+            }
+            readoutFrame_.sequence = false;
+            readoutIdle_.Post();
+         }
+         return readoutError_;
+      }
+
+      class ReadoutThread : public MMDeviceThreadBase
+      {
+      public:
+         ReadoutThread(BaseSequenceThread* pSeq) : seq_(pSeq) {}
+         int svc(void) throw() {return seq_->ReadoutLoop();}
+      private:
+         BaseSequenceThread* seq_;
+      };
+      friend class ReadoutThread;
+
       int svc(void) throw()
       {
          int ret=DEVICE_ERR;
+         if (pipelined_)
+         {
+            readoutQuit_ = false;
+            readoutError_ = DEVICE_OK;
+            readoutThd_.activate();
+         }
          try 
          {
+            double startMs = CDeviceUtils::GetMonotonicTimeMs();
+            long slot = 0;
             do
             {  
-               ret=camera_->ThreadRun();
+               double nowMs = WaitForSlot(startMs, slot);
+               if (IsStopped())
+                  break;
+               // without an interval there is no schedule to be late for
+               exposedFrame_.latenessMs = intervalMs_ > 0.0 ? nowMs - (startMs + slot * intervalMs_) : 0.0;
+               exposedFrame_.intervalMs = lastFrameTime_ < 0.0 ? 0.0 : nowMs - lastFrameTime_;
+               exposedFrame_.time = camera_->GetCurrentMMTime();
+               exposedFrame_.number = imageCounter_;
+               exposedFrame_.sequence = true;
+               lastFrameTime_ = nowMs;
+               slot++;
+
+               if (pipelined_)
+                  ret = ExposeAndHandOver();
+               else
+               {
+                  readoutFrame_ = exposedFrame_;
+                  ret=camera_->ThreadRun();
+                  readoutFrame_.sequence = false;
+               }
             } while (DEVICE_OK == ret && !IsStopped() && imageCounter_++ < numImages_-1);
             if (IsStopped())
                camera_->LogMessage("SeqAcquisition interrupted by the user\n");
@@ -1009,6 +1251,12 @@ protected:
          {
             camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
          }
+         if (pipelined_)
+         {
+            int readoutRet = StopReadout();
+            if (ret == DEVICE_OK)
+               ret = readoutRet;
+         }
          stop_=true;
          actualDuration_ = camera_->GetCurrentMMTime() - startTime_;
          camera_->OnThreadExiting();
@@ -1023,7 +1271,26 @@ protected:
       double intervalMs_;
       MM::MMTime startTime_;
       MM::MMTime actualDuration_;
-      MM::MMTime lastFrameTime_;
+      double lastFrameTime_;     // monotonic ms, negative before the first frame
+
+      struct FrameTiming
+      {
+         FrameTiming() : time(0), intervalMs(0.0), latenessMs(0.0), number(0), sequence(false) {}
+         MM::MMTime time;        // start of the frame, core time base
+         double intervalMs;      // achieved interval to the previous frame
+         double latenessMs;      // delay of the frame behind its slot
+         long number;            // frames started before this one
+         bool sequence;          // handed over by the sequence thread and not inserted yet
+      };
+      FrameTiming exposedFrame_;
+      FrameTiming readoutFrame_;
+
+      bool pipelined_;
+      volatile bool readoutQuit_;
+      volatile int readoutError_;
+      MMThreadSemaphore frameReady_;  // exposed frame handed to the readout thread
+      MMThreadSemaphore readoutIdle_; // previous frame inserted
+      ReadoutThread readoutThd_;
       MMThreadLock stopLock_;
       MMThreadLock suspendLock_;
    };
@@ -1242,6 +1509,50 @@ class CAutoFocusBase : public CDeviceBase<MM::AutoFocus, U>
 template <class U>
 class CImageProcessorBase : public CDeviceBase<MM::ImageProcessor, U>
 {
+public:
+   /**
+    * By default processors keep the image format.
+    */
+   virtual int GetOutputFormat(unsigned width, unsigned height, unsigned byteDepth,
+                               unsigned& outWidth, unsigned& outHeight, unsigned& outByteDepth)
+   {
+      outWidth = width;
+      outHeight = height;
+      outByteDepth = byteDepth;
+      return DEVICE_OK;
+   }
+
+   virtual bool PrefersProcessInto() {return false;}
+
+   /**
+    * Default out-of-place processing: copies the source to the destination
+    * and processes it there in place.
+    */
+   virtual int ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                           unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth)
+   {
+      if (dstWidth != width || dstHeight != height || dstByteDepth != byteDepth)
+         return DEVICE_UNSUPPORTED_COMMAND;
+      memcpy(dst, src, (size_t)width * height * byteDepth);
+      return this->Process(dst, width, height, byteDepth);
+   }
+};
+
+/**
+* Base class for creating image streaming (saving) modules.
+*/
+template <class U>
+class CImageStreamerBase : public CDeviceBase<MM::ImageStreamer, U>
+{
+public:
+   /**
+    * By default streamers save uncompressed images only.
+    */
+   virtual bool AcceptsCompressedImages() {return false;}
+   virtual int SaveCompressedImage(const unsigned char* /*data*/, size_t /*bytes*/, unsigned /*width*/, unsigned /*height*/, unsigned /*depth*/, const Metadata* /*imageMd*/ = 0)
+   {
+      return DEVICE_UNSUPPORTED_COMMAND;
+   }
 };
 
 /**
@@ -23,6 +23,7 @@
 
 #pragma once
 #include <assert.h>
+#include <limits.h>
 
 #ifdef WIN32
    #define WIN32_LEAN_AND_MEAN
@@ -117,3 +118,62 @@ private:
    MMThreadGuard& operator=(MMThreadGuard& /*rhs*/) {assert(false); return *this;}
    MMThreadLock& lock_;
 };
+
+/**
+ * Counting semaphore, e.g. for handing buffers over between two threads.
+ */
+class MMThreadSemaphore
+{
+public:
+#ifdef WIN32
+   MMThreadSemaphore(long initialCount = 0)
+   {
+      sem_ = CreateSemaphore(NULL, initialCount, LONG_MAX, NULL);
+   }
+
+   ~MMThreadSemaphore()
+   {
+      CloseHandle(sem_);
+   }
+
+   void Wait() {WaitForSingleObject(sem_, INFINITE);}
+   void Post() {ReleaseSemaphore(sem_, 1, NULL);}
+
+private:
+   HANDLE sem_;
+#else
+   MMThreadSemaphore(long initialCount = 0) : count_(initialCount)
+   {
+      pthread_mutex_init(&lock_, NULL);
+      pthread_cond_init(&cond_, NULL);
+   }
+
+   ~MMThreadSemaphore()
+   {
+      pthread_cond_destroy(&cond_);
+      pthread_mutex_destroy(&lock_);
+   }
+
+   void Wait()
+   {
+      pthread_mutex_lock(&lock_);
+      while (count_ == 0)
+         pthread_cond_wait(&cond_, &lock_);
+      count_--;
+      pthread_mutex_unlock(&lock_);
+   }
+
+   void Post()
+   {
+      pthread_mutex_lock(&lock_);
+      count_++;
+      pthread_cond_signal(&cond_);
+      pthread_mutex_unlock(&lock_);
+   }
+
+private:
+   pthread_mutex_t lock_;
+   pthread_cond_t cond_;
+   long count_;
+#endif
+};
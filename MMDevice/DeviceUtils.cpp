@@ -29,6 +29,10 @@
    #include <windows.h>
    #define snprintf _snprintf 
 #pragma warning(disable : 4996)
+#elif defined(__APPLE__)
+   #include <mach/mach_time.h>
+#else
+   #include <time.h>
 #endif
 
 char CDeviceUtils::m_pszBuffer[MM::MaxStrLength]={""};
@@ -128,3 +132,26 @@ void CDeviceUtils::SleepMs(long periodMs)
    usleep(periodMs * 1000);
 #endif
 }
+
+/**
+ * Milliseconds from an arbitrary origin, measured with a clock that is not
+ * affected by changes of the system time. Meant for measuring intervals.
+ */
+double CDeviceUtils::GetMonotonicTimeMs()
+{
+#ifdef WIN32
+   LARGE_INTEGER freq, count;
+   QueryPerformanceFrequency(&freq);
+   QueryPerformanceCounter(&count);
+   return (double)count.QuadPart * 1000.0 / (double)freq.QuadPart;
+#elif defined(__APPLE__)
+   static mach_timebase_info_data_t timebase;
+   if (timebase.denom == 0)
+      mach_timebase_info(&timebase);
+   return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1.0e6;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000.0 + t.tv_nsec / 1.0e6;
+#endif
+}
@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        FrameMetadata.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Compact per-frame metadata: numeric tags with interned
+//                keys stored inline, next to the string tags of Metadata.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+
+#if !defined(_FRAME_METADATA_)
+#define _FRAME_METADATA_
+
+#include "MMDeviceConstants.h"
+#include "ImageMetadata.h"
+#include <sstream>
+#include <iomanip>
+
+/**
+ * Interned keys of the numeric frame metadata. Each key stands for a tag
+ * name, the device label the tag is reported with and the number of
+ * decimals, see FrameMetadata::GetKeyInfo(). The keys are the same in all
+ * modules.
+ */
+enum FrameMetadataKey
+{
+   FrameKey_BufferElapsedTime = 0, // stamped by the circular buffer
+   FrameKey_ReceivedTime,          // core receive time of every frame
+   FrameKey_ElapsedTime,           // camera supplied elapsed time
+   FrameKey_Interval,              // achieved interval of the sequence
+   FrameKey_Lateness,              // delay of the frame behind its slot
+   FrameKey_DeviceFrameCounter,    // frame counter of the camera
+   FrameKey_DeviceTimestamp,       // camera clock, microseconds
+   FrameKey_DeviceFramesBehind,    // frames waiting in the driver behind this one
+   FrameKey_Count
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FrameMetadata class
+// ~~~~~~~~~~~~~~~~~~~
+// The numbers live in a fixed array indexed by the key, so that setting and
+// copying them never touches the heap. The string tags supplied by the
+// devices are kept as Metadata. ToMetadata() formats the numbers as string
+// tags only when someone asks for the Metadata view.
+// Keys without a fixed device are reported with the label of the device
+// that supplied the frame, see SetDevice().
+//
+
+class FrameMetadata
+{
+public:
+   struct KeyInfo
+   {
+      const char* name;
+      const char* device;              // 0: the device that supplied the frame
+      int decimals;
+   };
+
+   static const KeyInfo& GetKeyInfo(FrameMetadataKey key)
+   {
+      static const KeyInfo keys[FrameKey_Count] =
+      {
+         {MM::g_Keyword_Elapsed_Time_ms, "Buffer", 2},
+         {MM::g_Keyword_Metadata_ReceivedTime, "Core", 3},
+         {MM::g_Keyword_Elapsed_Time_ms, 0, 2},
+         {MM::g_Keyword_Metadata_Interval, 0, 2},
+         {MM::g_Keyword_Metadata_Lateness, 0, 2},
+         {MM::g_Keyword_Metadata_DeviceFrameCounter, 0, 0},
+         {MM::g_Keyword_Metadata_DeviceTimestamp, 0, 2},
+         {MM::g_Keyword_Metadata_DeviceFramesBehind, 0, 0}
+      };
+      return keys[key];
+   }
+
+   FrameMetadata() : numbers_(0) {}
+
+   void Clear()
+   {
+      numbers_ = 0;
+      device_.clear();
+      tags_.Clear();
+   }
+
+   void SetDevice(const char* label) {device_ = label;}
+   const std::string& GetDevice() const {return device_;}
+
+   void SetTags(const Metadata& md) {tags_ = md;}
+   const Metadata& GetTags() const {return tags_;}
+
+   void SetNumber(FrameMetadataKey key, double value)
+   {
+      values_[key] = value;
+      numbers_ |= 1u << key;
+   }
+
+   bool GetNumber(FrameMetadataKey key, double& value) const
+   {
+      if ((numbers_ & (1u << key)) == 0)
+         return false;
+      value = values_[key];
+      return true;
+   }
+
+   bool HasNumbers() const {return numbers_ != 0;}
+
+   /**
+    * Copies the string tags to md and adds the numbers as read-only tags.
+    */
+   void ToMetadata(Metadata& md) const
+   {
+      md = tags_;
+      for (int k=0; k<FrameKey_Count; k++)
+      {
+         if ((numbers_ & (1u << k)) == 0)
+            continue;
+         const KeyInfo& info = GetKeyInfo((FrameMetadataKey)k);
+         std::ostringstream os;
+         os << std::fixed << std::setprecision(info.decimals) << values_[k];
+         MetadataSingleTag tag(info.name, info.device ? info.device : device_.c_str(), true);
+         tag.SetValue(os.str().c_str());
+         md.SetTag(tag);
+      }
+   }
+
+private:
+   unsigned numbers_;               // bit mask of the keys set
+   double values_[FrameKey_Count];
+   std::string device_;             // label of the device that supplied the frame
+   Metadata tags_;
+};
+
+#endif // !defined(_FRAME_METADATA_)
@@ -0,0 +1,366 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        ImageCodec.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Fast lossless compression of 8 and 16-bit images.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+#include "ImageCodec.h"
+#include "DeviceThreads.h"
+#include <string.h>
+#include <vector>
+
+const unsigned blockValues = 16; // residuals packed with one bit width
+
+/**
+ * Packs 16 values of up to 16 bits, preceded by their bit width; 16 values
+ * of b bits take exactly 2b bytes.
+ */
+static unsigned char* PackBlock(const unsigned* values, unsigned char* out)
+{
+   unsigned all = 0;
+   for (unsigned i=0; i<blockValues; i++)
+      all |= values[i];
+   unsigned bits = 0;
+   while (all >> bits)
+      bits++;
+
+   *out++ = (unsigned char)bits;
+   unsigned long long acc = 0;
+   unsigned filled = 0;
+   for (unsigned i=0; i<blockValues && bits > 0; i++)
+   {
+      acc |= (unsigned long long)values[i] << filled;
+      filled += bits;
+      while (filled >= 8)
+      {
+         *out++ = (unsigned char)acc;
+         acc >>= 8;
+         filled -= 8;
+      }
+   }
+   return out;
+}
+
+static void UnpackBlock(const unsigned char* in, unsigned bits, unsigned* values)
+{
+   const unsigned mask = (1u << bits) - 1;
+   unsigned long long acc = 0;
+   unsigned avail = 0;
+   for (unsigned i=0; i<blockValues; i++)
+   {
+      while (avail < bits)
+      {
+         acc |= (unsigned long long)*in++ << avail;
+         avail += 8;
+      }
+      values[i] = (unsigned)acc & mask;
+      acc >>= bits;
+      avail -= bits;
+   }
+}
+
+/**
+ * Encodes a band of rows; returns the encoded bytes. Differences wrap
+ * around in the pixel type, so every value has an exact residual.
+ */
+template <class T>
+static size_t EncodeTile(const T* src, unsigned width, unsigned rows, unsigned char* dst)
+{
+   const unsigned shift = sizeof(T) * 8 - 1;
+   const unsigned mask = (1u << (shift + 1)) - 1;
+   const size_t count = (size_t)width * rows;
+
+   unsigned char* out = dst;
+   unsigned block[blockValues];
+   unsigned n = 0;
+   unsigned x = 0;
+   for (size_t i=0; i<count; i++)
+   {
+      T pred = x > 0 ? src[i - 1] : (i >= width ? src[i - width] : 0);
+      unsigned diff = (T)(src[i] - pred);
+      block[n++] = ((diff << 1) ^ (0u - (diff >> shift))) & mask; // zigzag
+      if (n == blockValues)
+      {
+         out = PackBlock(block, out);
+         n = 0;
+      }
+      if (++x == width)
+         x = 0;
+   }
+   if (n > 0)
+   {
+      for (; n<blockValues; n++)
+         block[n] = 0;
+      out = PackBlock(block, out);
+   }
+   return out - dst;
+}
+
+template <class T>
+static bool DecodeTile(const unsigned char* src, size_t srcBytes, T* dst, unsigned width, unsigned rows)
+{
+   const size_t count = (size_t)width * rows;
+   const unsigned char* in = src;
+   const unsigned char* end = src + srcBytes;
+
+   unsigned block[blockValues];
+   unsigned x = 0;
+   for (size_t i=0; i<count; i+=blockValues)
+   {
+      if (in >= end)
+         return false;
+      unsigned bits = *in++;
+      if (bits > sizeof(T) * 8 || (size_t)(end - in) < 2 * bits)
+         return false;
+      UnpackBlock(in, bits, block);
+      in += 2 * bits;
+
+      size_t n = count - i < blockValues ? count - i : blockValues;
+      for (size_t k=0; k<n; k++)
+      {
+         size_t j = i + k;
+         T pred = x > 0 ? dst[j - 1] : (j >= width ? dst[j - width] : 0);
+         unsigned diff = (block[k] >> 1) ^ (0u - (block[k] & 1));
+         dst[j] = (T)(pred + diff);
+         if (++x == width)
+            x = 0;
+      }
+   }
+   return true;
+}
+
+/**
+ * Decodes a range of tiles in its own thread.
+ */
+class ImageCodec::TileThread : public MMDeviceThreadBase
+{
+public:
+   TileThread(const unsigned char* src, const std::vector<size_t>& offsets, const std::vector<size_t>& bytes,
+              unsigned char* dst, unsigned width, unsigned height, unsigned depth, unsigned tileRows,
+              unsigned firstTile, unsigned lastTile) :
+      src_(src), offsets_(offsets), bytes_(bytes), dst_(dst), width_(width), height_(height), depth_(depth),
+      tileRows_(tileRows), firstTile_(firstTile), lastTile_(lastTile), ok_(false) {}
+
+   int svc()
+   {
+      ok_ = true;
+      for (unsigned t=firstTile_; t<lastTile_ && ok_; t++)
+      {
+         unsigned firstRow = t * tileRows_;
+         unsigned rows = height_ - firstRow < tileRows_ ? height_ - firstRow : tileRows_;
+         ok_ = DecompressTile(src_ + offsets_[t], bytes_[t], dst_ + (size_t)firstRow * width_ * depth_, width_, rows, depth_);
+      }
+      return 0;
+   }
+
+   bool Succeeded() const {return ok_;}
+
+private:
+   const unsigned char* src_;
+   const std::vector<size_t>& offsets_;
+   const std::vector<size_t>& bytes_;
+   unsigned char* dst_;
+   unsigned width_;
+   unsigned height_;
+   unsigned depth_;
+   unsigned tileRows_;
+   unsigned firstTile_;
+   unsigned lastTile_;
+   bool ok_;
+};
+
+unsigned ImageCodec::TileCount(unsigned height)
+{
+   return (height + g_ImageCodecTileRows - 1) / g_ImageCodecTileRows;
+}
+
+/**
+ * Size of the header and the tile table.
+ */
+size_t ImageCodec::TableBytes(unsigned tileCount)
+{
+   return sizeof(ImageCodecHeader) + tileCount * sizeof(unsigned int);
+}
+
+/**
+ * Worst case size of an encoded tile: every block at full width.
+ */
+size_t ImageCodec::MaxTileBytes(unsigned width, unsigned depth)
+{
+   size_t blocks = ((size_t)width * g_ImageCodecTileRows + blockValues - 1) / blockValues;
+   return blocks * (1 + 2 * 8 * depth);
+}
+
+/**
+ * Size of the destination buffer the compression needs, a few percent more
+ * than the raw image.
+ */
+size_t ImageCodec::MaxCompressedBytes(unsigned width, unsigned height, unsigned depth)
+{
+   unsigned tiles = TileCount(height);
+   return TableBytes(tiles) + tiles * MaxTileBytes(width, depth);
+}
+
+/**
+ * Compresses the image in the calling thread. dst must hold
+ * MaxCompressedBytes(). Returns the compressed size, or 0 if the pixel
+ * type is not supported.
+ */
+size_t ImageCodec::Compress(const unsigned char* src, unsigned width, unsigned height, unsigned depth, unsigned char* dst)
+{
+   if (!CanCompress(depth) || width == 0 || height == 0)
+      return 0;
+
+   unsigned tiles = TileCount(height);
+   std::vector<size_t> tileBytes(tiles);
+   for (unsigned t=0; t<tiles; t++)
+      tileBytes[t] = CompressTile(src, width, height, depth, t, TileSlot(dst, width, height, depth, t));
+   return Assemble(dst, width, height, depth, &tileBytes[0]);
+}
+
+/**
+ * Where CompressTile() writes the given tile before Assemble().
+ */
+unsigned char* ImageCodec::TileSlot(unsigned char* dst, unsigned width, unsigned height, unsigned depth, unsigned tile)
+{
+   return dst + TableBytes(TileCount(height)) + tile * MaxTileBytes(width, depth);
+}
+
+/**
+ * Encodes one tile of the image into dst, which must hold the worst case
+ * size of a tile. Returns the encoded bytes.
+ */
+size_t ImageCodec::CompressTile(const unsigned char* src, unsigned width, unsigned height, unsigned depth, unsigned tile, unsigned char* dst)
+{
+   unsigned firstRow = tile * g_ImageCodecTileRows;
+   if (firstRow >= height)
+      return 0;
+   unsigned rows = height - firstRow < g_ImageCodecTileRows ? height - firstRow : g_ImageCodecTileRows;
+
+   size_t offset = (size_t)firstRow * width;
+   if (depth == 1)
+      return EncodeTile(src + offset, width, rows, dst);
+   return EncodeTile((const unsigned short*)src + offset, width, rows, dst);
+}
+
+/**
+ * Moves the tiles from their slots to the final positions, after the table,
+ * and fills in the header and the table. Returns the compressed size.
+ */
+size_t ImageCodec::Assemble(unsigned char* dst, unsigned width, unsigned height, unsigned depth, const size_t* tileBytes)
+{
+   unsigned tiles = TileCount(height);
+   unsigned char* out = dst + TableBytes(tiles);
+   for (unsigned t=0; t<tiles; t++)
+   {
+      memmove(out, TileSlot(dst, width, height, depth, t), tileBytes[t]);
+      out += tileBytes[t];
+      unsigned int bytes = (unsigned int)tileBytes[t];
+      memcpy(dst + sizeof(ImageCodecHeader) + t * sizeof(unsigned int), &bytes, sizeof(bytes));
+   }
+
+   ImageCodecHeader header;
+   memset(&header, 0, sizeof(header));
+   strncpy(header.magic, g_ImageCodecMagic, sizeof(header.magic));
+   header.version = g_ImageCodecVersion;
+   header.width = width;
+   header.height = height;
+   header.depth = depth;
+   header.tileRows = g_ImageCodecTileRows;
+   header.tileCount = tiles;
+   header.totalBytes = (unsigned long long)(out - dst);
+   memcpy(dst, &header, sizeof(header));
+   return out - dst;
+}
+
+/**
+ * Reads and validates the header of a compressed image of srcBytes or more.
+ */
+bool ImageCodec::ReadHeader(const unsigned char* src, size_t srcBytes, ImageCodecHeader& header)
+{
+   if (srcBytes < sizeof(header))
+      return false;
+   memcpy(&header, src, sizeof(header));
+   return strncmp(header.magic, g_ImageCodecMagic, sizeof(header.magic)) == 0 &&
+          header.version <= g_ImageCodecVersion && CanCompress(header.depth) &&
+          header.width > 0 && header.height > 0 && header.tileRows > 0 &&
+          header.tileCount == (header.height + header.tileRows - 1) / header.tileRows &&
+          header.totalBytes >= TableBytes(header.tileCount) && header.totalBytes <= srcBytes;
+}
+
+/**
+ * Restores the image into dst, which has the given format. The tiles are
+ * spread over the given number of threads. Returns false if the data is
+ * corrupt or has another format.
+ */
+bool ImageCodec::Decompress(const unsigned char* src, size_t srcBytes, unsigned char* dst, unsigned width, unsigned height, unsigned depth, unsigned threads)
+{
+   ImageCodecHeader header;
+   if (!ReadHeader(src, srcBytes, header) || header.width != width || header.height != height || header.depth != depth)
+      return false;
+
+   unsigned tiles = header.tileCount;
+   std::vector<size_t> offsets(tiles);
+   std::vector<size_t> bytes(tiles);
+   size_t offset = TableBytes(tiles);
+   for (unsigned t=0; t<tiles; t++)
+   {
+      unsigned int tileBytes;
+      memcpy(&tileBytes, src + sizeof(header) + t * sizeof(unsigned int), sizeof(tileBytes));
+      if (tileBytes > header.totalBytes - offset)
+         return false;
+      offsets[t] = offset;
+      bytes[t] = tileBytes;
+      offset += tileBytes;
+   }
+
+   if (threads > tiles)
+      threads = tiles;
+   if (threads <= 1)
+   {
+      TileThread all(src, offsets, bytes, dst, width, height, depth, header.tileRows, 0, tiles);
+      all.svc();
+      return all.Succeeded();
+   }
+
+   unsigned tilesPerThread = (tiles + threads - 1) / threads;
+   std::vector<TileThread*> workers;
+   for (unsigned first=tilesPerThread; first<tiles; first+=tilesPerThread)
+   {
+      unsigned last = first + tilesPerThread < tiles ? first + tilesPerThread : tiles;
+      TileThread* pWorker = new TileThread(src, offsets, bytes, dst, width, height, depth, header.tileRows, first, last);
+      pWorker->activate();
+      workers.push_back(pWorker);
+   }
+   TileThread own(src, offsets, bytes, dst, width, height, depth, header.tileRows, 0, tilesPerThread);
+   own.svc();
+   bool ok = own.Succeeded();
+   for (unsigned i=0; i<workers.size(); i++)
+   {
+      workers[i]->wait();
+      ok = ok && workers[i]->Succeeded();
+      delete workers[i];
+   }
+   return ok;
+}
+
+bool ImageCodec::DecompressTile(const unsigned char* src, size_t srcBytes, unsigned char* dst, unsigned width, unsigned rows, unsigned depth)
+{
+   if (depth == 1)
+      return DecodeTile(src, srcBytes, dst, width, rows);
+   return DecodeTile(src, srcBytes, (unsigned short*)dst, width, rows);
+}
@@ -0,0 +1,91 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        ImageCodec.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Fast lossless compression of 8 and 16-bit images.
+//
+//                [header]   ImageCodecHeader
+//                [table]    tileCount unsigned ints, bytes of each tile
+//                [tiles]    the encoded tiles, back to back
+//
+//                A tile is a band of tileRows rows, encoded on its own so
+//                that tiles can be compressed and decompressed in parallel.
+//                Each pixel is predicted by its left neighbour (the first
+//                pixel of a row by the pixel above it); the residuals are
+//                zigzag mapped to small unsigned numbers and packed in
+//                blocks of 16 with the bit width of the largest one, which
+//                is stored in one byte before the block. Smooth 16-bit
+//                images typically shrink to a third or half.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+
+#if !defined(_IMAGE_CODEC_)
+#define _IMAGE_CODEC_
+
+#include <stddef.h>
+
+const char* const g_ImageCodecMagic = "MMZ";
+const unsigned int g_ImageCodecVersion = 1;
+const unsigned int g_ImageCodecTileRows = 64;
+
+struct ImageCodecHeader
+{
+   char magic[4];                 // "MMZ"
+   unsigned int version;
+   unsigned int width;
+   unsigned int height;
+   unsigned int depth;            // bytes per pixel
+   unsigned int tileRows;
+   unsigned int tileCount;
+   unsigned int reserved;
+   unsigned long long totalBytes; // of the whole compressed image
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ImageCodec class
+// ~~~~~~~~~~~~~~~~
+// Compress() and Decompress() handle whole images. Callers that spread the
+// tiles over their own threads compress each tile with CompressTile() into
+// its slot of the destination, see TileSlot(), and call Assemble() when
+// all tiles are done.
+//
+
+class ImageCodec
+{
+public:
+   static bool CanCompress(unsigned depth) {return depth == 1 || depth == 2;}
+   static unsigned TileCount(unsigned height);
+   static size_t MaxCompressedBytes(unsigned width, unsigned height, unsigned depth);
+
+   static size_t Compress(const unsigned char* src, unsigned width, unsigned height, unsigned depth, unsigned char* dst);
+   static bool Decompress(const unsigned char* src, size_t srcBytes, unsigned char* dst, unsigned width, unsigned height, unsigned depth, unsigned threads = 1);
+   static bool ReadHeader(const unsigned char* src, size_t srcBytes, ImageCodecHeader& header);
+
+   static unsigned char* TileSlot(unsigned char* dst, unsigned width, unsigned height, unsigned depth, unsigned tile);
+   static size_t CompressTile(const unsigned char* src, unsigned width, unsigned height, unsigned depth, unsigned tile, unsigned char* dst);
+   static size_t Assemble(unsigned char* dst, unsigned width, unsigned height, unsigned depth, const size_t* tileBytes);
+
+private:
+   class TileThread;
+   friend class TileThread;
+
+   static size_t TableBytes(unsigned tileCount);
+   static size_t MaxTileBytes(unsigned width, unsigned depth);
+   static bool DecompressTile(const unsigned char* src, size_t srcBytes, unsigned char* dst, unsigned width, unsigned rows, unsigned depth);
+};
+
+#endif // !defined(_IMAGE_CODEC_)
@@ -33,6 +33,8 @@
 #include <vector>
 #include <map>
 #include <sstream>
+#include <stdlib.h>
+#include <string.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // MetadataError
@@ -96,6 +98,70 @@ public:
    virtual std::string Serialize() = 0;
    virtual bool Restore(const char* stream) = 0;
 
+protected:
+   friend class Metadata;
+
+   // text form: one field per line
+   virtual void WriteText(std::ostream& os) const = 0;
+   virtual bool ReadText(std::istream& is) = 0;
+
+   void WriteTextHeader(std::ostream& os) const
+   {
+      WriteTextLine(os, name_);
+      WriteTextLine(os, deviceLabel_);
+      os << (readOnly_ ? 1 : 0) << std::endl;
+   }
+
+   bool ReadTextHeader(std::istream& is)
+   {
+      std::string ro;
+      if (!ReadTextLine(is, name_) || !ReadTextLine(is, deviceLabel_) || !ReadTextLine(is, ro))
+         return false;
+      readOnly_ = (ro.compare("1") == 0);
+      return true;
+   }
+
+   /**
+    * Writes the field on one line; backslashes and line breaks in the
+    * field are escaped, so that any value survives the round trip.
+    */
+   static void WriteTextLine(std::ostream& os, const std::string& field)
+   {
+      for (size_t i=0; i<field.size(); i++)
+      {
+         switch (field[i])
+         {
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\r': os << "\\r"; break;
+            default: os << field[i];
+         }
+      }
+      os << std::endl;
+   }
+
+   static bool ReadTextLine(std::istream& is, std::string& field)
+   {
+      std::string line;
+      if (!std::getline(is, line))
+         return false;
+      if (!line.empty() && line[line.size()-1] == '\r')
+         line.erase(line.size()-1);
+
+      field.clear();
+      for (size_t i=0; i<line.size(); i++)
+      {
+         if (line[i] == '\\' && i+1 < line.size())
+         {
+            char c = line[++i];
+            field += (c == 'n') ? '\n' : (c == 'r') ? '\r' : c;
+         }
+         else
+            field += line[i];
+      }
+      return true;
+   }
+
 private:
    std::string name_;
    std::string deviceLabel_;
@@ -110,8 +176,9 @@ public:
       MetadataTag(name, device, readOnly) {}
    ~MetadataSingleTag() {}
 
-   const std::string& GetValue() {return value_;}
+   const std::string& GetValue() const {return value_;}
    void SetValue(const char* val) {value_ = val;}
+   void SetValue(const std::string& val) {value_ = val;}
 
    MetadataTag* Clone()
    {
@@ -121,29 +188,26 @@ public:
    std::string Serialize()
    {
       std::ostringstream os;
-      os << GetName() << std::endl << GetDevice() << std::endl << IsReadOnly() << value_ << std::endl;
+      WriteText(os);
       return os.str();
    }
 
    bool Restore(const char* stream)
    {
       std::istringstream is(stream);
+      return ReadText(is);
+   }
 
-      std::string name;
-      is >> name;
-      SetName(name.c_str());
-
-      std::string device;
-      is >> device;
-      SetDevice(device.c_str());
-
-      bool ro;
-      is >> ro;
-      SetReadOnly(ro);
-
-      is >> value_;
+protected:
+   void WriteText(std::ostream& os) const
+   {
+      WriteTextHeader(os);
+      WriteTextLine(os, value_);
+   }
 
-      return true;
+   bool ReadText(std::istream& is)
+   {
+      return ReadTextHeader(is) && ReadTextLine(is, value_);
    }
 
 private:
@@ -157,6 +221,7 @@ public:
    ~MetadataArrayTag() {}
 
    void AddValue(const char* val) {values_.push_back(val);}
+   void AddValue(const std::string& val) {values_.push_back(val);}
    void SetValue(const char* val, size_t idx)
    {
       if (values_.size() < idx+1)
@@ -170,7 +235,7 @@ public:
       return values_[idx];
    }
 
-   size_t GetSize() {return values_.size();}
+   size_t GetSize() const {return values_.size();}
 
    MetadataTag* Clone()
    {
@@ -180,36 +245,42 @@ public:
    std::string Serialize()
    {
       std::ostringstream os;
-      os << GetName() << std::endl << GetDevice() << std::endl << IsReadOnly() << values_.size();
-      for (size_t i=0; i<values_.size(); i++)
-         os << values_[i];
+      WriteText(os);
       return os.str();
    }
 
    bool Restore(const char* stream)
    {
       std::istringstream is(stream);
+      return ReadText(is);
+   }
 
-      std::string name;
-      is >> name;
-      SetName(name.c_str());
-
-      std::string device;
-      is >> device;
-      SetDevice(device.c_str());
-
-      bool ro;
-      is >> ro;
-      SetReadOnly(ro);
-
-      size_t size;
-      is >> size;
-
-      values_.resize(size);
-
+protected:
+   void WriteText(std::ostream& os) const
+   {
+      WriteTextHeader(os);
+      os << (long) values_.size() << std::endl;
       for (size_t i=0; i<values_.size(); i++)
-         is >> values_[i];
+         WriteTextLine(os, values_[i]);
+   }
 
+   bool ReadText(std::istream& is)
+   {
+      std::string size;
+      if (!ReadTextHeader(is) || !ReadTextLine(is, size))
+         return false;
+
+      long sizea = atol(size.c_str());
+      if (sizea < 0)
+         return false;
+      values_.clear();
+      for (long i=0; i<sizea; i++)
+      {
+         std::string val;
+         if (!ReadTextLine(is, val))
+            return false;
+         values_.push_back(val);
+      }
       return true;
    }
 
@@ -226,6 +297,12 @@ public:
 
    Metadata() {}
 
+   Metadata(const Metadata& original)
+   {
+      for (TagIterator it=original.tags_.begin(); it != original.tags_.end(); it++)
+         SetTag(*it->second);
+   }
+
    ~Metadata()
    {
       Clear();
@@ -254,6 +331,18 @@ public:
       return *stag;
    }
 
+   /**
+    * Returns the single tag with the given key, or 0 if there is none;
+    * unlike GetSingleTag() it never throws, for lookups on every frame.
+    */
+   const MetadataSingleTag* FindSingleTag(const char* key) const
+   {
+      TagIterator it = tags_.find(key);
+      if (it == tags_.end())
+         return 0;
+      return dynamic_cast<const MetadataSingleTag*>(it->second);
+   }
+
    MetadataArrayTag GetArrayTag(const char* key) const throw (MetadataKeyError)
    {
       MetadataTag* tag = FindTag(key);
@@ -287,34 +376,19 @@ public:
       return *this;
    }
 
-   std::string Serialize()
+   /**
+    * Text form of the metadata, one field per line, kept for debugging.
+    * Streamers save the binary form, see SerializeBinary().
+    */
+   std::string Serialize() const
    {
       std::ostringstream os;
 
-      os << tags_.size();
+      os << tags_.size() << std::endl;
       for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
       {
-         std::string id("s");
-         if (dynamic_cast<MetadataArrayTag*>(it->second))
-            id = "a";
-
-         os << id << std::endl;
-         os << it->second->GetName() << std::endl << it->second->GetDevice() << std::endl;
-         os << (it->second->IsReadOnly() ? 1 : 0) << std::endl;
-
-         if (id.compare("s") == 0)
-         {
-            MetadataSingleTag* st = dynamic_cast<MetadataSingleTag*>(it->second);
-            os << st->GetValue() << std::endl;
-         }
-         else
-         {
-            MetadataArrayTag* at = dynamic_cast<MetadataArrayTag*>(it->second);
-
-            os << (long) at->GetSize() << std::endl;
-            for (size_t i=0; i<at->GetSize(); i++)
-               os << at->GetValue(i) << std::endl;
-         }
+         os << (dynamic_cast<MetadataArrayTag*>(it->second) ? "a" : "s") << std::endl;
+         it->second->WriteText(os);
       }
 
       return os.str();
@@ -322,67 +396,117 @@ public:
 
    bool Restore(const char* stream)
    {
-      tags_.clear();
+      Clear();
       std::istringstream is(stream);
-      size_t sz;
-      is >> sz;
-
+      std::string line;
+      if (!MetadataTag::ReadTextLine(is, line))
+         return false;
+
+      // older versions wrote the id of the first tag right after the count
+      size_t sz = (size_t)atol(line.c_str());
+      size_t idPos = line.find_first_not_of("0123456789");
+      std::string id = (idPos == std::string::npos) ? "" : line.substr(idPos);
       for (size_t i=0; i<sz; i++)
       {
-         std::string id;
-         std::string stream;
-         is >> id;
+         if (id.empty() && !MetadataTag::ReadTextLine(is, id))
+            return false;
 
+         MetadataTag* newTag;
          if (id.compare("s") == 0)
+            newTag = new MetadataSingleTag();
+         else if (id.compare("a") == 0)
+            newTag = new MetadataArrayTag();
+         else
+            return false;
+
+         if (!newTag->ReadText(is))
          {
-            MetadataSingleTag ms;
-            std::string strVal;
-            is >> strVal;
-            ms.SetName(strVal.c_str());
-            is >> strVal;
-            ms.SetDevice(strVal.c_str());
-            int ro;
-            is >> ro;
-            ms.SetReadOnly(ro == 1 ? true : false);
-            is >> strVal;
-            ms.SetValue(strVal.c_str());
-
-            MetadataTag* newTag = ms.Clone();
-            tags_[ms.GetName()] = newTag;
+            delete newTag;
+            return false;
          }
-         else if (id.compare("a") == 0)
+         Insert(newTag);
+         id.clear();
+      }
+      return true;
+   }
+
+   /**
+    * Size of the binary form. The binary form holds the tag count followed
+    * by the tags, each with its kind ('s' or 'a'), the read-only flag, the
+    * name, the device and the values; the strings and the number of array
+    * values are prefixed with their length as 4-byte integers in the byte
+    * order of the machine.
+    */
+   size_t GetBinarySize() const
+   {
+      size_t bytes = sizeof(unsigned int);
+      for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
+      {
+         bytes += 2 + 2 * sizeof(unsigned int) + it->second->GetName().size() + it->second->GetDevice().size();
+         if (MetadataArrayTag* at = dynamic_cast<MetadataArrayTag*>(it->second))
          {
-            MetadataArrayTag as;
-            std::string strVal;
-            is >> strVal;
-            as.SetName(strVal.c_str());
-            is >> strVal;
-            as.SetDevice(strVal.c_str());
-            int ro;
-            is >> ro;
-            as.SetReadOnly(ro == 1 ? true : false);
-
-            long sizea;
-            is >> sizea;
-
-            for (long i=0; i<sizea; i++)
-            {
-               is >> strVal;
-               as.AddValue(strVal.c_str());
-            }
-
-            MetadataTag* newTag = as.Clone();
-            tags_[as.GetName()] = newTag;
+            bytes += sizeof(unsigned int);
+            for (size_t i=0; i<at->GetSize(); i++)
+               bytes += sizeof(unsigned int) + at->GetValue(i).size();
          }
          else
+            bytes += sizeof(unsigned int) + static_cast<MetadataSingleTag*>(it->second)->GetValue().size();
+      }
+      return bytes;
+   }
+
+   /**
+    * Writes the binary form, GetBinarySize() bytes, to dst and returns the
+    * number of bytes written.
+    */
+   size_t SerializeBinary(unsigned char* dst) const
+   {
+      unsigned char* p = dst;
+      PutBinary(p, (unsigned int)tags_.size());
+      for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
+      {
+         MetadataArrayTag* at = dynamic_cast<MetadataArrayTag*>(it->second);
+         *p++ = at ? 'a' : 's';
+         *p++ = it->second->IsReadOnly() ? 1 : 0;
+         PutBinary(p, it->second->GetName());
+         PutBinary(p, it->second->GetDevice());
+         if (at)
          {
+            PutBinary(p, (unsigned int)at->GetSize());
+            for (size_t i=0; i<at->GetSize(); i++)
+               PutBinary(p, at->GetValue(i));
+         }
+         else
+            PutBinary(p, static_cast<MetadataSingleTag*>(it->second)->GetValue());
+      }
+      return p - dst;
+   }
+
+   /**
+    * Restores the metadata from its binary form. Returns false, with the
+    * metadata cleared, if the data is truncated or malformed.
+    */
+   bool RestoreBinary(const unsigned char* src, size_t bytes)
+   {
+      Clear();
+      const unsigned char* p = src;
+      const unsigned char* end = src + bytes;
+      unsigned int count = 0;
+      if (!GetBinary(p, end, count))
+         return false;
+
+      for (unsigned int i=0; i<count; i++)
+      {
+         if (!RestoreBinaryTag(p, end))
+         {
+            Clear();
             return false;
          }
       }
       return true;
    }
 
-   std::string Dump()
+   std::string Dump() const
    {
       std::ostringstream os;
 
@@ -409,6 +533,86 @@ private:
          throw MetadataKeyError();
    }
 
+   void Insert(MetadataTag* newTag)
+   {
+      TagIterator it = tags_.find(newTag->GetName());
+      if (it != tags_.end())
+         delete it->second;
+      tags_[newTag->GetName()] = newTag;
+   }
+
+   bool RestoreBinaryTag(const unsigned char*& p, const unsigned char* end)
+   {
+      if (end - p < 2)
+         return false;
+      unsigned char id = *p++;
+      bool readOnly = (*p++ != 0);
+      std::string name, device, value;
+      if (!GetBinary(p, end, name) || !GetBinary(p, end, device))
+         return false;
+
+      if (id == 's')
+      {
+         if (!GetBinary(p, end, value))
+            return false;
+         MetadataSingleTag st(name.c_str(), device.c_str(), readOnly);
+         st.SetValue(value); // may hold NUL characters
+         SetTag(st);
+         return true;
+      }
+      else if (id == 'a')
+      {
+         unsigned int size;
+         if (!GetBinary(p, end, size))
+            return false;
+         MetadataArrayTag at;
+         at.SetName(name.c_str());
+         at.SetDevice(device.c_str());
+         at.SetReadOnly(readOnly);
+         for (unsigned int i=0; i<size; i++)
+         {
+            if (!GetBinary(p, end, value))
+               return false;
+            at.AddValue(value);
+         }
+         SetTag(at);
+         return true;
+      }
+      return false;
+   }
+
+   static void PutBinary(unsigned char*& p, unsigned int value)
+   {
+      memcpy(p, &value, sizeof(value));
+      p += sizeof(value);
+   }
+
+   static void PutBinary(unsigned char*& p, const std::string& value)
+   {
+      PutBinary(p, (unsigned int)value.size());
+      memcpy(p, value.data(), value.size());
+      p += value.size();
+   }
+
+   static bool GetBinary(const unsigned char*& p, const unsigned char* end, unsigned int& value)
+   {
+      if ((size_t)(end - p) < sizeof(value))
+         return false;
+      memcpy(&value, p, sizeof(value));
+      p += sizeof(value);
+      return true;
+   }
+
+   static bool GetBinary(const unsigned char*& p, const unsigned char* end, std::string& value)
+   {
+      unsigned int size;
+      if (!GetBinary(p, end, size) || size > (size_t)(end - p))
+         return false;
+      value.assign((const char*)p, size);
+      p += size;
+      return true;
+   }
+
    std::map<std::string, MetadataTag*> tags_;
    typedef std::map<std::string, MetadataTag*>::const_iterator TagIterator;
 };
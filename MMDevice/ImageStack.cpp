@@ -0,0 +1,254 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        ImageStack.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Memory mapped reader of the multi-frame stack files.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+#include "ImageStack.h"
+#include "ImageCodec.h"
+#include <string.h>
+#include <string>
+
+#ifndef WIN32
+   #include <sys/types.h>
+   #include <sys/stat.h>
+   #include <sys/mman.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
+
+ImageStackReader::ImageStackReader() :
+   base_(0), fileSize_(0), header_(0), index_(0), frameCount_(0),
+#ifdef WIN32
+   file_(INVALID_HANDLE_VALUE), mapping_(0)
+#else
+   file_(-1)
+#endif
+{
+}
+
+ImageStackReader::~ImageStackReader()
+{
+   Close();
+}
+
+/**
+ * Maps the stack file into memory and validates the header and the index.
+ * Returns false if the file can not be mapped or is not a stack file.
+ */
+bool ImageStackReader::Open(const char* fileName)
+{
+   Close();
+
+#ifdef WIN32
+   file_ = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+   if (file_ == INVALID_HANDLE_VALUE)
+      return false;
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(file_, &size))
+   {
+      Close();
+      return false;
+   }
+   fileSize_ = (unsigned long long)size.QuadPart;
+   if (fileSize_ < g_ImageStackHeaderSize)
+   {
+      Close();
+      return false;
+   }
+   mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (mapping_ == 0)
+   {
+      Close();
+      return false;
+   }
+   base_ = (const unsigned char*) MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+#else
+   file_ = open(fileName, O_RDONLY);
+   if (file_ < 0)
+      return false;
+   struct stat st;
+   if (fstat(file_, &st) != 0 || (unsigned long long)st.st_size < g_ImageStackHeaderSize)
+   {
+      Close();
+      return false;
+   }
+   fileSize_ = (unsigned long long)st.st_size;
+   void* p = mmap(0, (size_t)fileSize_, PROT_READ, MAP_SHARED, file_, 0);
+   if (p != MAP_FAILED)
+   {
+      base_ = (const unsigned char*) p;
+      madvise(p, (size_t)fileSize_, MADV_RANDOM); // frames are read in any order
+   }
+#endif
+   if (base_ == 0)
+   {
+      Close();
+      return false;
+   }
+
+   header_ = (const ImageStackHeader*) base_;
+   if (strncmp(header_->magic, g_ImageStackMagic, sizeof(header_->magic)) != 0 ||
+       header_->version > g_ImageStackVersion ||
+       (header_->version > 3 && header_->byteOrder != g_ImageStackByteOrder) ||
+       header_->headerSize < sizeof(ImageStackHeader) || header_->headerSize > fileSize_ ||
+       header_->frameBytes == 0 ||
+       (header_->version > 1 && header_->compression > g_ImageStackImageCodec))
+   {
+      Close();
+      return false;
+   }
+
+   unsigned long long indexOffset = header_->indexOffset;
+   unsigned long long count = header_->frameCount;
+   if (indexOffset != 0 && indexOffset <= fileSize_ &&
+       count <= (fileSize_ - indexOffset) / sizeof(ImageStackIndexEntry))
+   {
+      index_ = (const ImageStackIndexEntry*) (base_ + indexOffset);
+      frameCount_ = count;
+   }
+   else if (IsCompressed())
+   {
+      index_ = 0;
+      RecoverCompressedFrames();
+   }
+   else
+   {
+      // the file was not closed properly: recover the complete frames
+      index_ = 0;
+      frameCount_ = (fileSize_ - header_->headerSize) / header_->frameBytes;
+   }
+
+   return true;
+}
+
+void ImageStackReader::Close()
+{
+#ifdef WIN32
+   if (base_)
+      UnmapViewOfFile(base_);
+   if (mapping_)
+      CloseHandle(mapping_);
+   if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+   mapping_ = 0;
+   file_ = INVALID_HANDLE_VALUE;
+#else
+   if (base_)
+      munmap((void*)base_, (size_t)fileSize_);
+   if (file_ >= 0)
+      close(file_);
+   file_ = -1;
+#endif
+   base_ = 0;
+   header_ = 0;
+   index_ = 0;
+   fileSize_ = 0;
+   frameCount_ = 0;
+   recovered_.clear();
+}
+
+/**
+ * Returns the pixels of the frame, or 0 if the index is out of range or
+ * the file is compressed. The pointer is valid until the reader is closed.
+ */
+const unsigned char* ImageStackReader::GetFrame(unsigned long long index) const
+{
+   if (base_ == 0 || index >= frameCount_ || IsCompressed())
+      return 0;
+
+   unsigned long long offset = FrameOffset(index);
+   if (offset + header_->frameBytes > fileSize_)
+      return 0;
+   return base_ + offset;
+}
+
+/**
+ * Copies the pixels of the frame to dest, which must hold frameBytes.
+ * Compressed frames are decompressed, with the given number of threads.
+ * Returns false if the index is out of range or the frame is damaged.
+ */
+bool ImageStackReader::ReadFrame(unsigned long long index, unsigned char* dest, unsigned threads) const
+{
+   if (base_ == 0 || index >= frameCount_)
+      return false;
+
+   if (!IsCompressed())
+   {
+      const unsigned char* pFrame = GetFrame(index);
+      if (pFrame == 0)
+         return false;
+      memcpy(dest, pFrame, (size_t)header_->frameBytes);
+      return true;
+   }
+
+   unsigned long long offset = FrameOffset(index);
+   if (offset >= fileSize_)
+      return false;
+   return ImageCodec::Decompress(base_ + offset, (size_t)(fileSize_ - offset), dest,
+                                 header_->width, header_->height, header_->depth, threads);
+}
+
+unsigned long long ImageStackReader::FrameOffset(unsigned long long index) const
+{
+   if (index_)
+      return index_[index].frameOffset;
+   if (IsCompressed())
+      return recovered_[(size_t)index];
+   return header_->headerSize + index * header_->frameBytes;
+}
+
+/**
+ * Finds the complete frames of a compressed file that was not closed
+ * properly by following the sizes in the frame headers.
+ */
+void ImageStackReader::RecoverCompressedFrames()
+{
+   recovered_.clear();
+   unsigned long long offset = header_->headerSize;
+   while (offset < fileSize_)
+   {
+      ImageCodecHeader header;
+      if (!ImageCodec::ReadHeader(base_ + offset, (size_t)(fileSize_ - offset), header) ||
+          header.width != header_->width || header.height != header_->height || header.depth != header_->depth)
+         break;
+      recovered_.push_back(offset);
+      offset += header.totalBytes;
+   }
+   frameCount_ = recovered_.size();
+}
+
+/**
+ * Restores the metadata saved with the frame. Returns false if the frame
+ * has no metadata.
+ */
+bool ImageStackReader::GetMetadata(unsigned long long index, Metadata& md) const
+{
+   if (base_ == 0 || index_ == 0 || index >= frameCount_)
+      return false;
+
+   const ImageStackIndexEntry& entry = index_[index];
+   if (entry.metadataBytes == 0 || entry.metadataOffset + entry.metadataBytes > fileSize_)
+      return false;
+
+   if (header_->version < 3)
+   {
+      std::string serialized((const char*)(base_ + entry.metadataOffset), (size_t)entry.metadataBytes);
+      return md.Restore(serialized.c_str());
+   }
+   return md.RestoreBinary(base_ + entry.metadataOffset, (size_t)entry.metadataBytes);
+}
@@ -0,0 +1,134 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        ImageStack.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Multi-frame stack file format and memory mapped reader.
+//
+//                [header]   ImageStackHeader, padded to headerSize bytes
+//                [frames]   frameCount frames of frameBytes each, back to back;
+//                           compressed frames (see ImageCodec.h) are back to
+//                           back in their compressed sizes
+//                [index]    frameCount ImageStackIndexEntry records
+//                [metadata] Metadata of each frame in its binary form,
+//                           see Metadata::SerializeBinary()
+//
+//                All numbers, the pixels included, are in the byte order of
+//                the machine that wrote the file, so that frames and header
+//                are used straight from the mapping. byteOrder records it,
+//                and files of the other byte order are rejected.
+//                indexOffset is written last,
+//                so it is 0 in a file that was not closed properly; the
+//                frames of such a file can still be read, without metadata.
+//                Version 1 files have no compression field and are never
+//                compressed. Files before version 3 hold the metadata in
+//                its text form, see Metadata::Serialize(). Files before
+//                version 4 have no byteOrder field.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+
+#if !defined(_IMAGE_STACK_)
+#define _IMAGE_STACK_
+
+#ifdef WIN32
+   #define WIN32_LEAN_AND_MEAN
+   #include <windows.h>
+#endif
+#include "ImageMetadata.h"
+#include <vector>
+
+const char* const g_ImageStackMagic = "MMSTACK";
+const unsigned int g_ImageStackVersion = 4;
+const unsigned int g_ImageStackHeaderSize = 4096; // keeps the frames aligned for direct I/O
+const unsigned int g_ImageStackByteOrder = 0x01020304; // reads differently in the other byte order
+
+// ImageStackHeader::compression
+const unsigned int g_ImageStackUncompressed = 0;
+const unsigned int g_ImageStackImageCodec = 1;
+
+struct ImageStackHeader
+{
+   char magic[8];                 // "MMSTACK"
+   unsigned int version;
+   unsigned int headerSize;       // offset of the first frame
+   unsigned int width;
+   unsigned int height;
+   unsigned int depth;            // bytes per pixel
+   unsigned int compression;
+   unsigned long long frameBytes; // uncompressed
+   unsigned long long frameCount;
+   unsigned long long indexOffset;
+   unsigned int byteOrder;        // g_ImageStackByteOrder
+};
+
+struct ImageStackIndexEntry
+{
+   unsigned long long frameOffset;
+   unsigned long long metadataOffset;
+   unsigned long long metadataBytes;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ImageStackReader class
+// ~~~~~~~~~~~~~~~~~~~~~~
+// Maps the whole stack file read-only; frames are returned as pointers into
+// the mapping, so any frame is available in constant time and only the
+// pages actually touched are read from disk. Compressed frames are only
+// available through ReadFrame(), which decompresses them.
+//
+
+class ImageStackReader
+{
+public:
+   ImageStackReader();
+   ~ImageStackReader();
+
+   bool Open(const char* fileName);
+   void Close();
+   bool IsOpen() const {return base_ != 0;}
+
+   unsigned Width() const {return header_->width;}
+   unsigned Height() const {return header_->height;}
+   unsigned Depth() const {return header_->depth;}
+   unsigned long long GetFrameCount() const {return frameCount_;}
+   bool IsCompressed() const {return header_->version > 1 && header_->compression != g_ImageStackUncompressed;}
+
+   const unsigned char* GetFrame(unsigned long long index) const;
+   bool ReadFrame(unsigned long long index, unsigned char* dest, unsigned threads = 1) const;
+   bool GetMetadata(unsigned long long index, Metadata& md) const;
+
+private:
+   ImageStackReader(const ImageStackReader&);
+   ImageStackReader& operator=(const ImageStackReader&);
+
+   unsigned long long FrameOffset(unsigned long long index) const;
+   void RecoverCompressedFrames();
+
+   const unsigned char* base_;
+   unsigned long long fileSize_;
+   const ImageStackHeader* header_;
+   const ImageStackIndexEntry* index_; // 0 if the file was not closed properly
+   unsigned long long frameCount_;
+   std::vector<unsigned long long> recovered_; // frame offsets of a compressed file without index
+#ifdef WIN32
+   HANDLE file_;
+   HANDLE mapping_;
+#else
+   int file_;
+#endif
+};
+
+#endif // !defined(_IMAGE_STACK_)
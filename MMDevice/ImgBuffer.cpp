@@ -27,7 +27,7 @@ using namespace std;
 // ImgBuffer class
 //
 ImgBuffer::ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth) :
-   pixels_(0), width_(xSize), height_(ySize), pixDepth_(pixDepth)
+   pixels_(0), ownsPixels_(true), width_(xSize), height_(ySize), pixDepth_(pixDepth), shared_(0), viewValid_(false)
 {
    pixels_ = new unsigned char[xSize * ySize * pixDepth];
    assert(pixels_);
@@ -36,21 +36,49 @@ ImgBuffer::ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth) :
 
 ImgBuffer::ImgBuffer() :
    pixels_(0),
+   ownsPixels_(true),
    width_(0),
    height_(0),
-   pixDepth_(0)
+   pixDepth_(0),
+   shared_(0),
+   viewValid_(false)
 {
 }
 
 ImgBuffer::ImgBuffer(const ImgBuffer& right)                
 {
    pixels_ = 0;
+   ownsPixels_ = true;
+   shared_ = 0;
+   viewValid_ = false;
    *this = right;
 }
 
 ImgBuffer::~ImgBuffer()
 {
-   delete[] pixels_;
+   ReleasePixels();
+}
+
+void ImgBuffer::ReleasePixels()
+{
+   if (ownsPixels_)
+      delete[] pixels_;
+   pixels_ = 0;
+   ownsPixels_ = true;
+}
+
+/**
+ * Makes the image use externally owned memory of at least xSize*ySize*pixDepth bytes.
+ * The memory is neither initialized nor released by the image.
+ */
+void ImgBuffer::AttachPixels(unsigned char* pixels, unsigned xSize, unsigned ySize, unsigned pixDepth)
+{
+   ReleasePixels();
+   pixels_ = pixels;
+   ownsPixels_ = false;
+   width_ = xSize;
+   height_ = ySize;
+   pixDepth_ = pixDepth;
 }
 
 const unsigned char* ImgBuffer::GetPixels() const
@@ -89,7 +117,7 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize, unsigned pixDepth)
    // re-allocate internal buffer if it is not big enough
    if (width_ * height_ * pixDepth_ < xSize * ySize * pixDepth)
    {
-      delete[] pixels_;
+      ReleasePixels();
       pixels_ = new unsigned char [xSize * ySize * pixDepth];
       assert(pixels_);
    }
@@ -104,7 +132,7 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize)
    // re-allocate internal buffer if it is not big enough
    if (width_ * height_ < xSize * ySize)
    {
-      delete[] pixels_;
+      ReleasePixels();
       pixels_ = new unsigned char[xSize * ySize * pixDepth_];
    }
 
@@ -114,6 +142,81 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize)
    memset(pixels_, 0, width_ * height_ * pixDepth_);
 }
 
+/**
+ * Replaces the metadata with the given string tags.
+ */
+void ImgBuffer::SetMetadata(const Metadata& md)
+{
+   shared_ = 0;
+   viewValid_ = false;
+   metadata_.Clear();
+   metadata_.SetTags(md);
+}
+
+/**
+ * Metadata view of the image. Numeric tags are formatted on the first
+ * call after they changed; without them the string tags are returned
+ * as they are.
+ */
+const Metadata& ImgBuffer::GetMetadata() const
+{
+   if (shared_)
+      return shared_->GetMetadata();
+   if (!metadata_.HasNumbers())
+      return metadata_.GetTags();
+
+   MMThreadGuard guard(viewLock_);
+   if (!viewValid_)
+   {
+      metadata_.ToMetadata(view_);
+      viewValid_ = true;
+   }
+   return view_;
+}
+
+void ImgBuffer::ClearMetadata()
+{
+   shared_ = 0;
+   viewValid_ = false;
+   metadata_.Clear();
+}
+
+/**
+ * Sets a numeric tag, without formatting it or allocating memory.
+ */
+void ImgBuffer::SetMetadataNumber(FrameMetadataKey key, double value)
+{
+   shared_ = 0;
+   viewValid_ = false;
+   metadata_.SetNumber(key, value);
+}
+
+const FrameMetadata& ImgBuffer::GetFrameMetadata() const
+{
+   if (shared_)
+      return shared_->GetFrameMetadata();
+   return metadata_;
+}
+
+void ImgBuffer::SetFrameMetadata(const FrameMetadata& md)
+{
+   shared_ = 0;
+   viewValid_ = false;
+   metadata_ = md;
+}
+
+/**
+ * Makes the image report the metadata of the source image, e.g. the other
+ * channels of a frame report the metadata of the first one, which saves a
+ * copy per channel. The source must outlive the sharing; setting the
+ * metadata of this image ends it.
+ */
+void ImgBuffer::ShareMetadata(const ImgBuffer* pSource)
+{
+   shared_ = (pSource == this) ? 0 : pSource;
+   viewValid_ = false;
+}
+
 void ImgBuffer::Copy(const ImgBuffer& right)
 {
    if (!Compatible(right))
@@ -127,13 +230,16 @@ ImgBuffer& ImgBuffer::operator=(const ImgBuffer& img)
    if(this == &img)
       return *this;
 
-   if (pixels_)
-      delete[] pixels_;
+   // attached memory is kept as long as the image fits
+   if (ownsPixels_ || !Compatible(img))
+   {
+      ReleasePixels();
 
-   width_ = img.Width();
-   height_ = img.Height();
-   pixDepth_ = img.Depth();
-   pixels_ = new unsigned char[width_ * height_ * pixDepth_];
+      width_ = img.Width();
+      height_ = img.Height();
+      pixDepth_ = img.Depth();
+      pixels_ = new unsigned char[width_ * height_ * pixDepth_];
+   }
 
    Copy(img);
 
@@ -187,6 +293,25 @@ void FrameBuffer::Preallocate(unsigned channels, unsigned slices)
       }
 }
 
+/**
+ * Creates the images on consecutive regions of externally owned memory,
+ * imageStride bytes apart. Images that already exist are left alone.
+ */
+void FrameBuffer::Preallocate(unsigned channels, unsigned slices, unsigned char* pixels, unsigned long imageStride)
+{
+   for (unsigned i=0; i<channels; i++)
+      for (unsigned j=0; j<slices; j++)
+      {
+         if (FindImage(i, j))
+            continue;
+
+         ImgBuffer* img = new ImgBuffer();
+         img->AttachPixels(pixels + (i * slices + j) * imageStride, width_, height_, depth_);
+         images_.push_back(img);
+         indexMap_[GetIndex(i, j)] = img;
+      }
+}
+
 void FrameBuffer::Resize(unsigned xSize, unsigned ySize, unsigned byteDepth)
 {
    Clear();
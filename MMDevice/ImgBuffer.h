@@ -28,6 +28,8 @@
 #include <map>
 #include "MMDevice.h"
 #include "ImageMetadata.h"
+#include "FrameMetadata.h"
+#include "DeviceThreads.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -54,24 +56,36 @@ public:
 
    void Resize(unsigned xSize, unsigned ySize, unsigned pixDepth);
    void Resize(unsigned xSize, unsigned ySize);
+   void AttachPixels(unsigned char* pixels, unsigned xSize, unsigned ySize, unsigned pixDepth);
    bool Compatible(const ImgBuffer& img) const;
 
    void SetName(const char* name) {name_ = name;}
    const std::string& GetName() {return name_;}
-   void SetMetadata(const Metadata& md) {metadata_ = md;}
-   const Metadata& GetMetadata() const {return metadata_;}
+   void SetMetadata(const Metadata& md);
+   const Metadata& GetMetadata() const;
+   void ClearMetadata();
+   void SetMetadataNumber(FrameMetadataKey key, double value);
+   const FrameMetadata& GetFrameMetadata() const;
+   void SetFrameMetadata(const FrameMetadata& md);
+   void ShareMetadata(const ImgBuffer* pSource);
 
    void Copy(const ImgBuffer& rhs);
    ImgBuffer& operator=(const ImgBuffer& rhs);
 
 private:
+   void ReleasePixels();
+
    unsigned char* pixels_;
+   bool ownsPixels_; // false if pixels_ points into memory supplied with AttachPixels()
    unsigned int width_;
    unsigned int height_;
    unsigned int pixDepth_;
    std::string name_;
-   //MM::ImageMetadata metadata_;
-   Metadata metadata_;
+   FrameMetadata metadata_;
+   const ImgBuffer* shared_;        // image whose metadata this one reports, or 0
+   mutable Metadata view_;          // metadata_ with the numbers formatted
+   mutable bool viewValid_;
+   mutable MMThreadLock viewLock_;
 };
 
 class FrameBuffer
@@ -84,6 +98,7 @@ public:
    void Resize(unsigned xSize, unsigned ySize, unsigned pixDepth);
    void Clear();
    void Preallocate(unsigned channels, unsigned slices);
+   void Preallocate(unsigned channels, unsigned slices, unsigned char* pixels, unsigned long imageStride);
 
    bool SetImage(unsigned channel, unsigned slice, const ImgBuffer& img);
    bool GetImage(unsigned channel, unsigned slice, ImgBuffer& img) const;
@@ -34,7 +34,7 @@
 // Header version
 // If any of the class declarations changes, the interface version
 // must be incremented
-#define DEVICE_INTERFACE_VERSION 31
+#define DEVICE_INTERFACE_VERSION 40
 ///////////////////////////////////////////////////////////////////////////////
 
 #pragma once
@@ -56,6 +56,7 @@
 #define HDEVMODULE void*
 
 class Metadata;
+class FrameMetadata;
 class ImgBuffer;
 
 namespace MM {
@@ -522,21 +523,34 @@ namespace MM {
 
    /**
     * Streaming API.
+    * The core calls SaveImage() from its writer thread for each image of the
+    * sequence, between OpenContext() and CloseContext(). The buffer is owned
+    * by the core and is valid only for the duration of the call.
     */
    class ImageStreamer : public Device
    {
    public:
-      ImageStreamer();
-      virtual ~ImageStreamer();
+      ImageStreamer() {}
+      virtual ~ImageStreamer() {}
 
       // MM Device API
       virtual DeviceType GetType() const {return ImageStreamerDevice;}
       static const DeviceType Type = ImageStreamerDevice;
 
       // image streaming API
-      virtual int OpenContext(unsigned width, unsigned height, unsigned depth, const char* path, const Metadata* contextMd = 0);
-      virtual int CloseContext();
-      virtual int SaveImage(unsigned char* buffer, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd = 0);
+      virtual int OpenContext(unsigned width, unsigned height, unsigned depth, const char* path, const Metadata* contextMd = 0) = 0;
+      virtual int CloseContext() = 0;
+      virtual int SaveImage(unsigned char* buffer, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd = 0) = 0;
+      /**
+       * True if the open context takes images compressed with ImageCodec,
+       * so that the caller may compress them before SaveCompressedImage().
+       */
+      virtual bool AcceptsCompressedImages() = 0;
+      /**
+       * Saves an image compressed with ImageCodec. The image has the given
+       * format once decompressed.
+       */
+      virtual int SaveCompressedImage(const unsigned char* data, size_t bytes, unsigned width, unsigned height, unsigned depth, const Metadata* imageMd = 0) = 0;
    };
 
    /**
@@ -554,6 +568,27 @@ namespace MM {
 
       // image processor API
       virtual int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth) = 0;
+
+      /**
+       * Reports the format of the images produced from images of the given
+       * format, or DEVICE_UNSUPPORTED_DATA_FORMAT if the input is not supported.
+       * A processor changing the format must implement ProcessInto().
+       */
+      virtual int GetOutputFormat(unsigned width, unsigned height, unsigned byteDepth,
+                                  unsigned& outWidth, unsigned& outHeight, unsigned& outByteDepth) = 0;
+      /**
+       * True if the processor writes to a separate destination more efficiently
+       * than in place, so that the caller should use ProcessInto().
+       */
+      virtual bool PrefersProcessInto() = 0;
+      /**
+       * Out-of-place processing: reads src and writes dst, which has the format
+       * reported by GetOutputFormat(). The buffers do not overlap.
+       * A processor combining several images returns DEVICE_IMAGE_ACCUMULATED
+       * while it has no output yet; the processor chain then drops the frame.
+       */
+      virtual int ProcessInto(const unsigned char* src, unsigned width, unsigned height, unsigned byteDepth,
+                              unsigned char* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstByteDepth) = 0;
    };
 
    /**
@@ -629,9 +664,26 @@ namespace MM {
       virtual int InsertImage(const Device* caller, const ImgBuffer& buf) = 0;
       virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* md = 0) = 0;
       virtual void ClearImageBuffer(const Device* caller) = 0;
-      virtual bool InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth) = 0;
+      virtual bool InitializeImageBuffer(const Device* caller, unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth) = 0;
       virtual int InsertMultiChannel(const Device* caller, const unsigned char* buf, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, Metadata* md = 0) = 0;
       virtual void SetAcqStatus(const Device* caller, int statusCode) = 0;
+      /**
+       * Hands the camera a writable pointer to the next free slot in the
+       * circular buffer, so the frame can be read out directly into it.
+       * The slot becomes visible to the consumers only after CommitImageSlot().
+       * A slot that is not committed is handed out again on the next call.
+       * Returns DEVICE_BUFFER_OVERFLOW if the buffer is full.
+       */
+      virtual int AcquireImageSlot(const Device* caller, unsigned width, unsigned height, unsigned byteDepth, unsigned char*& pSlot) = 0;
+      /**
+       * Publishes the slot obtained with AcquireImageSlot().
+       */
+      virtual int CommitImageSlot(const Device* caller, const Metadata* md = 0) = 0;
+      /**
+       * Publishes the slot with numeric metadata, which the core formats
+       * only if a consumer asks for it.
+       */
+      virtual int CommitImageSlot(const Device* caller, const FrameMetadata& md) = 0;
 
       // autofocus
       virtual const char* GetImage() = 0;
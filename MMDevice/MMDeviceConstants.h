@@ -69,6 +69,7 @@
 #define DEVICE_CAMERA_BUSY_ACQUIRING   30
 #define DEVICE_INCOMPATIBLE_IMAGE      31
 #define DEVICE_CAN_NOT_SET_PROPERTY    32
+#define DEVICE_IMAGE_ACCUMULATED       33
 
 
 namespace MM {
@@ -130,6 +131,12 @@ namespace MM {
    const char* const g_Keyword_Metadata_Score       = "Score";
    const char* const g_Keyword_Metadata_ImageNumber = "ImageNumber";
    const char* const g_Keyword_Metadata_StartTime   = "StartTime-ms";
+   const char* const g_Keyword_Metadata_Interval    = "FrameInterval-ms";
+   const char* const g_Keyword_Metadata_Lateness    = "FrameLateness-ms";
+   const char* const g_Keyword_Metadata_DeviceFrameCounter = "DeviceFrameCounter";
+   const char* const g_Keyword_Metadata_DeviceTimestamp    = "DeviceTimestamp-us";
+   const char* const g_Keyword_Metadata_DeviceFramesBehind = "DeviceFramesBehind";
+   const char* const g_Keyword_Metadata_ReceivedTime       = "ReceivedTime-ms";
 
    // configuration file format constants
    const char* const g_FieldDelimiters = ",";
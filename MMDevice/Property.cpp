@@ -303,14 +303,18 @@ MM::PropertyCollection::PropertyCollection()
 
 MM::PropertyCollection::~PropertyCollection()
 {
-   CPropArray::const_iterator it;
-   for (it = properties_.begin(); it != properties_.end(); it++)
-      delete it->second;
+   for (size_t i=0; i<properties_.size(); i++)
+      delete properties_[i];
 }
 
 int MM::PropertyCollection::Set(const char* pszPropName, const char* pszValue)
 {
-   MM::Property* pProp = Find(pszPropName);
+   return SetByHandle(GetHandle(pszPropName), pszValue);
+}
+
+int MM::PropertyCollection::SetByHandle(int handle, const char* pszValue)
+{
+   MM::Property* pProp = FindByHandle(handle);
    if (!pProp)
       return DEVICE_INVALID_PROPERTY; // name not found
 
@@ -333,7 +337,12 @@ int MM::PropertyCollection::Set(const char* pszPropName, const char* pszValue)
 
 int MM::PropertyCollection::Get(const char* pszPropName, string& strValue) const
 {
-   MM::Property* pProp = Find(pszPropName);
+   return GetByHandle(GetHandle(pszPropName), strValue);
+}
+
+int MM::PropertyCollection::GetByHandle(int handle, string& strValue) const
+{
+   MM::Property* pProp = FindByHandle(handle);
    if (!pProp)
       return DEVICE_INVALID_PROPERTY; // name not found
 
@@ -349,19 +358,44 @@ int MM::PropertyCollection::Get(const char* pszPropName, string& strValue) const
 
 MM::Property* MM::PropertyCollection::Find(const char* pszName) const
 {
-   CPropArray::const_iterator it = properties_.find(pszName);
-   if (it == properties_.end())
+   return FindByHandle(GetHandle(pszName));
+}
+
+/**
+ * Returns the handle of the property, or -1 if there is no such property.
+ * Handles stay valid for the lifetime of the collection, so callers that
+ * access a property often can keep the handle and skip the name lookup.
+ */
+int MM::PropertyCollection::GetHandle(const char* pszName) const
+{
+   if (buckets_.empty())
+      return -1;
+
+   size_t mask = buckets_.size() - 1;
+   for (size_t i = Hash(pszName) & mask; buckets_[i] >= 0; i = (i + 1) & mask)
+   {
+      if (names_[buckets_[i]].compare(pszName) == 0)
+         return buckets_[i];
+   }
+   return -1; // not found
+}
+
+MM::Property* MM::PropertyCollection::FindByHandle(int handle) const
+{
+   if (handle < 0 || handle >= (int)properties_.size())
       return 0; // not found
-   return it->second;
+   return properties_[handle];
 }
 
+/**
+ * Returns the names in alphabetical order, the order of the indices.
+ */
 vector<string> MM::PropertyCollection::GetNames() const
 {
    vector<string> nameList;
-
-   CPropArray::const_iterator it;
-   for (it = properties_.begin(); it != properties_.end(); it++)
-      nameList.push_back(it->first);
+   nameList.reserve(sorted_.size());
+   for (size_t i=0; i<sorted_.size(); i++)
+      nameList.push_back(names_[sorted_[i]]);
 
    return nameList;
 }
@@ -402,7 +436,24 @@ int MM::PropertyCollection::CreateProperty(const char* pszName, const char* pszV
       return false;
    pProp->SetReadOnly(bReadOnly);
    pProp->SetInitStatus(initStatus);
-   properties_[pszName] = pProp;
+
+   int handle = (int)properties_.size();
+   properties_.push_back(pProp);
+   names_.push_back(pszName);
+   vector<int>::iterator pos = sorted_.begin();
+   while (pos != sorted_.end() && names_[*pos].compare(pszName) < 0)
+      pos++;
+   sorted_.insert(pos, handle);
+   if (2 * properties_.size() > buckets_.size())
+      Rehash(buckets_.empty() ? 32 : 2 * buckets_.size());
+   else
+   {
+      size_t mask = buckets_.size() - 1;
+      size_t i = Hash(pszName) & mask;
+      while (buckets_[i] >= 0)
+         i = (i + 1) & mask;
+      buckets_[i] = handle;
+   }
 
    // asign action functor
    pProp->RegisterAction(pAct);
@@ -471,13 +522,10 @@ int MM::PropertyCollection::GetCurrentPropertyData(const char* name, long& data)
 
 bool MM::PropertyCollection::GetName(unsigned uIdx, string& strName) const
 {
-   if (uIdx >= properties_.size())
+   if (uIdx >= sorted_.size())
       return false; // unknown index
 
-   CPropArray::const_iterator it = properties_.begin();
-   for (unsigned i=0; i<uIdx; i++)
-      it++;
-   strName = it->first;
+   strName = names_[sorted_[uIdx]];
    return true;
 }
 
@@ -494,11 +542,10 @@ int MM::PropertyCollection::RegisterAction(const char* pszName, MM::ActionFuncto
 
 int MM::PropertyCollection::UpdateAll()
 {
-   CPropArray::const_iterator it;
-   for (it=properties_.begin(); it!=properties_.end(); it++)
+   for (size_t i=0; i<sorted_.size(); i++)
    {
       int nRet;
-      nRet = it->second->Update();
+      nRet = properties_[sorted_[i]]->Update();
       if (nRet != DEVICE_OK)
          return nRet;
    }
@@ -507,11 +554,10 @@ int MM::PropertyCollection::UpdateAll()
 
 int MM::PropertyCollection::ApplyAll()
 {
-   CPropArray::const_iterator it;
-   for (it=properties_.begin(); it!=properties_.end(); it++)
+   for (size_t i=0; i<sorted_.size(); i++)
    {
       int nRet;
-      nRet = it->second->Apply();
+      nRet = properties_[sorted_[i]]->Apply();
       if (nRet != DEVICE_OK)
          return nRet;
    }
@@ -535,3 +581,33 @@ int MM::PropertyCollection::Apply(const char* pszName)
 
       return pProp->Apply();
 }
+
+/**
+ * FNV-1a hash of the name.
+ */
+unsigned MM::PropertyCollection::Hash(const char* pszName)
+{
+   unsigned hash = 2166136261u;
+   for (const unsigned char* p = (const unsigned char*)pszName; *p; p++)
+   {
+      hash ^= *p;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+/**
+ * Rebuilds the hash table with the given number of buckets, a power of 2.
+ */
+void MM::PropertyCollection::Rehash(size_t buckets)
+{
+   buckets_.assign(buckets, -1);
+   size_t mask = buckets - 1;
+   for (size_t handle=0; handle<names_.size(); handle++)
+   {
+      size_t i = Hash(names_[handle].c_str()) & mask;
+      while (buckets_[i] >= 0)
+         i = (i + 1) & mask;
+      buckets_[i] = (int)handle;
+   }
+}
@@ -322,6 +322,11 @@ public:
    int Update(const char* Name);
    int Apply(const char* Name);
 
+   int GetHandle(const char* name) const;
+   Property* FindByHandle(int handle) const;
+   int SetByHandle(int handle, const char* value);
+   int GetByHandle(int handle, std::string& val) const;
+
 private:
    /*
    template <typename T>
@@ -329,8 +334,14 @@ private:
    template <typename T>
    int SetVal(const char* PropName, const T val);
    */
-   typedef std::map<std::string, Property*> CPropArray;
-   CPropArray properties_;
+   static unsigned Hash(const char* name);
+   void Rehash(size_t buckets);
+
+   // the handle of a property is its position in the order of creation
+   std::vector<Property*> properties_; // by handle
+   std::vector<std::string> names_;    // by handle
+   std::vector<int> sorted_;           // handles in the order of the names, by index
+   std::vector<int> buckets_;          // open addressing table of handles, -1 if empty
 };
 
 /*
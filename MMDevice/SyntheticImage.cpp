@@ -0,0 +1,230 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        SyntheticImage.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Fast generator of the moving sine pattern used by the demo
+//                cameras.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+#include "SyntheticImage.h"
+#include <math.h>
+
+const double cPi = 3.14;                 // the pattern has always used this
+const double cTwoPi = 6.283185307179586; // period of sin()
+
+/**
+ * Worker that lives as long as the thread setting of the generator and fills
+ * a band of rows each time one is handed to it. The band is posted to the
+ * start semaphore, completion is posted to the shared done semaphore.
+ */
+class SyntheticImageGenerator::RowThread : public MMDeviceThreadBase
+{
+public:
+   RowThread(const SyntheticImageGenerator* pGen, MMThreadSemaphore* pDone) :
+      gen_(pGen), done_(pDone), firstRow_(0), lastRow_(0), quit_(false) {}
+
+   int svc()
+   {
+      for (;;)
+      {
+         start_.Wait();
+         if (quit_)
+            break;
+         gen_->FillRows(frame_, firstRow_, lastRow_);
+         done_->Post();
+      }
+      return 0;
+   }
+
+   void Start(const Frame& frame, unsigned firstRow, unsigned lastRow)
+   {
+      frame_ = frame;
+      firstRow_ = firstRow;
+      lastRow_ = lastRow;
+      start_.Post();
+   }
+
+   void Quit()
+   {
+      quit_ = true;
+      start_.Post();
+      wait();
+   }
+
+private:
+   const SyntheticImageGenerator* gen_;
+   MMThreadSemaphore start_;
+   MMThreadSemaphore* done_;
+   Frame frame_;
+   unsigned firstRow_;
+   unsigned lastRow_;
+   bool quit_;
+};
+
+SyntheticImageGenerator::SyntheticImageGenerator() :
+   phase_(0.0), threads_(1)
+{
+}
+
+SyntheticImageGenerator::~SyntheticImageGenerator()
+{
+   StopWorkers();
+}
+
+/**
+ * Sets the number of threads sharing the rows of a frame. The calling
+ * thread counts as one; the others are started here and kept until the
+ * setting changes.
+ */
+void SyntheticImageGenerator::SetThreads(unsigned threads)
+{
+   threads = threads > 0 ? threads : 1;
+   if (threads == threads_)
+      return;
+
+   StopWorkers();
+   threads_ = threads;
+   for (unsigned i=1; i<threads_; i++)
+   {
+      RowThread* pWorker = new RowThread(this, &bandsDone_);
+      pWorker->activate();
+      workers_.push_back(pWorker);
+   }
+}
+
+void SyntheticImageGenerator::StopWorkers()
+{
+   for (unsigned i=0; i<workers_.size(); i++)
+   {
+      workers_[i]->Quit();
+      delete workers_[i];
+   }
+   workers_.clear();
+}
+
+/**
+ * Generates the next frame of the pattern. The amplitude and the pedestal
+ * follow the exposure; 8-bit images saturate at 255, 16-bit images at
+ * maxValue.
+ */
+void SyntheticImageGenerator::Generate(unsigned char* pBuf, unsigned width, unsigned height, unsigned byteDepth, double exp, unsigned maxValue)
+{
+   if (width == 0 || height == 0 || (byteDepth != 1 && byteDepth != 2))
+      return;
+
+   if (sinTable_.size() != width)
+      BuildTables(width);
+
+   Frame frame;
+   frame.pBuf = pBuf;
+   frame.width = width;
+   frame.height = height;
+   frame.byteDepth = byteDepth;
+   frame.phase = phase_;
+   frame.linePhaseInc = 2.0 * cPi / 4.0 / height;
+   if (byteDepth == 1)
+   {
+      frame.pedestal = (float)(127 * exp / 100.0);
+      frame.amplitude = (float)exp;
+      frame.maxValue = 255.0f;
+   }
+   else
+   {
+      frame.pedestal = (float)(maxValue / 2 * exp / 100.0);
+      frame.amplitude = (float)(exp * maxValue / 255.0); // scale to behave like 8-bit
+      frame.maxValue = (float)maxValue;
+   }
+
+   unsigned threads = threads_ < height ? threads_ : height;
+   if (threads <= 1)
+   {
+      FillRows(frame, 0, height);
+   }
+   else
+   {
+      unsigned rowsPerThread = (height + threads - 1) / threads;
+      unsigned bands = 0;
+      for (unsigned first = rowsPerThread; first < height; first += rowsPerThread)
+      {
+         unsigned last = first + rowsPerThread < height ? first + rowsPerThread : height;
+         workers_[bands++]->Start(frame, first, last);
+      }
+      FillRows(frame, 0, rowsPerThread);
+      for (unsigned i=0; i<bands; i++)
+         bandsDone_.Wait();
+   }
+
+   phase_ = fmod(phase_ + cPi / 4.0, cTwoPi);
+}
+
+/**
+ * Tabulates the sine and cosine of the phase along x.
+ */
+void SyntheticImageGenerator::BuildTables(unsigned width)
+{
+   long period = width / 2 > 0 ? width / 2 : 1;
+   sinTable_.resize(width);
+   cosTable_.resize(width);
+   for (unsigned k=0; k<width; k++)
+   {
+      double x = (2.0 * cPi * k) / period;
+      sinTable_[k] = (float)sin(x);
+      cosTable_[k] = (float)cos(x);
+   }
+}
+
+/**
+ * Fills rows [firstRow, lastRow). The inner loops are free of branches and
+ * function calls so that they can be vectorized.
+ */
+void SyntheticImageGenerator::FillRows(const Frame& frame, unsigned firstRow, unsigned lastRow) const
+{
+   const float* sinX = &sinTable_[0];
+   const float* cosX = &cosTable_[0];
+   const unsigned width = frame.width;
+   const float pedestal = frame.pedestal;
+   const float maxValue = frame.maxValue;
+
+   for (unsigned j=firstRow; j<lastRow; j++)
+   {
+      double rowPhase = frame.phase + j * frame.linePhaseInc;
+      const float a = (float)(frame.amplitude * cos(rowPhase));
+      const float b = (float)(frame.amplitude * sin(rowPhase));
+
+      if (frame.byteDepth == 1)
+      {
+         unsigned char* pRow = frame.pBuf + (size_t)width * j;
+         for (unsigned k=0; k<width; k++)
+         {
+            float v = pedestal + a * sinX[k] + b * cosX[k];
+            v = v > 0.0f ? v : 0.0f;
+            v = v < maxValue ? v : maxValue;
+            pRow[k] = (unsigned char)v;
+         }
+      }
+      else
+      {
+         unsigned short* pRow = (unsigned short*)frame.pBuf + (size_t)width * j;
+         for (unsigned k=0; k<width; k++)
+         {
+            float v = pedestal + a * sinX[k] + b * cosX[k];
+            v = v > 0.0f ? v : 0.0f;
+            v = v < maxValue ? v : maxValue;
+            pRow[k] = (unsigned short)v;
+         }
+      }
+   }
+}
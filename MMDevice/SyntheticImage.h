@@ -0,0 +1,84 @@
+///////////////////////////////////////////////////////////////////////////////
+// MODULE:        SyntheticImage.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//
+// DESCRIPTION:   Fast generator of the moving sine pattern used by the demo
+//                cameras.
+//
+// COPYRIGHT:     University of California, San Francisco, 2009
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+///////////////////////////////////////////////////////////////////////////////
+
+#if !defined(_SYNTHETIC_IMAGE_)
+#define _SYNTHETIC_IMAGE_
+
+#include "DeviceThreads.h"
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SyntheticImageGenerator class
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Each row of the pattern is the same sine wave along x, shifted by a phase
+// that grows with the row and with every generated frame. Using
+// sin(a + b) = sin(a)cos(b) + cos(a)sin(b), the sine and cosine along x are
+// tabulated once per image width and each row is filled with two multiply-
+// adds per pixel, a loop the compiler turns into SIMD code. Rows can be
+// split over several threads, which are kept between frames.
+//
+
+class SyntheticImageGenerator
+{
+public:
+   SyntheticImageGenerator();
+   ~SyntheticImageGenerator();
+
+   void SetThreads(unsigned threads);
+   unsigned GetThreads() const {return threads_;}
+
+   void Generate(unsigned char* pBuf, unsigned width, unsigned height, unsigned byteDepth, double exp, unsigned maxValue);
+
+private:
+   class RowThread;
+   friend class RowThread;
+
+   struct Frame
+   {
+      unsigned char* pBuf;
+      unsigned width;
+      unsigned height;
+      unsigned byteDepth;
+      double phase;          // of the first row
+      double linePhaseInc;   // from row to row
+      float pedestal;
+      float amplitude;
+      float maxValue;
+   };
+
+   SyntheticImageGenerator(const SyntheticImageGenerator&);
+   SyntheticImageGenerator& operator=(const SyntheticImageGenerator&);
+
+   void BuildTables(unsigned width);
+   void FillRows(const Frame& frame, unsigned firstRow, unsigned lastRow) const;
+   void StopWorkers();
+
+   std::vector<float> sinTable_;
+   std::vector<float> cosTable_;
+   double phase_;
+   unsigned threads_;
+   std::vector<RowThread*> workers_; // threads_ - 1, the caller fills the first band
+   MMThreadSemaphore bandsDone_;
+};
+
+#endif // !defined(_SYNTHETIC_IMAGE_)
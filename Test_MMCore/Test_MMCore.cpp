@@ -26,7 +26,9 @@
 
 
 #include "../MMCore/MMCore.h"
+#include "../MMCore/CircularBuffer.h"
 #include "../MMDevice/ImageMetadata.h"
+#include "../MMDevice/ImageStack.h"
 #define ACE_NTRACE 0
 #define ACE_NDEBUG 0
 
@@ -41,6 +43,7 @@ using namespace std;
 
 #pragma warning(disable : 4312 4244)
 #include "ace/Task.h"
+#include <ace/High_Res_Timer.h>
 #include <ace/Mutex.h>
 #include <ace/Guard_T.h>
 #include <ace/Log_Msg.h>
@@ -56,6 +59,14 @@ void TestPixelSize(CMMCore& core);
 void TestColorMode(CMMCore& core);
 void TestHam(CMMCore& core);
 void TestCameraLive(CMMCore& core);
+void TestBufferInsertLatency(CMMCore& core);
+void TestMultiCameraStreaming(CMMCore& core);
+void TestImageStreaming(CMMCore& core);
+void TestProcessorChain(CMMCore& core);
+void TestFrameAverager(CMMCore& core);
+void TestMetadataSerialization();
+void TestFrameTiming(CMMCore& core);
+void TestSystemState(CMMCore& core);
 
 /**
  * Creates MMCore object, loads configuration, prints the status and performs
@@ -110,6 +121,14 @@ int main(int argc, char* argv[])
       TestCameraStreaming(core);
       // TestColorMode(core);
       // TestCameraLive(core);
+      //TestBufferInsertLatency(core);
+      //TestMultiCameraStreaming(core);
+      //TestImageStreaming(core);
+      //TestProcessorChain(core);
+      //TestFrameAverager(core);
+      //TestMetadataSerialization();
+      //TestFrameTiming(core);
+      //TestSystemState(core);
       //TestPixelSize(core);
       //TestHam(core);
 
@@ -379,3 +398,514 @@ void TestCameraLive(CMMCore& core)
    //core.setProperty(camera.c_str(), "ShutterMode", "Auto");
 
 }
+
+class PopTask : public ACE_Task_Base
+{
+public:
+   PopTask(CircularBuffer* pBuf, long numFrames) : buf_(pBuf), numFrames_(numFrames), popped_(0)
+   {
+      copy_.resize(pBuf->Width() * pBuf->Height() * pBuf->Depth());
+   }
+
+   virtual int svc (void)
+   {
+      // drain the buffer as fast as possible, copying each frame out
+      // the same way the Java layer does; in the overwrite mode the
+      // frames the producer dropped never arrive
+      while (popped_ + buf_->GetDroppedFrames() < numFrames_ || buf_->GetRemainingImageCount() > 0)
+      {
+         const unsigned char* pBuf = buf_->GetNextImage();
+         if (pBuf != 0)
+         {
+            memcpy(&copy_[0], pBuf, copy_.size());
+            popped_++;
+         }
+      }
+      return 0;
+   }
+
+   long Popped() const {return popped_;}
+
+private:
+   CircularBuffer* buf_;
+   long numFrames_;
+   long popped_;
+   vector<unsigned char> copy_;
+};
+
+/**
+ * Stress test for the circular buffer with the MMConfig_Demo.cfg.
+ * Pushes 512x512x2 frames obtained from the demo camera into the buffer
+ * while a second thread pops them, and reports the worst-case insert
+ * latency in the mutex protected and in the lock-free mode, each with
+ * stopping on overflow and with overwriting (live mode). In the overwrite
+ * mode no insert may fail, and every frame is either popped or dropped.
+ */
+void TestBufferInsertLatency(CMMCore& core)
+{
+   const long numFrames = 5000;
+   const unsigned memoryFootprintMB = 100;
+
+   string camera = core.getCameraDevice();
+   core.setProperty(camera.c_str(), "Binning", "1");
+   core.setProperty(camera.c_str(), "PixelType", "16bit");
+   core.setExposure(0.0);
+   core.snapImage();
+   const unsigned char* pFrame = (const unsigned char*) core.getImage();
+   unsigned width = core.getImageWidth();
+   unsigned height = core.getImageHeight();
+   unsigned depth = core.getBytesPerPixel();
+
+   for (int mode=0; mode<4; mode++)
+   {
+      bool lockFree = (mode & 1) != 0;
+      bool overwrite = (mode & 2) != 0;
+      CircularBuffer cbuf(memoryFootprintMB);
+      cbuf.SetLockFree(lockFree);
+      if (!cbuf.Initialize(1, 1, width, height, depth))
+      {
+         cout << "Failed to initialize circular buffer." << endl;
+         return;
+      }
+      cbuf.SetOverwrite(overwrite);
+
+      PopTask popper(&cbuf, numFrames);
+      popper.activate();
+
+      ACE_hrtime_t maxUs = 0;
+      ACE_hrtime_t totalUs = 0;
+      long overflows = 0;
+      for (long i=0; i<numFrames; i++)
+      {
+         ACE_High_Res_Timer timer;
+         ACE_hrtime_t us = 0;
+         bool inserted = false;
+         while (!inserted)
+         {
+            timer.start();
+            inserted = cbuf.InsertImage(pFrame, width, height, depth, 0);
+            timer.stop();
+            if (!inserted)
+               overflows++;
+         }
+         timer.elapsed_microseconds(us);
+         totalUs += us;
+         if (us > maxUs)
+            maxUs = us;
+      }
+      popper.wait();
+
+      printf("%s, %s: %ld frames %ux%ux%u, insert latency mean %.1f us, max %.1f us, %ld overflows, %ld popped, %ld dropped\n",
+             cbuf.IsLockFree() ? "Lock-free" : "Locked", cbuf.IsOverwrite() ? "overwrite" : "stop on overflow",
+             numFrames, width, height, depth, (double)totalUs / numFrames, (double)maxUs,
+             overflows, popper.Popped(), cbuf.GetDroppedFrames());
+      if (overwrite)
+         assert(overflows == 0 && popper.Popped() + cbuf.GetDroppedFrames() == numFrames);
+   }
+}
+
+/**
+ * Streams all cameras in the configuration at the same time and drains
+ * each one from its own circular buffer.
+ * Requires a configuration with at least two cameras, e.g. two DemoCameras.
+ */
+void TestMultiCameraStreaming(CMMCore& core)
+{
+   const long numFrames = 200;
+   const double intervalMs = 0.0;
+
+   vector<string> cameras = core.getLoadedDevicesOfType(MM::CameraDevice);
+   if (cameras.size() < 2)
+   {
+      cout << "Multi-camera test requires at least two cameras." << endl;
+      return;
+   }
+
+   // the current camera keeps using the default buffer
+   core.intializeCircularBuffer();
+   for (size_t i=0; i<cameras.size(); i++)
+      core.startSequenceAcquisition(cameras[i].c_str(), numFrames, intervalMs, true);
+
+   vector<long> received(cameras.size(), 0);
+   bool running = true;
+   while (running)
+   {
+      running = false;
+      for (size_t i=0; i<cameras.size(); i++)
+      {
+         const char* label = cameras[i].c_str();
+         while (core.getRemainingImageCount(label) > 0)
+         {
+            core.popNextImage(label);
+            received[i]++;
+         }
+         if (core.isSequenceRunning(label) || core.getRemainingImageCount(label) > 0)
+            running = true;
+      }
+   }
+
+   for (size_t i=0; i<cameras.size(); i++)
+      printf("%s: received %ld of %ld frames\n", cameras[i].c_str(), received[i], numFrames);
+}
+
+/**
+ * Streams a sequence to a stack file through the core writer thread and
+ * reads it back in random order, once uncompressed and once compressed by
+ * the core threads.
+ * Requires the "Raw Streamer" from the Utilities library loaded as "Streamer".
+ */
+void TestImageStreaming(CMMCore& core)
+{
+   const long numFrames = 500;
+   const char* streamer = "Streamer";
+   const char* compression[] = {"None", "Lossless"};
+
+   core.setProperty(streamer, "FileFormat", "Stack");
+   core.setImageStreamingThreads(4);
+   for (int c=0; c<2; c++)
+   {
+      core.setProperty(streamer, "Compression", compression[c]);
+      core.startSequenceAcquisition(numFrames, 0.0, true);
+      core.startImageStreaming(streamer, "Test_MMCore_stream");
+
+      ACE_High_Res_Timer timer;
+      timer.start();
+      while (core.isSequenceRunning())
+         core.sleep(10);
+      core.stopImageStreaming();
+      timer.stop();
+      ACE_hrtime_t us = 0;
+      timer.elapsed_microseconds(us);
+
+      long saved = core.getStreamedImageCount();
+      size_t frameBytes = (size_t)core.getImageWidth() * core.getImageHeight() * core.getBytesPerPixel();
+      double mb = (double)saved * frameBytes / 1048576.0;
+      printf("Compression %s: streamed %ld of %ld images, %.1f MB/s\n", compression[c], saved, numFrames, mb * 1e6 / (double)us);
+
+      ImageStackReader reader;
+      if (!reader.Open("Test_MMCore_stream.mmstack"))
+      {
+         cout << "Failed to open the stack file." << endl;
+         return;
+      }
+      std::vector<unsigned char> pixels(frameBytes);
+      long withMetadata = 0, failures = 0;
+      for (unsigned long long i=reader.GetFrameCount(); i>0; i--)
+      {
+         Metadata md;
+         bool read = reader.ReadFrame(i-1, &pixels[0], 4);
+         if (!read)
+            failures++;
+         if (reader.GetMetadata(i-1, md))
+            withMetadata++;
+      }
+      printf("Read back %llu frames, %ld with metadata, %ld failures, %s\n", reader.GetFrameCount(), withMetadata,
+             failures, reader.IsCompressed() ? "compressed" : "uncompressed");
+      assert(failures == 0);
+   }
+}
+
+/**
+ * Runs a sequence through a chain of image processors and reports the time
+ * each processor spends on a frame. Assumes that the configuration defines
+ * the image processors "Processor" and "Processor2".
+ */
+void TestProcessorChain(CMMCore& core)
+{
+   const long numFrames = 200;
+
+   vector<string> chain;
+   chain.push_back("Processor");
+   chain.push_back("Processor2");
+   core.setImageProcessorChain(chain);
+
+   core.startSequenceAcquisition(numFrames, 0.0, true);
+   long popped = 0;
+   while (core.isSequenceRunning() || core.getRemainingImageCount() > 0)
+   {
+      if (core.getRemainingImageCount() > 0)
+      {
+         core.popNextImage();
+         popped++;
+      }
+      else
+         core.sleep(1);
+   }
+
+   for (size_t i=0; i<chain.size(); i++)
+   {
+      printf("%s: %ld frames, %ld errors, mean %.2f ms, max %.2f ms\n", chain[i].c_str(),
+             core.getImageProcessorFrameCount(chain[i].c_str()), core.getImageProcessorErrorCount(chain[i].c_str()),
+             core.getImageProcessorMeanMs(chain[i].c_str()), core.getImageProcessorMaxMs(chain[i].c_str()));
+   }
+   printf("Popped %ld of %ld processed images\n", popped, numFrames);
+
+   core.setImageProcessorChain(vector<string>());
+}
+
+/**
+ * Averages every 10 frames of a sequence with 2x2 binning and reports how
+ * many frames reach the buffer, one per 10 is expected. Assumes that the configuration
+ * defines the "Frame Averager" device with the label "Averager".
+ */
+void TestFrameAverager(CMMCore& core)
+{
+   const long numFrames = 200;
+   const long averaged = 10; // the Frames property
+
+   core.setProperty("Averager", "Frames", "10");
+   core.setProperty("Averager", "Binning", "2");
+   vector<string> chain;
+   chain.push_back("Averager");
+   core.setImageProcessorChain(chain);
+
+   core.startSequenceAcquisition(numFrames, 0.0, true);
+   long popped = 0;
+   while (core.isSequenceRunning() || core.getRemainingImageCount() > 0)
+   {
+      if (core.getRemainingImageCount() > 0)
+      {
+         core.popNextImage();
+         popped++;
+      }
+      else
+         core.sleep(1);
+   }
+
+   printf("Buffer images %ux%u, camera images %ux%u\n", core.getBufferImageWidth(), core.getBufferImageHeight(),
+          core.getImageWidth(), core.getImageHeight());
+   printf("Popped %ld images, expected %ld\n", popped, numFrames / averaged);
+
+   core.setImageProcessorChain(vector<string>());
+}
+
+/**
+ * Random string of up to maxLength characters, including white space, line
+ * breaks and backslashes.
+ */
+static string RandomMetadataString(size_t maxLength)
+{
+   const char special[] = " \t\r\n\\";
+   string s;
+   size_t length = rand() % (maxLength + 1);
+   for (size_t i=0; i<length; i++)
+   {
+      if (rand() % 4 == 0)
+         s += special[rand() % (sizeof(special) - 1)];
+      else
+         s += (char)(1 + rand() % 255);
+   }
+   return s;
+}
+
+static void RandomMetadata(Metadata& md)
+{
+   md.Clear();
+   int tags = rand() % 8;
+   for (int i=0; i<tags; i++)
+   {
+      string name = RandomMetadataString(12);
+      string device = RandomMetadataString(8);
+      bool readOnly = (rand() % 2 == 0);
+      if (rand() % 3 == 0)
+      {
+         MetadataArrayTag at;
+         at.SetName(name.c_str());
+         at.SetDevice(device.c_str());
+         at.SetReadOnly(readOnly);
+         int values = rand() % 5;
+         for (int j=0; j<values; j++)
+            at.AddValue(RandomMetadataString(16).c_str());
+         md.SetTag(at);
+      }
+      else
+      {
+         MetadataSingleTag st(name.c_str(), device.c_str(), readOnly);
+         st.SetValue(RandomMetadataString(16).c_str());
+         md.SetTag(st);
+      }
+   }
+}
+
+static vector<unsigned char> BinaryMetadata(const Metadata& md)
+{
+   vector<unsigned char> data(md.GetBinarySize());
+   size_t bytes = md.SerializeBinary(&data[0]);
+   assert(bytes == data.size());
+   data.resize(bytes);
+   return data;
+}
+
+/**
+ * Round trips random metadata through the binary and the text form,
+ * restores truncated and corrupted binary data and compares the speed of
+ * the two forms. Needs no devices.
+ */
+void TestMetadataSerialization()
+{
+   const int rounds = 10000;
+   srand(1);
+
+   long failures = 0;
+   for (int r=0; r<rounds; r++)
+   {
+      Metadata md;
+      RandomMetadata(md);
+      vector<unsigned char> data = BinaryMetadata(md);
+
+      Metadata binary;
+      bool restored = binary.RestoreBinary(&data[0], data.size());
+      if (!restored || BinaryMetadata(binary) != data)
+         failures++;
+
+      Metadata text;
+      restored = text.Restore(md.Serialize().c_str());
+      if (!restored || BinaryMetadata(text) != data)
+         failures++;
+
+      // every truncation is detected
+      for (size_t bytes=0; bytes<data.size(); bytes++)
+      {
+         restored = binary.RestoreBinary(&data[0], bytes);
+         if (restored)
+            failures++;
+      }
+
+      // corrupted data must not crash, it may or may not restore
+      for (int i=0; i<8; i++)
+      {
+         vector<unsigned char> corrupted(data);
+         corrupted[rand() % corrupted.size()] = (unsigned char)rand();
+         binary.RestoreBinary(&corrupted[0], corrupted.size());
+      }
+   }
+
+   // text written before the text form was made line based
+   Metadata legacy;
+   bool restored = legacy.Restore("1s\nExposure\nCamera\n1\n10\n");
+   const MetadataSingleTag* pExposure = legacy.FindSingleTag("Exposure");
+   if (!restored || pExposure == 0 || pExposure->GetValue().compare("10") != 0 || !pExposure->IsReadOnly())
+      failures++;
+
+   // the binary form keeps values with embedded NUL characters
+   const string nulValue("a\0b", 3);
+   Metadata nul;
+   MetadataSingleTag nulSingle("Single", "Camera", false);
+   nulSingle.SetValue(nulValue);
+   nul.SetTag(nulSingle);
+   MetadataArrayTag nulArray;
+   nulArray.SetName("Array");
+   nulArray.AddValue(nulValue);
+   nul.SetTag(nulArray);
+   vector<unsigned char> nulData = BinaryMetadata(nul);
+   Metadata nulRestored;
+   restored = nulRestored.RestoreBinary(&nulData[0], nulData.size());
+   const MetadataSingleTag* pSingle = nulRestored.FindSingleTag("Single");
+   if (!restored || pSingle == 0 || pSingle->GetValue() != nulValue)
+      failures++;
+   else if (nulRestored.GetArrayTag("Array").GetSize() != 1 || nulRestored.GetArrayTag("Array").GetValue(0) != nulValue)
+      failures++;
+   printf("Metadata serialization: %ld failures\n", failures);
+   assert(failures == 0);
+
+   // a typical frame
+   Metadata md;
+   for (int i=0; i<6; i++)
+   {
+      ostringstream name;
+      name << "Tag-" << i;
+      MetadataSingleTag st(name.str().c_str(), "Camera", true);
+      st.SetValue("1234.56");
+      md.SetTag(st);
+   }
+   vector<unsigned char> data(md.GetBinarySize());
+   ACE_High_Res_Timer timer;
+   ACE_hrtime_t binaryUs = 0, textUs = 0;
+   timer.start();
+   for (int r=0; r<rounds; r++)
+   {
+      Metadata restored;
+      md.SerializeBinary(&data[0]);
+      restored.RestoreBinary(&data[0], data.size());
+   }
+   timer.stop();
+   timer.elapsed_microseconds(binaryUs);
+   timer.start();
+   for (int r=0; r<rounds; r++)
+   {
+      Metadata restored;
+      restored.Restore(md.Serialize().c_str());
+   }
+   timer.stop();
+   timer.elapsed_microseconds(textUs);
+   printf("Metadata round trip: binary %.2f us, text %.2f us\n", (double)binaryUs / rounds, (double)textUs / rounds);
+}
+
+/**
+ * Runs a sequence and reconstructs its timing from the standard frame
+ * tags: gaps in the device frame counter are dropped frames, the receive
+ * time minus the device timestamp is the time from the start of a frame to
+ * its arrival in the core. Cameras whose driver queues frames also report
+ * how many frames waited behind each one.
+ * Assumes that the camera derives from CCameraBase or fills the tags.
+ */
+void TestFrameTiming(CMMCore& core)
+{
+   const long numFrames = 200;
+
+   core.startSequenceAcquisition(numFrames, 0.0, false);
+   long popped = 0, dropped = 0, previous = -1, maxBehind = -1;
+   double maxLatencyMs = 0.0, sumLatencyMs = 0.0;
+   while (core.isSequenceRunning() || core.getRemainingImageCount() > 0)
+   {
+      if (core.getRemainingImageCount() == 0)
+      {
+         core.sleep(1);
+         continue;
+      }
+
+      Metadata md;
+      core.popNextImageMD(0, 0, md);
+      long counter = atol(md.GetSingleTag(MM::g_Keyword_Metadata_DeviceFrameCounter).GetValue().c_str());
+      double deviceMs = atof(md.GetSingleTag(MM::g_Keyword_Metadata_DeviceTimestamp).GetValue().c_str()) / 1000.0;
+      double receivedMs = atof(md.GetSingleTag(MM::g_Keyword_Metadata_ReceivedTime).GetValue().c_str());
+      if (previous >= 0)
+         dropped += counter - previous - 1;
+      previous = counter;
+      const MetadataSingleTag* pBehind = md.FindSingleTag(MM::g_Keyword_Metadata_DeviceFramesBehind);
+      if (pBehind && atol(pBehind->GetValue().c_str()) > maxBehind)
+         maxBehind = atol(pBehind->GetValue().c_str());
+
+      double latencyMs = receivedMs - deviceMs;
+      sumLatencyMs += latencyMs;
+      if (latencyMs > maxLatencyMs)
+         maxLatencyMs = latencyMs;
+      popped++;
+   }
+
+   printf("Popped %ld of %ld frames, %ld dropped by the buffer\n", popped, numFrames, dropped);
+   if (maxBehind >= 0)
+      printf("Up to %ld frames waited in the driver\n", maxBehind);
+   if (popped > 0)
+      printf("Frame start to receive mean %.2f ms, max %.2f ms\n", sumLatencyMs / popped, maxLatencyMs);
+}
+
+/**
+ * Reports the time to snapshot the state of all loaded devices, as done
+ * for every frame of a multi-dimensional acquisition.
+ */
+void TestSystemState(CMMCore& core)
+{
+   const int rounds = 1000;
+
+   ACE_High_Res_Timer timer;
+   timer.start();
+   size_t settings = 0;
+   for (int r=0; r<rounds; r++)
+      settings = core.getSystemState().size();
+   timer.stop();
+   ACE_hrtime_t us = 0;
+   timer.elapsed_microseconds(us);
+   printf("System state of %ld devices, %ld properties: %.1f us\n", (long)core.getLoadedDevices().size(),
+          (long)settings, (double)us / rounds);
+}